@@ -9,6 +9,12 @@
  * Copyright (C) CERN 2012-2024
  */
 
+/*
+ * features (needed for statx and friends)
+ */
+
+#define _GNU_SOURCE
+
 /*
  * includes
  */
@@ -17,11 +23,14 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -29,14 +38,32 @@
 #include <time.h>
 #include <unistd.h>
 #include <utime.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/xattr.h>
+#endif
 
 #include "dirq.h"
+#include "dirq_async.h"
+#include "dirq_checkpoint.h"
 #include "dirq_clock.h"
+#include "dirq_count.h"
 #include "dirq_error.h"
 #include "dirq_iter.h"
+#include "dirq_local.h"
 #include "dirq_low.h"
+#include "dirq_maint.h"
+#include "dirq_meta.h"
 #include "dirq_misc.h"
+#include "dirq_mux.h"
 #include "dirq_oo.h"
+#include "dirq_packed.h"
+#include "dirq_prefetch.h"
+#include "dirq_purge.h"
+#include "dirq_set.h"
+#include "dirq_tier.h"
 
 /*
  * constants
@@ -47,6 +74,12 @@
 #define DIR_NAME_LENGTH   8
 #define ELT_NAME_LENGTH  14
 #define ELEMENT_LENGTH   (DIR_NAME_LENGTH + 1 + ELT_NAME_LENGTH)
+#define TIME_KEY_LENGTH  13
+#define ATTEMPTS_XATTR   "user.dirq.attempts"
+#define META_XATTR       "user.dirq.meta."
+#define META_SUFFIX      ".mta"
+#define ATTEMPTS_SUFFIX  ".att"
+#define SEGMENT_SUFFIX   ".seg"
 
 /*
  * macros
@@ -58,33 +91,44 @@
 #define TMP2NAME(_d) (_d->buffer + _d->tmp2_offset + _d->pathlen + 1)
 
 /*
- * dirq_add(DIRQ, BUFFER, LENGTH): NAME success | NULL error
+ * write data (via callback) into a new temporary path (left in tmp1)
+ * (using the given insertion time or, if NULL, the current time) and
+ * tell how many bytes have been written
  */
 
-const char *dirq_add (dirq_t dirq, dirq_iow callback)
+static int _add_data (dirq_t dirq, dirq_iow callback, struct timespec *when,
+                      off_t *size)
 {
   char *tmppath;
-  int fd, result, offset, done;
+  int fd, result, offset, done, restored;
   char buffer[8192];
 
   tmppath = TMP1BUF(dirq);
   /* setup the insertion directory */
-  result = set_insertion_directory(dirq);
+  result = set_insertion_directory(dirq, when);
   if (result != 0)
-    return(NULL);
+    return(-1);
   /* create new path to hold data */
+  restored = 0;
   while (1) {
-    set_new_name(dirq, dirq->tmp1_offset);
+    set_new_name(dirq, dirq->tmp1_offset, NULL);
     strcpy(TMP1NAME(dirq) + ELEMENT_LENGTH, TEMPORARY_SUFFIX);
     fd = open(tmppath, O_WRONLY|O_CREAT|O_EXCL, 0666);
     if (fd >= 0)
       break;
+    if (errno == ENOENT && !restored) {
+      restored = 1;
+      if (restore_insertion_directory(dirq, dirq->tmp1_offset) != 0)
+        return(-1);
+      continue;
+    }
     if (errno != EEXIST) {
       error_set(dirq, errno, "cannot open(%s): %s", tmppath, ERROR);
-      return(NULL);
+      return(-1);
     }
   }
   /* save data into new path */
+  *size = 0;
   while (1) {
     result = callback(dirq, buffer, sizeof(buffer));
     if (result == 0)
@@ -92,7 +136,7 @@ const char *dirq_add (dirq_t dirq, dirq_iow callback)
     if (result < 0) {
       error_set(dirq, result, "cannot write(%s): %d", tmppath, result);
       (void) close(fd); /* best effort cleanup... */
-      return(NULL);
+      return(-1);
     }
     offset = 0;
     while (offset < result) {
@@ -100,20 +144,120 @@ const char *dirq_add (dirq_t dirq, dirq_iow callback)
       if (done < 0) {
         error_set(dirq, result, "cannot write(%s): %s", tmppath, ERROR);
         (void) close(fd); /* best effort cleanup... */
-        return(NULL);
+        return(-1);
       }
       offset += done;
     }
+    *size += result;
   }
   if (close(fd) != 0) {
       error_set(dirq, errno, "cannot close(%s): %s", tmppath, ERROR);
+      return(-1);
+  }
+  return(0);
+}
+
+/*
+ * add data (via callback) with the given insertion time (NULL means now)
+ */
+
+static const char *_add (dirq_t dirq, dirq_iow callback, struct timespec *when)
+{
+  off_t size;
+
+  if (dirq->packed) {
+    if (!when)
+      return(packed_add(dirq, callback));
+    packed_unsupported(dirq, "add_at");
+    return(NULL);
+  }
+  if (dirq->tier && !when && tier_accept(dirq))
+    return(tier_add(dirq, callback));
+  if (_add_data(dirq, callback, when, &size) != 0)
+    return(NULL);
+  if (add_temporary_path(dirq, TMP1BUF(dirq), when, size) != 0)
+    return(NULL);
+  return(TMP2NAME(dirq));
+}
+
+/*
+ * dirq_add(DIRQ, CALLBACK): NAME success | NULL error
+ */
+
+const char *dirq_add (dirq_t dirq, dirq_iow callback)
+{
+  int result;
+
+  /* the element may be refused (or shed) if the queue is full */
+  if (count_admit(dirq) != 0)
+    return(NULL);
+  if (dirq->local) {
+    /* the queue is only used when the ring is full */
+    result = local_add(dirq, callback);
+    if (result == 0)
+      return(TMP2NAME(dirq));
+    if (result < 0)
       return(NULL);
   }
-  /* add the newly created path */
-  result = add_temporary_path(dirq, tmppath);
+  return(_add(dirq, callback, NULL));
+}
+
+/*
+ * dirq_add_at(DIRQ, CALLBACK, TIME): NAME success | NULL error
+ */
+
+const char *dirq_add_at (dirq_t dirq, dirq_iow callback,
+                         const struct timespec *ts)
+{
+  struct timespec when;
+
+  if (count_admit(dirq) != 0)
+    return(NULL);
+  memcpy((void *)&when, (const void *)ts, sizeof(when));
+  return(_add(dirq, callback, &when));
+}
+
+/*
+ * dirq_add_delayed(DIRQ, CALLBACK, DELAY): NAME success | NULL error
+ */
+
+const char *dirq_add_delayed (dirq_t dirq, dirq_iow callback, int delay)
+{
+  struct timespec when;
+
+  if (count_admit(dirq) != 0)
+    return(NULL);
+  dirq_now(dirq, &when);
+  when.tv_sec += (delay < 0) ? 0 : delay;
+  return(_add(dirq, callback, &when));
+}
+
+/*
+ * dirq_add_meta(DIRQ, CALLBACK, META): NAME success | NULL error
+ */
+
+const char *dirq_add_meta (dirq_t dirq, dirq_iow callback, const char **meta)
+{
+  off_t size;
+  int result;
+
+  if (dirq->packed) {
+    packed_unsupported(dirq, "add_meta");
+    return(NULL);
+  }
+  if (count_admit(dirq) != 0)
+    return(NULL);
+  if (_add_data(dirq, callback, NULL, &size) != 0)
+    return(NULL);
+  result = meta_set(dirq, TMP1BUF(dirq), meta);
+  if (result < 0)
+    return(NULL);
+  if (result == 0)
+    result = add_temporary_path(dirq, TMP1BUF(dirq), NULL, size);
+  else
+    result = meta_add_with_sidecar(dirq, TMP1BUF(dirq), meta, size);
   if (result != 0)
     return(NULL);
-  /* return the element name */
   return(TMP2NAME(dirq));
 }
 
@@ -125,12 +269,18 @@ const char *dirq_add_path (dirq_t dirq, const char *path)
 {
   int result;
 
+  if (dirq->packed) {
+    packed_unsupported(dirq, "add_path");
+    return(NULL);
+  }
+  if (count_admit(dirq) != 0)
+    return(NULL);
   /* setup the insertion directory */
-  result = set_insertion_directory(dirq);
+  result = set_insertion_directory(dirq, NULL);
   if (result != 0)
     return(NULL);
   /* directly add the path (that must be on the same filesystem) */
-  result = add_temporary_path(dirq, path);
+  result = add_temporary_path(dirq, path, NULL, count_size(dirq, path));
   if (result != 0)
     return(NULL);
   /* return the element name */
@@ -138,12 +288,174 @@ const char *dirq_add_path (dirq_t dirq, const char *path)
 }
 
 /*
- * dirq_lock(DIRQ, NAME, FLAG): 0 success | -1 error | 1 failed but permissive
+ * link the given temporary path (on the given device) into the fast tier of the
+ * queue if it can hold it or else into the queue itself, whose insertion
+ * directory may already have been setup: QUEUE holding it | NULL error
  */
 
-int dirq_lock (dirq_t dirq, const char *name, int permissive)
+static dirq_t _fanout_link (dirq_t dirq, const char *path, dev_t dev,
+                            int ready)
 {
+  dirq_t fast;
+
+  if (dirq->tier && dirq->tier->dev == dev && tier_accept(dirq)) {
+    fast = dirq->tier->fast;
+    if (set_insertion_directory(fast, NULL) != 0 ||
+        link_temporary_path(fast, path, NULL) != 0) {
+      tier_error(dirq, -1);
+      return(NULL);
+    }
+    strcpy(TMP2NAME(dirq), TMP2NAME(fast));
+    return(fast);
+  }
+  if (!ready && set_insertion_directory(dirq, NULL) != 0)
+    return(NULL);
+  if (link_temporary_path(dirq, path, NULL) != 0)
+    return(NULL);
+  return(dirq);
+}
+
+/*
+ * dirq_add_fanout(DIRQS, COUNT, CALLBACK, NAMES): 0 success | -1 error
+ */
+
+int dirq_add_fanout (dirq_t *dirqs, int count, dirq_iow callback,
+                     const char **names)
+{
+  char tmppath[MAXPATHLEN], path[MAXPATHLEN];
+  struct stat sb;
+  dirq_t *targets;
+  off_t size;
+  int i, result;
+
+  for (i = 0; i < count; i++)
+    names[i] = NULL;
+  if (count <= 0)
+    return(0);
+  for (i = 0; i < count; i++) {
+    if (dirqs[i]->packed)
+      return(packed_unsupported(dirqs[i], "add_fanout"));
+    if (dirqs[i]->lanes) {
+      /* the consumers of the lanes would never see the element */
+      error_set(dirqs[i], EINVAL, "cannot add_fanout(%s): %s",
+                dirqs[i]->buffer, "queue with lanes, use one of its lanes");
+      return(-1);
+    }
+  }
+  /* all or nothing: every queue must accept it */
+  for (i = 0; i < count; i++)
+    if (count_admit(dirqs[i]) != 0)
+      return(-1);
+  /* write the data only once, in the first queue */
+  if (_add_data(dirqs[0], callback, NULL, &size) != 0)
+    return(-1);
+  /* tmp1 will be overwritten when setting up the insertion directories */
+  strcpy(tmppath, TMP1BUF(dirqs[0]));
+  if (stat(tmppath, &sb) != 0) {
+    error_set(dirqs[0], errno, "cannot stat(%s): %s", tmppath, ERROR);
+    (void) unlink(tmppath); /* best effort cleanup... */
+    return(-1);
+  }
+  /* link it in all the queues (that must be on the same filesystem) */
+  targets = (dirq_t *)safe_malloc(count * sizeof(dirq_t));
+  result = 0;
+  for (i = 0; i < count; i++) {
+    targets[i] = _fanout_link(dirqs[i], tmppath, sb.st_dev, i == 0);
+    if (!targets[i]) {
+      result = -1;
+      break;
+    }
+    count_update(targets[i], 1, size);
+    names[i] = TMP2NAME(dirqs[i]);
+  }
+  if (result != 0) {
+    /* all or nothing: remove the elements already added */
+    while (i-- > 0) {
+      snprintf(path, sizeof(path), "%s/%s", targets[i]->buffer, names[i]);
+      if (unlink(path) == 0)
+        count_update(targets[i], -1, -size);
+      names[i] = NULL;
+    }
+  }
+  free((void *)targets);
+  if (unlink(tmppath) != 0 && result == 0) {
+    error_set(dirqs[0], errno, "cannot unlink(%s): %s", tmppath, ERROR);
+    result = -1;
+  }
+  return(result);
+}
+
+/*
+ * move a locked element to another queue (the insertion directory of the
+ * destination queue must have been setup)
+ */
+
+static int _move (dirq_t src, dirq_t dst, const char *name)
+{
+  char path[MAXPATHLEN];
+  dirq_t fast;
+
   assert(strlen(name) == ELEMENT_LENGTH);
+  if (src->tier && (fast = tier_route(src, name)))
+    return(tier_error(src, _move(fast, dst, name)));
+  snprintf(path, sizeof(path), "%s/%s", src->buffer, name);
+  /* the element (that must be on the same filesystem) is added as is */
+  if (move_element(src, dst, path) != 0)
+    return(-1);
+  /* and then the lock is removed */
+  strcat(path, LOCKED_SUFFIX);
+  if (unlink(path) != 0) {
+    error_set(src, errno, "cannot unlink(%s): %s", path, ERROR);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * dirq_move(SRC, DST, NAME): NAME success | NULL error
+ */
+
+const char *dirq_move (dirq_t src, dirq_t dst, const char *name)
+{
+  if (src->packed || dst->packed) {
+    packed_unsupported(src->packed ? src : dst, "move");
+    return(NULL);
+  }
+  if (set_insertion_directory(dst, NULL) != 0)
+    return(NULL);
+  if (_move(src, dst, name) != 0)
+    return(NULL);
+  return(TMP2NAME(dst));
+}
+
+/*
+ * dirq_move_batch(SRC, DST, NAMES, COUNT): COUNT moved
+ */
+
+int dirq_move_batch (dirq_t src, dirq_t dst, const char **names, int count)
+{
+  int i;
+
+  if (src->packed || dst->packed) {
+    packed_unsupported(src->packed ? src : dst, "move");
+    return(0);
+  }
+  if (count <= 0 || set_insertion_directory(dst, NULL) != 0)
+    return(0);
+  for (i = 0; i < count; i++)
+    if (_move(src, dst, names[i]) != 0)
+      break;
+  return(i);
+}
+
+/*
+ * lock the given element without counting a delivery attempt (the element
+ * path is left in tmp1 and the lock path in tmp2): 0 success | -1 error | 1
+ * failed but permissive
+ */
+
+static int lock_element (dirq_t dirq, const char *name, int permissive)
+{
   strcpy(TMP1NAME(dirq), name);
   strcpy(TMP2NAME(dirq), name);
   strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, LOCKED_SUFFIX);
@@ -166,13 +478,63 @@ int dirq_lock (dirq_t dirq, const char *name, int permissive)
   return(0);
 }
 
+/*
+ * dirq_lock(DIRQ, NAME, FLAG): 0 success | -1 error | 1 failed but permissive
+ */
+
+int dirq_lock (dirq_t dirq, const char *name, int permissive)
+{
+  dirq_t fast;
+  int attempts, result;
+
+  assert(strlen(name) == ELEMENT_LENGTH);
+  if (dirq->tier && (fast = tier_route(dirq, name)))
+    return(tier_error(dirq, dirq_lock(fast, name, permissive)));
+  if (dirq->packed)
+    return(packed_lock(dirq, name, permissive));
+  result = lock_element(dirq, name, permissive);
+  if (result != 0)
+    return(result);
+  /* count the delivery attempts if there is a dead letter queue */
+  if (dirq->deadletter) {
+    attempts = get_attempts(dirq, TMP1BUF(dirq)) + 1;
+    if (attempts <= dirq->maxattempts) {
+      set_attempts(dirq, TMP1BUF(dirq), attempts);
+      return(0);
+    }
+    /* too many attempts: move it to the dead letter queue and unlock it */
+    if (move_to_deadletter(dirq, TMP1BUF(dirq)) != 0) {
+      error_set(dirq, dirq_get_errcode(dirq->deadletter), "%s",
+                dirq_get_errstr(dirq->deadletter));
+      (void) unlink(TMP2BUF(dirq)); /* best effort cleanup... */
+      return(-1);
+    }
+    if (unlink(TMP2BUF(dirq)) != 0) {
+      error_set(dirq, errno, "cannot unlink(%s): %s", TMP2BUF(dirq), ERROR);
+      return(-1);
+    }
+    if (permissive)
+      return(1);
+    error_set(dirq, ENOENT, "cannot lock(%s): moved to dead letter queue",
+              TMP1BUF(dirq));
+    return(-1);
+  }
+  return(0);
+}
+
 /*
  * dirq_unlock(DIRQ, NAME, FLAG): 0 success | -1 error | 1 failed but permissive
  */
 
 int dirq_unlock (dirq_t dirq, const char *name, int permissive)
 {
+  dirq_t fast;
+
   assert(strlen(name) == ELEMENT_LENGTH);
+  if (dirq->tier && (fast = tier_route(dirq, name)))
+    return(tier_error(dirq, dirq_unlock(fast, name, permissive)));
+  if (dirq->packed)
+    return(packed_unlock(dirq, name, permissive));
   strcpy(TMP2NAME(dirq), name);
   strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, LOCKED_SUFFIX);
   if (unlink(TMP2BUF(dirq)) != 0) {
@@ -190,14 +552,23 @@ int dirq_unlock (dirq_t dirq, const char *name, int permissive)
 
 int dirq_remove (dirq_t dirq, const char *name)
 {
+  dirq_t fast;
+  off_t size;
+
   assert(strlen(name) == ELEMENT_LENGTH);
+  if (dirq->tier && (fast = tier_route(dirq, name)))
+    return(tier_error(dirq, dirq_remove(fast, name)));
+  if (dirq->packed)
+    return(packed_remove(dirq, name));
   strcpy(TMP1NAME(dirq), name);
   strcpy(TMP2NAME(dirq), name);
   strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, LOCKED_SUFFIX);
+  size = count_size(dirq, TMP1BUF(dirq));
   if (unlink(TMP1BUF(dirq)) != 0) {
     error_set(dirq, errno, "cannot unlink(%s): %s", TMP1BUF(dirq), ERROR);
     return(-1);
   }
+  count_update(dirq, -1, -size);
   if (unlink(TMP2BUF(dirq)) != 0) {
     error_set(dirq, errno, "cannot unlink(%s): %s", TMP2BUF(dirq), ERROR);
     return(-1);
@@ -212,11 +583,16 @@ int dirq_remove (dirq_t dirq, const char *name)
 int dirq_get (dirq_t dirq, const char *name, dirq_ior callback)
 {
   char *lckpath;
+  dirq_t fast;
   int fd, result, done;
   char buffer[8192];
 
-  lckpath = TMP2BUF(dirq);
   assert(strlen(name) == ELEMENT_LENGTH);
+  if (dirq->tier && (fast = tier_route(dirq, name)))
+    return(tier_error(dirq, dirq_get(fast, name, callback)));
+  if (dirq->packed)
+    return(packed_get(dirq, name, callback));
+  lckpath = TMP2BUF(dirq);
   strcpy(TMP2NAME(dirq), name);
   strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, LOCKED_SUFFIX);
   fd = open(lckpath, O_RDONLY);
@@ -253,7 +629,13 @@ int dirq_get (dirq_t dirq, const char *name, dirq_ior callback)
 
 int dirq_touch (dirq_t dirq, const char *name)
 {
+  dirq_t fast;
+
   assert(strlen(name) == ELEMENT_LENGTH);
+  if (dirq->tier && (fast = tier_route(dirq, name)))
+    return(tier_error(dirq, dirq_touch(fast, name)));
+  if (dirq->packed)
+    return(0); /* records have no time stamp of their own */
   strcpy(TMP1NAME(dirq), name);
   if (utimes(TMP1BUF(dirq), NULL) != 0) {
     error_set(dirq, errno, "cannot utimes(%s, NULL): %s", TMP1BUF(dirq), ERROR);
@@ -269,8 +651,13 @@ int dirq_touch (dirq_t dirq, const char *name)
 int dirq_get_size (dirq_t dirq, const char *name)
 {
   struct stat ss;
+  dirq_t fast;
 
   assert(strlen(name) == ELEMENT_LENGTH);
+  if (dirq->tier && (fast = tier_route(dirq, name)))
+    return(tier_error(dirq, dirq_get_size(fast, name)));
+  if (dirq->packed)
+    return(packed_get_size(dirq, name));
   strcpy(TMP1NAME(dirq), name);
   if (stat(TMP1BUF(dirq), &ss) != 0) {
     error_set(dirq, errno, "cannot stat(%s): %s", TMP1BUF(dirq), ERROR);
@@ -285,12 +672,18 @@ int dirq_get_size (dirq_t dirq, const char *name)
 
 const char *dirq_get_path (dirq_t dirq, const char *name)
 {
+  dirq_t fast;
+
   if (name == NULL) {
     /* get dirq path */
     return(dirq->buffer);
   } else {
     /* get element path */
     assert(strlen(name) == ELEMENT_LENGTH);
+    if (dirq->tier && (fast = tier_route(dirq, name)))
+      return(dirq_get_path(fast, name));
+    if (dirq->packed)
+      return(packed_path(dirq, name, name + DIR_NAME_LENGTH + 1));
     strcpy(TMP2NAME(dirq), name);
     strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, LOCKED_SUFFIX);
     return(TMP2BUF(dirq));
@@ -301,9 +694,21 @@ const char *dirq_get_path (dirq_t dirq, const char *name)
  * include code split into multiple files for maintenance purposes
  */
 
+#include "dirq_async.c"
+#include "dirq_checkpoint.c"
 #include "dirq_clock.c"
+#include "dirq_count.c"
 #include "dirq_error.c"
 #include "dirq_iter.c"
+#include "dirq_local.c"
 #include "dirq_low.c"
+#include "dirq_maint.c"
+#include "dirq_meta.c"
 #include "dirq_misc.c"
+#include "dirq_mux.c"
 #include "dirq_oo.c"
+#include "dirq_packed.c"
+#include "dirq_prefetch.c"
+#include "dirq_purge.c"
+#include "dirq_set.c"
+#include "dirq_tier.c"
@@ -0,0 +1,234 @@
+/*+*****************************************************************************
+*                                                                              *
+* C implementation of the simple directory queue algorithm                     *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+#ifndef _DIRQ_H
+#define _DIRQ_H 1
+
+/*
+ * includes
+ */
+
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * C++ compatibility
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*** BEGIN SYNOPSIS ***/
+
+/*
+ * constants
+ */
+
+#define DIRQ_VERSION_MAJOR 0
+#define DIRQ_VERSION_MINOR 5
+#define DIRQ_VERSION_HEX ((DIRQ_VERSION_MAJOR << 8) | DIRQ_VERSION_MINOR)
+
+#define DIRQ_TYPE_SIMPLE 0
+#define DIRQ_TYPE_PACKED 1
+
+#define DIRQ_ASYNC_BLOCK 0
+#define DIRQ_ASYNC_FAIL  1
+#define DIRQ_ASYNC_DROP  2
+
+#define DIRQ_FULL_BLOCK 0
+#define DIRQ_FULL_FAIL  1
+#define DIRQ_FULL_SHED  2
+
+#define DIRQ_ORDER_FIFO 0
+#define DIRQ_ORDER_NONE 1
+#define DIRQ_ORDER_LIFO 2
+
+/*
+ * types
+ */
+
+typedef struct dirq_s *dirq_t;
+typedef int (*dirq_iow)(dirq_t, char *, size_t);
+typedef int (*dirq_ior)(dirq_t, const char *, size_t);
+typedef void (*dirq_done)(dirq_t, long, const char *);
+typedef struct dirq_stats_s {
+  unsigned long steps;    /* number of purge steps */
+  unsigned long passes;   /* number of completed purge passes */
+  unsigned long purged;   /* number of elements or directories purged */
+  unsigned long errors;   /* number of errors */
+  unsigned long migrated; /* number of elements migrated from the tier */
+  int           errcode;  /* code of the last error */
+  time_t        last;     /* completion time of the last purge pass */
+} dirq_stats_t;
+typedef struct dirq_set_s *dirq_set_t;
+
+/*
+ * constructors & destructor
+ */
+
+dirq_t dirq_new  (const char *path);
+dirq_t dirq_copy (dirq_t dirq);
+void   dirq_free (dirq_t dirq);
+
+/*
+ * accessors
+ */
+
+void   dirq_set_granularity   (dirq_t dirq, int value);
+int    dirq_get_granularity   (dirq_t dirq);
+void   dirq_set_bucket_size   (dirq_t dirq, int value);
+int    dirq_get_bucket_size   (dirq_t dirq);
+void   dirq_set_rndhex        (dirq_t dirq, int value);
+int    dirq_get_rndhex        (dirq_t dirq);
+void   dirq_set_umask         (dirq_t dirq, mode_t value);
+mode_t dirq_get_umask         (dirq_t dirq);
+void   dirq_set_maxlock       (dirq_t dirq, int value);
+int    dirq_get_maxlock       (dirq_t dirq);
+void   dirq_set_maxtemp       (dirq_t dirq, int value);
+int    dirq_get_maxtemp       (dirq_t dirq);
+void   dirq_set_purge_threads (dirq_t dirq, int value);
+int    dirq_get_purge_threads (dirq_t dirq);
+int    dirq_set_deadletter    (dirq_t dirq, const char *path, int maxattempts);
+dirq_t dirq_get_deadletter    (dirq_t dirq);
+int    dirq_set_type          (dirq_t dirq, int value);
+int    dirq_get_type          (dirq_t dirq);
+int    dirq_set_order         (dirq_t dirq, int value);
+int    dirq_get_order         (dirq_t dirq);
+int    dirq_set_tier          (dirq_t dirq, const char *path, int maxcount,
+                               int maxage);
+dirq_t dirq_get_tier          (dirq_t dirq);
+int    dirq_set_watermarks    (dirq_t dirq, int high, int low, size_t highbytes,
+                               size_t lowbytes);
+int    dirq_set_full_policy   (dirq_t dirq, int policy, int timeout);
+int    dirq_set_prefetch      (dirq_t dirq, int depth);
+int    dirq_get_prefetch      (dirq_t dirq);
+int    dirq_set_checkpoint    (dirq_t dirq, const char *id, int recheck);
+
+/*
+ * iterators
+ */
+
+const char *dirq_first      (dirq_t dirq);
+const char *dirq_next       (dirq_t dirq);
+const char *dirq_seek       (dirq_t dirq, const struct timespec *ts);
+void        dirq_set_range  (dirq_t dirq, const struct timespec *from,
+                             const struct timespec *until);
+void        dirq_set_filter (dirq_t dirq, const char *key, const char *value);
+
+/*
+ * main methods
+ */
+
+const char *dirq_add         (dirq_t dirq, dirq_iow cb);
+const char *dirq_add_at      (dirq_t dirq, dirq_iow cb,
+                              const struct timespec *ts);
+const char *dirq_add_delayed (dirq_t dirq, dirq_iow cb, int delay);
+const char *dirq_add_meta    (dirq_t dirq, dirq_iow cb, const char **meta);
+const char *dirq_add_path    (dirq_t dirq, const char *path);
+int         dirq_add_fanout  (dirq_t *dirqs, int count, dirq_iow cb,
+                              const char **names);
+const char *dirq_move        (dirq_t src, dirq_t dst, const char *name);
+int         dirq_move_batch  (dirq_t src, dirq_t dst, const char **names,
+                              int count);
+int         dirq_get         (dirq_t dirq, const char *name, dirq_ior cb);
+const char *dirq_get_path    (dirq_t dirq, const char *name);
+int         dirq_lock        (dirq_t dirq, const char *name, int permissive);
+int         dirq_unlock      (dirq_t dirq, const char *name, int permissive);
+int         dirq_remove      (dirq_t dirq, const char *name);
+int         dirq_touch       (dirq_t dirq, const char *name);
+int         dirq_get_size    (dirq_t dirq, const char *name);
+const char *dirq_get_meta    (dirq_t dirq, const char *name, const char *key);
+int         dirq_count       (dirq_t dirq);
+int         dirq_count_fast  (dirq_t dirq);
+int         dirq_oldest      (dirq_t dirq, const char **name,
+                              struct timespec *ts);
+int         dirq_age         (dirq_t dirq);
+int         dirq_purge       (dirq_t dirq);
+int         dirq_purge_step  (dirq_t dirq, int budget);
+int         dirq_expire      (dirq_t dirq, int maxage);
+int         dirq_trim_older  (dirq_t dirq, const char *name);
+int         dirq_compact     (dirq_t dirq, int target);
+
+/*
+ * priority lanes
+ */
+
+int         dirq_set_lanes  (dirq_t dirq, int count, const int *weights);
+dirq_t      dirq_get_lane   (dirq_t dirq, int lane);
+const char *dirq_lane_first (dirq_t dirq, dirq_t *lane);
+const char *dirq_lane_next  (dirq_t dirq, dirq_t *lane);
+
+/*
+ * maintenance
+ */
+
+int         dirq_maint_start  (dirq_t dirq, int interval, int budget);
+void        dirq_maint_stop   (dirq_t dirq);
+int         dirq_maint_stats  (dirq_t dirq, dirq_stats_t *stats);
+int         dirq_tier_migrate (dirq_t dirq);
+
+/*
+ * local delivery
+ */
+
+int         dirq_local_start (dirq_t dirq, int capacity, int delay);
+void        dirq_local_stop  (dirq_t dirq);
+const char *dirq_local_take  (dirq_t dirq, dirq_ior callback);
+int         dirq_local_ack   (dirq_t dirq, const char *name);
+
+/*
+ * asynchronous adds
+ */
+
+int         dirq_async_start  (dirq_t dirq, int capacity, int threads,
+                               int policy);
+void        dirq_async_stop   (dirq_t dirq);
+int         dirq_async_notify (dirq_t dirq, dirq_done callback);
+int         dirq_async_fd     (dirq_t dirq);
+long        dirq_async_failed (dirq_t dirq);
+long        dirq_async_add    (dirq_t dirq, dirq_iow callback);
+long        dirq_async_give   (dirq_t dirq, char *data, size_t length);
+int         dirq_async_flush  (dirq_t dirq);
+
+/*
+ * queue sets
+ */
+
+dirq_set_t  dirq_set_new         (void);
+void        dirq_set_free        (dirq_set_t set);
+int         dirq_set_add         (dirq_set_t set, dirq_t dirq, int weight);
+int         dirq_set_wait        (dirq_set_t set, int timeout);
+const char *dirq_set_first       (dirq_set_t set, dirq_t *dirq);
+const char *dirq_set_next        (dirq_set_t set, dirq_t *dirq);
+int         dirq_set_get_errcode (dirq_set_t set);
+const char *dirq_set_get_errstr  (dirq_set_t set);
+
+/*
+ * other methods
+ */
+
+void        dirq_now         (dirq_t dirq, struct timespec *ts);
+int         dirq_get_errcode (dirq_t dirq);
+const char *dirq_get_errstr  (dirq_t dirq);
+void        dirq_clear_error (dirq_t dirq);
+
+/*** END SYNOPSIS ***/
+
+/*
+ * C++ compatibility
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DIRQ_H */
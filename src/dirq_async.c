@@ -0,0 +1,396 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq asynchronous producer support                                         *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * elements submitted via an object with asynchronous adds are kept in memory,
+ * in a bounded ring buffer shared by all the copies of this object (typically
+ * used by other threads), and added to the queue in batches by writer threads
+ * so that producers never wait for the filesystem (unless they want to)
+ */
+
+/*
+ * share the asynchronous adds state with a copy of the object
+ */
+
+static struct async_s *async_share (struct async_s *async)
+{
+  pthread_mutex_lock(&async->mutex);
+  async->refs++;
+  pthread_mutex_unlock(&async->mutex);
+  return(async);
+}
+
+/*
+ * submit data to the ring (which now owns it): TICKET | 0 dropped | -1 error
+ */
+
+static long _async_submit (dirq_t dirq, char *data, size_t length)
+{
+  struct async_s *async;
+  struct async_elt_s *elt;
+  long ticket;
+
+  async = dirq->async;
+  pthread_mutex_lock(&async->mutex);
+  while (async->used == async->capacity) {
+    if (async->policy == DIRQ_ASYNC_BLOCK) {
+      pthread_cond_wait(&async->room, &async->mutex);
+      continue;
+    }
+    pthread_mutex_unlock(&async->mutex);
+    free((void *)data);
+    if (async->policy == DIRQ_ASYNC_DROP)
+      return(0);
+    error_set(dirq, EAGAIN, "cannot add(%s): %s", dirq->buffer,
+              strerror(EAGAIN));
+    return(-1);
+  }
+  elt = &async->elts[(async->head + async->used) % async->capacity];
+  async->used++;
+  elt->data = data;
+  elt->length = length;
+  elt->ticket = ticket = ++async->ticket;
+  pthread_cond_signal(&async->ready);
+  pthread_mutex_unlock(&async->mutex);
+  return(ticket);
+}
+
+/*
+ * writer threads: add the submitted elements to the queue
+ */
+
+static int _async_read (dirq_t dirq, char *buffer, size_t length)
+{
+  struct async_writer_s *writer;
+  size_t chunk;
+  int i;
+
+  /* find out which writer is calling us */
+  for (i = 0; dirq->async->writers[i].dirq != dirq; i++)
+    ;
+  writer = &dirq->async->writers[i];
+  chunk = writer->elt->length - writer->offset;
+  if (chunk > length)
+    chunk = length;
+  memcpy(buffer, writer->elt->data + writer->offset, chunk);
+  writer->offset += chunk;
+  return((int)chunk);
+}
+
+static void *_async_thread (void *arg)
+{
+  struct async_writer_s *writer;
+  struct async_s *async;
+  struct async_elt_s batch[ASYNC_BATCH_SIZE];
+  dirq_done callback;
+  const char *name;
+  uint64_t done;
+  int i, count, failed;
+
+  writer = (struct async_writer_s *)arg;
+  async = writer->async;
+  pthread_mutex_lock(&async->mutex);
+  while (1) {
+    if (async->used == 0) {
+      if (async->stop)
+        break;
+      pthread_cond_wait(&async->ready, &async->mutex);
+      continue;
+    }
+    /* take a batch at once to free the ring as soon as possible */
+    count = MIN(async->used, ASYNC_BATCH_SIZE);
+    for (i = 0; i < count; i++)
+      batch[i] = async->elts[(async->head + i) % async->capacity];
+    async->head = (async->head + count) % async->capacity;
+    async->used -= count;
+    async->busy += count;
+    callback = async->callback;
+    pthread_cond_broadcast(&async->room);
+    pthread_mutex_unlock(&async->mutex);
+    failed = 0;
+    for (i = 0; i < count; i++) {
+      writer->elt = &batch[i];
+      writer->offset = 0;
+      name = NULL;
+      if (count_admit(writer->dirq) == 0)
+        name = _add(writer->dirq, _async_read, NULL);
+      if (callback)
+        callback(writer->dirq, batch[i].ticket, name);
+      if (!name) {
+        failed++;
+        dirq_clear_error(writer->dirq);
+      }
+      free((void *)batch[i].data);
+    }
+    writer->elt = NULL;
+    if (async->fd >= 0 && count > failed) {
+      done = count - failed;
+      if (write(async->fd, &done, sizeof(done)) < 0) {
+        /* best effort: it can only fail if nobody reads the counter... */
+      }
+    }
+    pthread_mutex_lock(&async->mutex);
+    async->failed += failed;
+    async->busy -= count;
+    if (async->used == 0 && async->busy == 0)
+      pthread_cond_broadcast(&async->idle);
+  }
+  pthread_mutex_unlock(&async->mutex);
+  return(NULL);
+}
+
+/*
+ * stop the writer threads (once all the elements have been added) and free
+ * everything
+ */
+
+static void _async_cleanup (struct async_s *async)
+{
+  int i;
+
+  pthread_mutex_lock(&async->mutex);
+  async->stop = 1;
+  pthread_cond_broadcast(&async->ready);
+  pthread_mutex_unlock(&async->mutex);
+  for (i = 0; i < async->threads; i++) {
+    pthread_join(async->writers[i].thread, NULL);
+    async->writers[i].dirq->async = NULL;
+    dirq_free(async->writers[i].dirq);
+  }
+  for (i = async->threads; i < ASYNC_MAX_THREADS; i++) {
+    if (!async->writers[i].dirq)
+      continue;
+    /* created but not started */
+    async->writers[i].dirq->async = NULL;
+    dirq_free(async->writers[i].dirq);
+  }
+  if (async->fd >= 0)
+    (void) close(async->fd); /* best effort cleanup... */
+  free((void *)async->elts);
+  pthread_cond_destroy(&async->idle);
+  pthread_cond_destroy(&async->room);
+  pthread_cond_destroy(&async->ready);
+  pthread_mutex_destroy(&async->mutex);
+  free((void *)async);
+}
+
+/*
+ * stop using asynchronous adds (the last object also waits for the writers)
+ */
+
+static void async_release (dirq_t dirq)
+{
+  struct async_s *async;
+  int last;
+
+  async = dirq->async;
+  if (!async)
+    return;
+  dirq->async = NULL;
+  pthread_mutex_lock(&async->mutex);
+  last = (--async->refs == 0);
+  pthread_mutex_unlock(&async->mutex);
+  if (last)
+    _async_cleanup(async);
+}
+
+/*
+ * dirq_async_start(DIRQ, CAPACITY, THREADS, POLICY): 0 success | -1 error
+ */
+
+int dirq_async_start (dirq_t dirq, int capacity, int threads, int policy)
+{
+  struct async_s *async;
+  dirq_t writer;
+  int i, result;
+
+  if (dirq->async) {
+    error_set(dirq, EBUSY, "asynchronous adds already started");
+    return(-1);
+  }
+  if (policy != DIRQ_ASYNC_BLOCK && policy != DIRQ_ASYNC_FAIL &&
+      policy != DIRQ_ASYNC_DROP) {
+    error_set(dirq, EINVAL, "invalid policy: %d", policy);
+    return(-1);
+  }
+  async = (struct async_s *)safe_malloc(sizeof(struct async_s));
+  memset((void *)async, 0, sizeof(struct async_s));
+  async->refs = 1;
+  async->policy = policy;
+  async->capacity = (capacity < 1) ? 1 : capacity;
+  async->elts = (struct async_elt_s *)
+    safe_malloc(async->capacity * sizeof(struct async_elt_s));
+  pthread_mutex_init(&async->mutex, NULL);
+  pthread_cond_init(&async->ready, NULL);
+  pthread_cond_init(&async->room, NULL);
+  pthread_cond_init(&async->idle, NULL);
+#ifdef __linux__
+  async->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (async->fd < 0) {
+    error_set(dirq, errno, "cannot eventfd(): %s", ERROR);
+    _async_cleanup(async);
+    return(-1);
+  }
+#else
+  async->fd = -1;
+#endif
+  if (threads < 1)
+    threads = 1;
+  if (threads > ASYNC_MAX_THREADS)
+    threads = ASYNC_MAX_THREADS;
+  for (i = 0; i < threads; i++) {
+    /* the writers work on their own copies as objects are not thread safe */
+    writer = dirq_copy(dirq);
+    local_release(writer);
+    writer->async = async; /* not counted, only used by _async_read() */
+    async->writers[i].dirq = writer;
+    async->writers[i].async = async;
+  }
+  for (i = 0; i < threads; i++) {
+    result = pthread_create(&async->writers[i].thread, NULL, _async_thread,
+                            &async->writers[i]);
+    if (result != 0) {
+      error_set(dirq, result, "cannot pthread_create(): %s",
+                strerror(result));
+      _async_cleanup(async);
+      return(-1);
+    }
+    async->threads++;
+  }
+  dirq->async = async;
+  return(0);
+}
+
+/*
+ * dirq_async_stop(DIRQ)
+ */
+
+void dirq_async_stop (dirq_t dirq)
+{
+  async_release(dirq);
+}
+
+/*
+ * dirq_async_notify(DIRQ, CALLBACK): 0 success | -1 error
+ */
+
+int dirq_async_notify (dirq_t dirq, dirq_done callback)
+{
+  struct async_s *async;
+
+  async = dirq->async;
+  if (!async) {
+    error_set(dirq, EINVAL, "no asynchronous adds");
+    return(-1);
+  }
+  pthread_mutex_lock(&async->mutex);
+  async->callback = callback;
+  pthread_mutex_unlock(&async->mutex);
+  return(0);
+}
+
+/*
+ * dirq_async_fd(DIRQ): FD | -1 error
+ */
+
+int dirq_async_fd (dirq_t dirq)
+{
+  if (!dirq->async) {
+    error_set(dirq, EINVAL, "no asynchronous adds");
+    return(-1);
+  }
+  if (dirq->async->fd < 0) {
+    error_set(dirq, ENOTSUP, "no completion file descriptor");
+    return(-1);
+  }
+  return(dirq->async->fd);
+}
+
+/*
+ * dirq_async_failed(DIRQ): COUNT | -1 error
+ */
+
+long dirq_async_failed (dirq_t dirq)
+{
+  struct async_s *async;
+  long failed;
+
+  async = dirq->async;
+  if (!async) {
+    error_set(dirq, EINVAL, "no asynchronous adds");
+    return(-1);
+  }
+  pthread_mutex_lock(&async->mutex);
+  failed = async->failed;
+  async->failed = 0;
+  pthread_mutex_unlock(&async->mutex);
+  return(failed);
+}
+
+/*
+ * dirq_async_add(DIRQ, CALLBACK): TICKET | 0 dropped | -1 error
+ */
+
+long dirq_async_add (dirq_t dirq, dirq_iow callback)
+{
+  size_t allocated;
+  ssize_t length;
+  char *data;
+
+  if (!dirq->async) {
+    error_set(dirq, EINVAL, "no asynchronous adds");
+    return(-1);
+  }
+  /* the data is copied before submission */
+  data = NULL;
+  allocated = 0;
+  length = gather_data(dirq, callback, &data, &allocated, 0);
+  if (length < 0) {
+    free((void *)data);
+    return(-1);
+  }
+  return(_async_submit(dirq, data, (size_t)length));
+}
+
+/*
+ * dirq_async_give(DIRQ, DATA, LENGTH): TICKET | 0 dropped | -1 error
+ */
+
+long dirq_async_give (dirq_t dirq, char *data, size_t length)
+{
+  if (!dirq->async) {
+    free((void *)data);
+    error_set(dirq, EINVAL, "no asynchronous adds");
+    return(-1);
+  }
+  /* the data is moved, i.e. owned (and later freed) by the ring */
+  return(_async_submit(dirq, data, length));
+}
+
+/*
+ * dirq_async_flush(DIRQ): 0 success | -1 error
+ */
+
+int dirq_async_flush (dirq_t dirq)
+{
+  struct async_s *async;
+
+  async = dirq->async;
+  if (!async) {
+    error_set(dirq, EINVAL, "no asynchronous adds");
+    return(-1);
+  }
+  pthread_mutex_lock(&async->mutex);
+  while (async->used > 0 || async->busy > 0)
+    pthread_cond_wait(&async->idle, &async->mutex);
+  pthread_mutex_unlock(&async->mutex);
+  return(0);
+}
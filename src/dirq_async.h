@@ -0,0 +1,63 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq asynchronous producer support                                         *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define ASYNC_BATCH_SIZE  64 /* maximum number of elements added in one batch */
+#define ASYNC_MAX_THREADS 16 /* maximum number of writer threads */
+
+/*
+ * types
+ */
+
+struct async_elt_s {
+  char        *data;          /* element data */
+  size_t       length;        /* element length */
+  long         ticket;        /* ticket returned to the producer */
+};
+
+struct async_writer_s {
+  pthread_t    thread;        /* writer thread */
+  dirq_t       dirq;          /* private copy used by it */
+  struct async_elt_s *elt;    /* element being added */
+  size_t       offset;        /* how much has been added */
+  struct async_s *async;      /* shared state */
+};
+
+struct async_s {
+  pthread_mutex_t mutex;      /* mutex protecting all the fields */
+  pthread_cond_t ready;       /* condition used to wake up the writers */
+  pthread_cond_t room;        /* condition used to wake up the producers */
+  pthread_cond_t idle;        /* condition used to wake up the flushers */
+  int          refs;          /* number of objects sharing this */
+  int          stop;          /* true if the writers must stop */
+  int          policy;        /* what to do when the ring is full */
+  int          capacity;      /* number of slots */
+  int          head;          /* index of the oldest slot */
+  int          used;          /* number of used slots */
+  int          busy;          /* number of elements being added */
+  long         ticket;        /* last ticket given */
+  long         failed;        /* number of elements that could not be added */
+  struct async_elt_s *elts;   /* slots (ring buffer) */
+  int          threads;       /* number of writer threads */
+  struct async_writer_s writers[ASYNC_MAX_THREADS]; /* writer threads */
+  dirq_done    callback;      /* completion callback (if any) */
+  int          fd;            /* completion eventfd (if any) */
+};
+
+/*
+ * functions
+ */
+
+static struct async_s *async_share (struct async_s *async);
+static void async_release (dirq_t dirq);
@@ -0,0 +1,228 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq consumer checkpoint support                                           *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * a consumer with an identifier records in its own file, at the top of the
+ * queue, the last intermediate directory its iterations went entirely through
+ * (only if it is old enough to not receive elements anymore); new iterations
+ * then start after it, except every now and then to find the stragglers,
+ * i.e. elements that were locked by others and got unlocked since; the
+ * operations adding elements to old directories (compaction and tier
+ * migration) reset the checkpoints that are past them; as this is only an
+ * optimization, the checkpoint files are updated on a best effort basis
+ */
+
+/*
+ * read the checkpoint file (an empty or garbled one means no checkpoint):
+ * 0 success | -1 error (errno set)
+ */
+
+static int _checkpoint_read (int fd, char *dir)
+{
+  char buffer[DIR_NAME_LENGTH + 2];
+  ssize_t done;
+
+  done = pread(fd, buffer, DIR_NAME_LENGTH + 1, 0);
+  if (done < 0)
+    return(-1);
+  buffer[done] = '\0';
+  dir[0] = '\0';
+  if (done >= DIR_NAME_LENGTH &&
+      strspn(buffer, "0123456789abcdef") >= DIR_NAME_LENGTH) {
+    memcpy(dir, buffer, DIR_NAME_LENGTH);
+    dir[DIR_NAME_LENGTH] = '\0';
+  }
+  return(0);
+}
+
+/*
+ * start an iteration (the sorted list of intermediate directories is known)
+ * after the checkpoint (read again as it may have been reset), unless it is
+ * time for a full iteration
+ */
+
+static void checkpoint_start (dirq_t dirq)
+{
+  struct checkpoint_s *checkpoint;
+  time_t now;
+  int index;
+
+  checkpoint = dirq->checkpoint;
+  if (!checkpoint)
+    return;
+  checkpoint->seen = 0;
+  if (dirq->order != DIRQ_ORDER_FIFO)
+    return;
+  if (_checkpoint_read(checkpoint->fd, checkpoint->dir) != 0)
+    checkpoint->dir[0] = '\0';
+  if (!checkpoint->dir[0])
+    return;
+  now = time(NULL);
+  if (now - checkpoint->rechecked >= checkpoint->recheck) {
+    checkpoint->rechecked = now;
+    return;
+  }
+  index = dirs_upper_bound(dirq, checkpoint->dir);
+  if (index > dirq->dirs_index)
+    dirq->dirs_index = index;
+}
+
+/*
+ * tell until when elements may still be added to an intermediate directory
+ * (as seen by this object): after its time range, by delayed writers such as
+ * the tier migration and the local write-behind thread, keeping their time
+ */
+
+static uint32_t _checkpoint_horizon (dirq_t dirq, uint32_t dir)
+{
+  uint32_t horizon;
+
+  horizon = dir + MAX(dirq->granularity, 1) + CHECKPOINT_MARGIN;
+  if (dirq->tier)
+    horizon += dirq->tier->maxage;
+  if (dirq->local)
+    horizon += (dirq->local->delay + 999) / 1000;
+  return(horizon);
+}
+
+/*
+ * the iterator is about to read the next intermediate directory: record the
+ * previous one (DIR, not terminated and only meaningful if it has been read
+ * by this iteration) if the iteration went entirely through it, i.e. if its
+ * last element (LAST, if any) was not too recent, and if it cannot receive
+ * new elements anymore
+ */
+
+static void checkpoint_next (dirq_t dirq, const char *dir, const char *last)
+{
+  struct checkpoint_s *checkpoint;
+  char buffer[DIR_NAME_LENGTH + 1];
+  uint32_t when;
+  int seen;
+
+  checkpoint = dirq->checkpoint;
+  seen = checkpoint->seen;
+  checkpoint->seen = (dirq->order == DIRQ_ORDER_FIFO);
+  if (!seen)
+    return;
+  if (last && strncmp(last, dirq->limit_key, TIME_KEY_LENGTH) > 0)
+    return;
+  memcpy(buffer, dir, DIR_NAME_LENGTH);
+  buffer[DIR_NAME_LENGTH] = '\0';
+  when = (uint32_t)strtoul(buffer, NULL, 16);
+  if (_checkpoint_horizon(dirq, when) >= (uint32_t)time(NULL))
+    return;
+  if (checkpoint->dir[0] &&
+      strncmp(dir, checkpoint->dir, DIR_NAME_LENGTH) <= 0)
+    return;
+  memcpy(checkpoint->dir, dir, DIR_NAME_LENGTH);
+  checkpoint->dir[DIR_NAME_LENGTH] = '\0';
+  memcpy(buffer, dir, DIR_NAME_LENGTH);
+  buffer[DIR_NAME_LENGTH] = '\n';
+  if (pwrite(checkpoint->fd, buffer, DIR_NAME_LENGTH + 1, 0) < 0) {
+    /* best effort: a stale checkpoint only means a longer iteration... */
+  }
+}
+
+/*
+ * forget the checkpoints of all the consumers that are at or past the given
+ * intermediate directory, which is about to receive old elements
+ */
+
+static void checkpoint_reset (dirq_t dirq, uint32_t dir)
+{
+  char path[MAXPATHLEN], name[DIR_NAME_LENGTH + 1], cdir[16];
+  struct dirent *dp;
+  DIR *dirp;
+  int fd;
+
+  sprintf(name, "%08x", dir);
+  dirp = opendir(dirq->buffer);
+  if (!dirp)
+    return;
+  while ((dp = readdir(dirp)) != NULL) {
+    if (strncmp(dp->d_name, CHECKPOINT_PREFIX, strlen(CHECKPOINT_PREFIX)))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dirq->buffer, dp->d_name);
+    fd = open(path, O_RDWR);
+    if (fd < 0)
+      continue;
+    if (_checkpoint_read(fd, cdir) == 0 && cdir[0] &&
+        strcmp(cdir, name) >= 0 && ftruncate(fd, 0) != 0) {
+      /* best effort: a stale checkpoint only delays some elements... */
+    }
+    (void) close(fd); /* best effort cleanup... */
+  }
+  (void) closedir(dirp); /* read only so nothing to check... */
+}
+
+/*
+ * stop using the checkpoint (the file is kept)
+ */
+
+static void checkpoint_free (dirq_t dirq)
+{
+  if (!dirq->checkpoint)
+    return;
+  (void) close(dirq->checkpoint->fd); /* best effort cleanup... */
+  free((void *)dirq->checkpoint);
+  dirq->checkpoint = NULL;
+}
+
+/*
+ * dirq_set_checkpoint(DIRQ, ID, RECHECK): 0 success | -1 error
+ */
+
+int dirq_set_checkpoint (dirq_t dirq, const char *id, int recheck)
+{
+  struct checkpoint_s *checkpoint;
+  char path[MAXPATHLEN];
+  const char *cp;
+  int fd;
+
+  checkpoint_free(dirq);
+  if (!id)
+    return(0);
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "set_checkpoint"));
+  for (cp = id; *cp; cp++)
+    if ((*cp < '0' || *cp > '9') && (*cp < 'a' || *cp > 'z') &&
+        (*cp < 'A' || *cp > 'Z') && *cp != '-' && *cp != '_')
+      break;
+  if (cp == id || *cp || cp - id > CHECKPOINT_MAXID) {
+    error_set(dirq, EINVAL, "invalid consumer id: %s", id);
+    return(-1);
+  }
+  /* stragglers would otherwise never be found */
+  if (recheck <= 0) {
+    error_set(dirq, EINVAL, "invalid recheck time: %d", recheck);
+    return(-1);
+  }
+  snprintf(path, sizeof(path), "%s/%s%s", dirq->buffer, CHECKPOINT_PREFIX, id);
+  fd = open(path, O_RDWR|O_CREAT, 0666 & ~dirq->umask);
+  if (fd < 0) {
+    error_set(dirq, errno, "cannot open(%s): %s", path, ERROR);
+    return(-1);
+  }
+  checkpoint = (struct checkpoint_s *)safe_malloc(sizeof(struct checkpoint_s));
+  memset((void *)checkpoint, 0, sizeof(struct checkpoint_s));
+  if (_checkpoint_read(fd, checkpoint->dir) != 0) {
+    error_set(dirq, errno, "cannot read(%s): %s", path, ERROR);
+    (void) close(fd); /* best effort cleanup... */
+    free((void *)checkpoint);
+    return(-1);
+  }
+  checkpoint->fd = fd;
+  checkpoint->recheck = recheck;
+  checkpoint->rechecked = time(NULL);
+  dirq->checkpoint = checkpoint;
+  return(0);
+}
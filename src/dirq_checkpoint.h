@@ -0,0 +1,39 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq consumer checkpoint support                                           *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define CHECKPOINT_PREFIX ".checkpoint." /* prefix of the checkpoint files */
+#define CHECKPOINT_MAXID  64             /* maximum length of a consumer id */
+#define CHECKPOINT_MARGIN 60             /* extra safety horizon (in seconds) */
+
+/*
+ * types
+ */
+
+struct checkpoint_s {
+  int          fd;            /* checkpoint file */
+  int          recheck;       /* time between two full iterations */
+  time_t       rechecked;     /* last full iteration time */
+  int          seen;          /* true if the previous directory was read */
+  char         dir[16];       /* last drained directory ("": none) */
+};
+
+/*
+ * functions
+ */
+
+static void checkpoint_start (dirq_t dirq);
+static void checkpoint_next (dirq_t dirq, const char *dir, const char *last);
+static void checkpoint_reset (dirq_t dirq, uint32_t dir);
+static void checkpoint_free (dirq_t dirq);
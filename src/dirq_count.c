@@ -0,0 +1,325 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq counter support                                                       *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * the number of elements (and their total size) is kept in a small counter
+ * file, at the top of the queue, that all the users map in memory: it is
+ * atomically updated when elements are added or removed and the number is
+ * fully recomputed by dirq_count(); it is only approximate as other processes
+ * (or older versions of this library) may change the queue without updating
+ * it, hence the periodic synchronization (the size is only reset when the
+ * queue is found empty as computing it would require a stat() per element);
+ * the file is only created once somebody needs it (dirq_count_fast() or the
+ * watermarks) so that the other queues do not pay for it
+ */
+
+/*
+ * map the counter file, creating it if asked to: COUNTER | NULL unavailable
+ * (this is best effort: without counter, dirq_count_fast() falls back to
+ * dirq_count())
+ */
+
+static struct count_s *_count_map (dirq_t dirq, int create)
+{
+  char path[MAXPATHLEN];
+  struct stat sb;
+  void *addr;
+  int fd;
+
+  if (dirq->counter == MAP_FAILED && !create)
+    return(NULL);
+  if (dirq->counter && dirq->counter != MAP_FAILED)
+    return(dirq->counter);
+  dirq->counter = MAP_FAILED;
+  snprintf(path, sizeof(path), "%s/%s", dirq->buffer, COUNT_FILE);
+  if (create)
+    fd = open(path, O_RDWR|O_CREAT, 0666 & ~dirq->umask);
+  else
+    fd = open(path, O_RDWR);
+  if (fd < 0)
+    return(NULL);
+  if (fstat(fd, &sb) != 0 ||
+      (sb.st_size < (off_t)sizeof(struct count_s) &&
+       ftruncate(fd, sizeof(struct count_s)) != 0)) {
+    (void) close(fd); /* best effort cleanup... */
+    return(NULL);
+  }
+  addr = mmap(NULL, sizeof(struct count_s), PROT_READ|PROT_WRITE, MAP_SHARED,
+              fd, 0);
+  (void) close(fd); /* the mapping is kept anyway... */
+  if (addr == MAP_FAILED)
+    return(NULL);
+  dirq->counter = (struct count_s *)addr;
+  return(dirq->counter);
+}
+
+/*
+ * get the size of an element (0 if unknown or not needed)
+ */
+
+static off_t count_size (dirq_t dirq, const char *path)
+{
+  struct stat sb;
+
+  if (!_count_map(dirq, 0))
+    return(0);
+  if (stat(path, &sb) != 0)
+    return(0);
+  return(sb.st_size);
+}
+
+/*
+ * update the counter after adding or removing elements
+ */
+
+static void count_update (dirq_t dirq, int delta, off_t bytes)
+{
+  struct count_s *counter;
+
+  counter = _count_map(dirq, 0);
+  if (!counter)
+    return;
+  (void) __sync_add_and_fetch(&counter->count, (int64_t)delta);
+  (void) __sync_add_and_fetch(&counter->bytes, (int64_t)bytes);
+}
+
+/*
+ * synchronize the counter with the real number of elements
+ */
+
+static void count_sync (dirq_t dirq, int count)
+{
+  struct count_s *counter;
+
+  counter = _count_map(dirq, 0);
+  if (!counter)
+    return;
+  (void) __sync_lock_test_and_set(&counter->count, (int64_t)count);
+  if (count == 0)
+    (void) __sync_lock_test_and_set(&counter->bytes, (int64_t)0);
+  counter->synced = time(NULL);
+}
+
+/*
+ * unmap the counter file (if mapped)
+ */
+
+static void count_unmap (dirq_t dirq)
+{
+  if (dirq->counter && dirq->counter != MAP_FAILED)
+    (void) munmap((void *)dirq->counter, sizeof(struct count_s));
+  dirq->counter = NULL;
+}
+
+/*
+ * check if the counter has not been synchronized for the given time
+ */
+
+static int _count_stale (struct count_s *counter, int maxage)
+{
+  return(counter->synced == 0 || counter->synced + maxage < time(NULL));
+}
+
+/*
+ * synchronize the counter (if any) before it gets stale, outside of the add
+ * path: 0 success | -1 error
+ */
+
+static int count_refresh (dirq_t dirq)
+{
+  struct count_s *counter;
+
+  counter = _count_map(dirq, 0);
+  if (!counter || !_count_stale(counter, COUNT_MAXAGE / 2))
+    return(0);
+  return((dirq_count(dirq) < 0) ? -1 : 0);
+}
+
+/*
+ * read the counter (the tier is included), synchronizing it first if asked
+ * to or else telling what is unknown (-1): nothing without counter (or if it
+ * was never synchronized) and the size with a stale counter, as it may have
+ * drifted: 0 success | -1 error
+ */
+
+static int _count_read (dirq_t dirq, int64_t *count, int64_t *bytes,
+                        int sync)
+{
+  struct count_s *counter;
+  int64_t tcount, tbytes;
+  int result;
+
+  counter = _count_map(dirq, 1);
+  if (sync && (!counter || _count_stale(counter, COUNT_MAXAGE))) {
+    /* a full count (including the tier) also synchronizes the counters */
+    result = dirq_count(dirq);
+    if (result < 0)
+      return(-1);
+    if (!counter) {
+      /* the size is unknown without counter */
+      *count = result;
+      *bytes = -1;
+      return(0);
+    }
+  }
+  if (!counter) {
+    *count = *bytes = -1;
+    return(0);
+  }
+  *count = MAX(__sync_add_and_fetch(&counter->count, 0), 0);
+  *bytes = MAX(__sync_add_and_fetch(&counter->bytes, 0), 0);
+  if (_count_stale(counter, COUNT_MAXAGE))
+    *bytes = -1;
+  if (counter->synced == 0)
+    *count = -1;
+  if (dirq->tier) {
+    if (_count_read(dirq->tier->fast, &tcount, &tbytes, sync) < 0)
+      return(tier_error(dirq, -1));
+    *count = (*count < 0 || tcount < 0) ? -1 : *count + tcount;
+    *bytes = (*bytes < 0 || tbytes < 0) ? -1 : *bytes + tbytes;
+  }
+  return(0);
+}
+
+/*
+ * check if the queue is past its watermarks (ignoring what is unknown):
+ * 1 full | 0 not full | -1 error
+ */
+
+static int _count_full (dirq_t dirq)
+{
+  int64_t count, bytes;
+  int highcount, highbytes;
+
+  if (_count_read(dirq, &count, &bytes, 0) < 0)
+    return(-1);
+  highcount = dirq->highcount && count >= 0;
+  highbytes = dirq->highbytes && bytes >= 0;
+  if (dirq->full) {
+    /* full until below both low watermarks */
+    if ((highcount && count > dirq->lowcount) ||
+        (highbytes && (uint64_t)bytes > dirq->lowbytes))
+      return(1);
+    dirq->full = 0;
+  } else {
+    if ((highcount && count >= dirq->highcount) ||
+        (highbytes && (uint64_t)bytes >= dirq->highbytes))
+      dirq->full = 1;
+  }
+  return(dirq->full);
+}
+
+/*
+ * apply the full queue policy before adding an element: 0 go ahead | -1
+ * error (including when the element is shed)
+ */
+
+static int count_admit (dirq_t dirq)
+{
+  struct timespec now, until, pause;
+  int result;
+
+  if (!dirq->highcount && !dirq->highbytes)
+    return(0);
+  if (dirq->full_policy == DIRQ_FULL_BLOCK && dirq->full_timeout >= 0) {
+    dirq_now(dirq, &until);
+    until.tv_sec += dirq->full_timeout / 1000;
+    until.tv_nsec += (dirq->full_timeout % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+  }
+  while (1) {
+    result = _count_full(dirq);
+    if (result <= 0)
+      return(result);
+    if (dirq->full_policy == DIRQ_FULL_SHED) {
+      error_set(dirq, ECANCELED, "cannot add(%s): %s", dirq->buffer,
+                "queue is full, element shed");
+      return(-1);
+    }
+    if (dirq->full_policy == DIRQ_FULL_FAIL) {
+      error_set(dirq, EDQUOT, "cannot add(%s): %s", dirq->buffer,
+                "queue is full");
+      return(-1);
+    }
+    if (dirq->full_timeout >= 0) {
+      dirq_now(dirq, &now);
+      if (now.tv_sec > until.tv_sec ||
+          (now.tv_sec == until.tv_sec && now.tv_nsec >= until.tv_nsec)) {
+        error_set(dirq, ETIMEDOUT, "cannot add(%s): %s", dirq->buffer,
+                  "queue is still full");
+        return(-1);
+      }
+    }
+    pause.tv_sec = 0;
+    pause.tv_nsec = COUNT_POLL * 1000000;
+    (void) nanosleep(&pause, NULL);
+  }
+}
+
+/*
+ * dirq_count_fast(DIRQ): COUNT | -1 error
+ */
+
+int dirq_count_fast (dirq_t dirq)
+{
+  int64_t count, bytes;
+
+  if (_count_read(dirq, &count, &bytes, 1) < 0)
+    return(-1);
+  return((count > INT_MAX) ? INT_MAX : (int)count);
+}
+
+/*
+ * dirq_set_watermarks(DIRQ, HIGH, LOW, HIGHBYTES, LOWBYTES): 0 success | -1
+ * error
+ */
+
+int dirq_set_watermarks (dirq_t dirq, int high, int low, size_t highbytes,
+                         size_t lowbytes)
+{
+  struct count_s *counter;
+
+  if (high < 0 || low < 0 || (high && low > high) ||
+      (highbytes && lowbytes > highbytes)) {
+    error_set(dirq, EINVAL, "invalid watermarks: %d/%d %lu/%lu", high, low,
+              (unsigned long)highbytes, (unsigned long)lowbytes);
+    return(-1);
+  }
+  dirq->highcount = high;
+  dirq->lowcount = low;
+  dirq->highbytes = highbytes;
+  dirq->lowbytes = lowbytes;
+  dirq->full = 0;
+  /* the producers must maintain the counter from now on */
+  counter = (high || highbytes) ? _count_map(dirq, 1) : NULL;
+  if (counter && counter->synced == 0 && dirq_count(dirq) < 0)
+    return(-1);
+  return(0);
+}
+
+/*
+ * dirq_set_full_policy(DIRQ, POLICY, TIMEOUT): 0 success | -1 error
+ */
+
+int dirq_set_full_policy (dirq_t dirq, int policy, int timeout)
+{
+  if (policy != DIRQ_FULL_BLOCK && policy != DIRQ_FULL_FAIL &&
+      policy != DIRQ_FULL_SHED) {
+    error_set(dirq, EINVAL, "invalid policy: %d", policy);
+    return(-1);
+  }
+  dirq->full_policy = policy;
+  dirq->full_timeout = timeout;
+  return(0);
+}
@@ -0,0 +1,39 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq counter support                                                       *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define COUNT_FILE   ".count" /* name of the counter file */
+#define COUNT_MAXAGE 600      /* maximum time between two synchronizations */
+#define COUNT_POLL   10       /* polling interval when blocked (in ms) */
+
+/*
+ * types
+ */
+
+struct count_s {
+  int64_t      count;         /* approximate number of elements */
+  int64_t      synced;        /* last synchronization time (0: never) */
+  int64_t      bytes;         /* approximate size of the elements */
+};
+
+/*
+ * functions
+ */
+
+static off_t count_size (dirq_t dirq, const char *path);
+static void count_update (dirq_t dirq, int delta, off_t bytes);
+static void count_sync (dirq_t dirq, int count);
+static void count_unmap (dirq_t dirq);
+static int count_refresh (dirq_t dirq);
+static int count_admit (dirq_t dirq);
@@ -36,8 +36,20 @@ typedef int (*iter_cb)(dirq_t, const char *, int);
 
 static void iter_reset (dirq_t dirq)
 {
+  DIR *dirp;
+
   dirq->dirs_index = dirq->dirs_count = 0;
   dirq->elts_index = dirq->elts_count = 0;
+  if (dirq->iter_eltp) {
+    dirp = dirq->iter_eltp;
+    dirq->iter_eltp = NULL;
+    (void) closedir(dirp); /* read only so nothing to check... */
+  }
+  if (dirq->iter_dirp) {
+    dirp = dirq->iter_dirp;
+    dirq->iter_dirp = NULL;
+    (void) closedir(dirp); /* read only so nothing to check... */
+  }
 }
 
 /*
@@ -141,6 +153,27 @@ static int _get_dirs (dirq_t dirq)
   return(0);
 }
 
+/*
+ * find the index of the first cached intermediate directory which is strictly
+ * greater than the given one (binary search in the sorted list)
+ */
+
+static int dirs_upper_bound (dirq_t dirq, const char *dir)
+{
+  int low, high, middle;
+
+  low = 0;
+  high = dirq->dirs_count;
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (strncmp(DIRBUF(dirq,middle), dir, DIRS_SIZE) <= 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return(low);
+}
+
 /*
  * get the list of elements (from the intermediate directory in tmp1)
  */
@@ -175,51 +208,283 @@ static int _get_elts (dirq_t dirq)
   return(0);
 }
 
+/*
+ * find the index of the first cached element which is not smaller than the
+ * given time key (binary search in the sorted list)
+ */
+
+static int _elts_lower_bound (dirq_t dirq, const char *key)
+{
+  int low, high, middle;
+
+  low = 0;
+  high = dirq->elts_count;
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (strncmp(ELTBUF(dirq,middle), key, TIME_KEY_LENGTH) < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return(low);
+}
+
+/*
+ * reverse a list of cached intermediate directories or elements
+ */
+
+static void _reverse (char *base, int count, int size)
+{
+  char tmp[ELTS_SIZE];
+  int i;
+
+  for (i = 0; i < count / 2; i++) {
+    memcpy(tmp, base + i * size, size);
+    memcpy(base + i * size, base + (count - 1 - i) * size, size);
+    memcpy(base + (count - 1 - i) * size, tmp, size);
+  }
+}
+
+/*
+ * start a new iteration at the given time key (if any)
+ */
+
+static const char *iter_start (dirq_t dirq, const char *key)
+{
+  struct timespec now;
+  int result, index;
+
+  /* elements in the future (i.e. delayed) are not visible yet */
+  dirq_now(dirq, &now);
+  set_time_key(dirq->limit_key, &now);
+  if (dirq->until_key[0] && strcmp(dirq->until_key, dirq->limit_key) < 0)
+    strcpy(dirq->limit_key, dirq->until_key);
+  if (dirq->order == DIRQ_ORDER_NONE) {
+    /* the directories will only be read (and not sorted) while iterating */
+    iter_reset(dirq);
+    dirq->iter_dirp = opendir(dirq->buffer);
+    if (!dirq->iter_dirp) {
+      error_set(dirq, errno, "cannot opendir(%s): %s", dirq->buffer, ERROR);
+      return(NULL);
+    }
+  } else {
+    result = _get_dirs(dirq);
+    if (result < 0)
+      return(NULL);
+    if (dirq->order == DIRQ_ORDER_LIFO) {
+      /* newest first: the key is then where the iteration stops */
+      _reverse(DIRBUF(dirq,0), dirq->dirs_count, DIRS_SIZE);
+    } else if (key[0]) {
+      /* skip the intermediate directories before the one holding the key */
+      index = dirs_upper_bound(dirq, key);
+      dirq->dirs_index = (index > 0) ? index - 1 : 0;
+    }
+  }
+  checkpoint_start(dirq);
+  if (key[0])
+    strcpy(dirq->start_key, key);
+  else
+    dirq->start_key[0] = '\0';
+  if (dirq->tier)
+    return(tier_first(dirq, key));
+  return(dirq_next(dirq));
+}
+
 /*
  * dirq_first(DIRQ): NAME | NULL end or error
  */
 
 const char *dirq_first (dirq_t dirq)
 {
-  int result;
-
-  result = _get_dirs(dirq);
-  if (result < 0)
+  if (dirq->packed && (dirq->from_key[0] || dirq->until_key[0])) {
+    packed_unsupported(dirq, "range");
     return(NULL);
-  return(dirq_next(dirq));
+  }
+  return(iter_start(dirq, dirq->from_key));
 }
 
 /*
- * dirq_next(DIRQ): NAME | NULL end or error
+ * dirq_seek(DIRQ, TIME): NAME | NULL end or error
  */
 
-const char *dirq_next (dirq_t dirq)
+const char *dirq_seek (dirq_t dirq, const struct timespec *ts)
 {
-  int result;
+  char key[TIME_KEY_LENGTH + 1];
 
-  if (dirq->elts_index < dirq->elts_count) {
-    assert(dirq->dirs_index > 0);
-    memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index-1), DIRS_SIZE);
-    *(TMP1NAME(dirq) + DIRS_SIZE) = '/';
-    strcpy(TMP1NAME(dirq) + DIRS_SIZE + 1, ELTBUF(dirq,dirq->elts_index));
-    dirq->elts_index++;
-    return(TMP1NAME(dirq));
+  if (dirq->packed) {
+    packed_unsupported(dirq, "seek");
+    return(NULL);
   }
-  while (dirq->dirs_index < dirq->dirs_count) {
-    memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index), DIRS_SIZE);
-    *(TMP1NAME(dirq) + DIRS_SIZE) = '\0';
-    result = _get_elts(dirq);
-    if (result < 0)
+  set_time_key(key, ts);
+  return(iter_start(dirq, key));
+}
+
+/*
+ * get the next element of the queue itself in directory order, i.e. as soon
+ * as it is read, without listing nor sorting anything
+ */
+
+static const char *_iter_next_unordered (dirq_t dirq)
+{
+  struct dirent *dp;
+  int len;
+
+  while (1) {
+    if (dirq->iter_eltp) {
+      errno = 0;
+      dp = readdir(dirq->iter_eltp);
+      if (dp) {
+        len = strlen(dp->d_name);
+        if (len != ELT_NAME_LENGTH || !_ishexstr(dp->d_name, len))
+          continue;
+        /* too recent or before the start of the iteration */
+        if (strncmp(dp->d_name, dirq->limit_key, TIME_KEY_LENGTH) > 0 ||
+            (dirq->start_key[0] &&
+             strncmp(dp->d_name, dirq->start_key, TIME_KEY_LENGTH) < 0))
+          continue;
+        sprintf(TMP1NAME(dirq), "%s/%s", dirq->iter_dir, dp->d_name);
+        if (!meta_match(dirq, TMP1NAME(dirq)))
+          continue;
+        return(TMP1NAME(dirq));
+      }
+      if (errno != 0) {
+        strcpy(TMP1NAME(dirq), dirq->iter_dir);
+        error_set(dirq, errno, "cannot readdir(%s): %s", TMP1BUF(dirq),
+                  ERROR);
+        return(NULL);
+      }
+      (void) closedir(dirq->iter_eltp); /* read only so nothing to check... */
+      dirq->iter_eltp = NULL;
+    }
+    if (!dirq->iter_dirp)
       return(NULL);
-    dirq->dirs_index++;
+    errno = 0;
+    dp = readdir(dirq->iter_dirp);
+    if (!dp) {
+      if (errno != 0) {
+        error_set(dirq, errno, "cannot readdir(%s): %s", dirq->buffer, ERROR);
+        return(NULL);
+      }
+      /* end of the queue directory */
+      iter_reset(dirq);
+      return(NULL);
+    }
+    len = strlen(dp->d_name);
+    if (len != DIR_NAME_LENGTH || !_ishexstr(dp->d_name, len))
+      continue;
+    if (strncmp(dp->d_name, dirq->limit_key, DIRS_SIZE) > 0)
+      continue;
+    strcpy(dirq->iter_dir, dp->d_name);
+    strcpy(TMP1NAME(dirq), dirq->iter_dir);
+    dirq->iter_eltp = opendir(TMP1BUF(dirq));
+    if (!dirq->iter_eltp) {
+      if (errno == ENOENT)
+        continue;
+      error_set(dirq, errno, "cannot opendir(%s): %s", TMP1BUF(dirq), ERROR);
+      return(NULL);
+    }
+  }
+}
+
+/*
+ * get the next element of the queue itself (i.e. not of its tier)
+ */
+
+static const char *iter_next (dirq_t dirq)
+{
+  int result;
+
+  if (dirq->order == DIRQ_ORDER_NONE)
+    return(_iter_next_unordered(dirq));
+  while (1) {
     if (dirq->elts_index < dirq->elts_count) {
+      assert(dirq->dirs_index > 0);
+      if (strncmp(ELTBUF(dirq,dirq->elts_index), dirq->limit_key,
+                  TIME_KEY_LENGTH) > 0) {
+        /* too recent: skip the rest of this intermediate directory */
+        if (dirq->order == DIRQ_ORDER_LIFO)
+          dirq->elts_index++;
+        else
+          dirq->elts_index = dirq->elts_count;
+        continue;
+      }
+      if (dirq->order == DIRQ_ORDER_LIFO && dirq->start_key[0] &&
+          strncmp(ELTBUF(dirq,dirq->elts_index), dirq->start_key,
+                  TIME_KEY_LENGTH) < 0) {
+        /* too old: this and all the following elements */
+        dirq->dirs_index = dirq->dirs_count;
+        dirq->elts_index = dirq->elts_count;
+        return(NULL);
+      }
+      memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index-1), DIRS_SIZE);
       *(TMP1NAME(dirq) + DIRS_SIZE) = '/';
       strcpy(TMP1NAME(dirq) + DIRS_SIZE + 1, ELTBUF(dirq,dirq->elts_index));
       dirq->elts_index++;
+      if (!meta_match(dirq, TMP1NAME(dirq)))
+        continue;
+      prefetch_hint(dirq);
       return(TMP1NAME(dirq));
     }
+    if (dirq->dirs_index >= dirq->dirs_count)
+      return(NULL);
+    if (strncmp(DIRBUF(dirq,dirq->dirs_index), dirq->limit_key,
+                DIRS_SIZE) > 0) {
+      if (dirq->order == DIRQ_ORDER_LIFO) {
+        /* too recent: only this intermediate directory */
+        dirq->dirs_index++;
+        continue;
+      }
+      /* too recent: this and all the following intermediate directories */
+      dirq->dirs_index = dirq->dirs_count;
+      return(NULL);
+    }
+    /* the iteration may have gone entirely through the previous one */
+    if (dirq->checkpoint)
+      checkpoint_next(dirq, DIRBUF(dirq,dirq->dirs_index-1), dirq->elts_count ?
+                      ELTBUF(dirq,dirq->elts_count-1) : NULL);
+    memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index), DIRS_SIZE);
+    *(TMP1NAME(dirq) + DIRS_SIZE) = '\0';
+    result = _get_elts(dirq);
+    if (result < 0)
+      return(NULL);
+    dirq->dirs_index++;
+    if (dirq->order == DIRQ_ORDER_LIFO)
+      _reverse(ELTBUF(dirq,0), dirq->elts_count, ELTS_SIZE);
+    else if (dirq->start_key[0])
+      dirq->elts_index = _elts_lower_bound(dirq, dirq->start_key);
+    if (dirq->prefetch)
+      dirq->prefetch->next = 0; /* new list of elements */
   }
-  return(NULL);
+}
+
+/*
+ * dirq_next(DIRQ): NAME | NULL end or error
+ */
+
+const char *dirq_next (dirq_t dirq)
+{
+  if (dirq->packed)
+    return(packed_next(dirq));
+  if (dirq->tier)
+    return(tier_next(dirq));
+  return(iter_next(dirq));
+}
+
+/*
+ * dirq_set_range(DIRQ, FROM, UNTIL)
+ */
+
+void dirq_set_range (dirq_t dirq, const struct timespec *from,
+                     const struct timespec *until)
+{
+  if (from)
+    set_time_key(dirq->from_key, from);
+  else
+    dirq->from_key[0] = '\0';
+  if (until)
+    set_time_key(dirq->until_key, until);
+  else
+    dirq->until_key[0] = '\0';
 }
 
 /*
@@ -230,6 +495,12 @@ int dirq_count (dirq_t dirq)
 {
   int count, result;
 
+  if (dirq->packed) {
+    count = packed_count(dirq);
+    if (count >= 0)
+      count_sync(dirq, count);
+    return(count);
+  }
   count = 0;
   result = _get_dirs(dirq);
   if (result < 0)
@@ -244,95 +515,421 @@ int dirq_count (dirq_t dirq)
     dirq->dirs_index++;
   }
   iter_reset(dirq); /* we have messed up with the iterator... */
+  count_sync(dirq, count);
+  if (dirq->tier) {
+    result = tier_error(dirq, dirq_count(dirq->tier->fast));
+    if (result < 0)
+      return(-1);
+    count += result;
+  }
   return(count);
 }
 
 /*
- * dir_purge(DIRQ): COUNT removals | -1 error
+ * find the oldest element by listing the intermediate directories once and
+ * then, in order, only keeping the smallest element name of each one until
+ * an element is found, without building the lists of elements and without
+ * touching the iterator: 1 found (name in tmp2) | 0 empty | -1 error
  */
 
-/* locally abuse unused fields in the dirq object for purging... */
-#define purge_maxlock elts_index
-#define purge_maxtemp elts_offset
+static int _oldest_dirs_cb (dirq_t dirq, const char *name, int len)
+{
+  if (len == DIR_NAME_LENGTH && _ishexstr(name, len)) {
+    if (dirq->oldest_count % 256 == 0)
+      dirq->oldest_dirs = (char *)safe_realloc((void *)dirq->oldest_dirs,
+                            (dirq->oldest_count + 256) * DIRS_SIZE);
+    memcpy(dirq->oldest_dirs + dirq->oldest_count * DIRS_SIZE, name,
+           DIRS_SIZE);
+    dirq->oldest_count++;
+  }
+  return(0);
+}
 
-static int _purge_cb (dirq_t dirq, const char *name, int len)
+static int _oldest_elt_cb (dirq_t dirq, const char *name, int len)
 {
-  struct stat sb;
+  char *oldest;
+
+  if (len != ELT_NAME_LENGTH || !_ishexstr(name, len))
+    return(0);
+  oldest = TMP2NAME(dirq) + DIRS_SIZE + 1;
+  if (oldest[0] && strncmp(name, oldest, ELT_NAME_LENGTH) >= 0)
+    return(0);
+  memcpy(oldest, name, ELT_NAME_LENGTH);
+  oldest[ELT_NAME_LENGTH] = '\0';
+  return(0);
+}
 
-  if ((dirq->purge_maxlock != 0 || dirq->purge_maxtemp != 0) &&
-      len >= SUFFIX_LENGTH && name[len - SUFFIX_LENGTH] == '.') {
-    /* dot file to maybe remove... */
-    strncpy(TMP2NAME(dirq) + DIRS_SIZE + 1, name, len);
-    *(TMP2NAME(dirq) + DIRS_SIZE + 1 + len) = '\0';
-    if (stat(TMP2BUF(dirq), &sb) != 0) {
-      if (errno == ENOENT)
-        return(0);
-      error_set(dirq, errno, "cannot stat(%s): %s", TMP2BUF(dirq), ERROR);
+static int _oldest (dirq_t dirq)
+{
+  int i, result;
+
+  dirq->oldest_dirs = NULL;
+  dirq->oldest_count = 0;
+  result = _iterate(dirq, 0, _oldest_dirs_cb);
+  if (result == 0 && dirq->oldest_count > 0)
+    qsort(dirq->oldest_dirs, dirq->oldest_count, DIRS_SIZE, _get_dirs_cmp);
+  for (i = 0; result == 0 && i < dirq->oldest_count; i++) {
+    memcpy(TMP1NAME(dirq), dirq->oldest_dirs + i * DIRS_SIZE, DIRS_SIZE);
+    *(TMP1NAME(dirq) + DIRS_SIZE) = '\0';
+    memcpy(TMP2NAME(dirq), TMP1NAME(dirq), DIRS_SIZE);
+    *(TMP2NAME(dirq) + DIRS_SIZE + 1) = '\0';
+    if (_iterate(dirq, dirq->tmp1_offset, _oldest_elt_cb) < 0)
+      result = -1;
+    /* elements only come after the ones of the previous directories */
+    else if (*(TMP2NAME(dirq) + DIRS_SIZE + 1))
+      result = 1;
+  }
+  free((void *)dirq->oldest_dirs);
+  dirq->oldest_dirs = NULL;
+  dirq->oldest_count = 0;
+  if (result > 0)
+    *(TMP2NAME(dirq) + DIRS_SIZE) = '/';
+  return(result);
+}
+
+/*
+ * dirq_oldest(DIRQ, NAME, TIME): 1 found | 0 empty | -1 error
+ */
+
+int dirq_oldest (dirq_t dirq, const char **name, struct timespec *ts)
+{
+  struct timespec when, fwhen, now;
+  const char *fname;
+  unsigned int sec, usec;
+  int result, fresult;
+
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "oldest"));
+  result = _oldest(dirq);
+  if (result < 0)
+    return(-1);
+  if (result > 0) {
+    if (sscanf(TMP2NAME(dirq) + DIRS_SIZE + 1, "%8x%5x", &sec, &usec) != 2)
+      return(0);
+    when.tv_sec = sec;
+    when.tv_nsec = usec * 1000;
+    /* elements in the future (i.e. delayed) are not visible yet */
+    dirq_now(dirq, &now);
+    if (when.tv_sec > now.tv_sec ||
+        (when.tv_sec == now.tv_sec && when.tv_nsec > now.tv_nsec))
+      result = 0;
+  }
+  if (dirq->tier) {
+    /* the oldest element may be in the fast queue */
+    fresult = tier_error(dirq, dirq_oldest(dirq->tier->fast, &fname, &fwhen));
+    if (fresult < 0)
       return(-1);
+    if (fresult > 0 && (result == 0 || fwhen.tv_sec < when.tv_sec ||
+                        (fwhen.tv_sec == when.tv_sec &&
+                         fwhen.tv_nsec < when.tv_nsec))) {
+      strcpy(TMP2NAME(dirq), fname);
+      when = fwhen;
+      result = 1;
     }
-    if (dirq->purge_maxlock != 0 &&
-        strcmp(&name[len - SUFFIX_LENGTH], LOCKED_SUFFIX) == 0 &&
-        sb.st_mtime < dirq->purge_maxlock) {
-      if (unlink(TMP2BUF(dirq)) != 0) {
-        if (errno == ENOENT)
-          return(0);
-        error_set(dirq, errno, "cannot unlink(%s): %s", TMP2BUF(dirq), ERROR);
-        return(-1);
-      }
-      return(1);
-    }
-    if (dirq->purge_maxtemp != 0 &&
-        strcmp(&name[len - SUFFIX_LENGTH], TEMPORARY_SUFFIX) == 0 &&
-        sb.st_mtime < dirq->purge_maxtemp) {
-      if (unlink(TMP2BUF(dirq)) != 0) {
-        if (errno == ENOENT)
-          return(0);
-        error_set(dirq, errno, "cannot unlink(%s): %s", TMP2BUF(dirq), ERROR);
-        return(-1);
-      }
+  }
+  if (result == 0)
+    return(0);
+  if (name)
+    *name = TMP2NAME(dirq);
+  if (ts)
+    *ts = when;
+  return(1);
+}
+
+/*
+ * dirq_age(DIRQ): SECONDS | -1 error
+ */
+
+int dirq_age (dirq_t dirq)
+{
+  struct timespec when, now;
+  int result;
+
+  result = dirq_oldest(dirq, NULL, &when);
+  if (result <= 0)
+    return(result);
+  dirq_now(dirq, &now);
+  return((now.tv_sec > when.tv_sec) ? (int)(now.tv_sec - when.tv_sec) : 0);
+}
+
+/*
+ * purge rules shared by dirq_purge() and dirq_purge_step(), the two engines
+ * only differing in the way they get the modification time of an entry
+ */
+
+#define PURGE_KEEP   0  /* entry to keep */
+#define PURGE_SKIP   1  /* entry vanished meanwhile */
+#define PURGE_DONE   2  /* entry (packed segment) already removed */
+#define PURGE_UNLINK 3  /* entry (old temporary or orphan sidecar) to remove */
+#define PURGE_LOCK   4  /* entry (stale lock) to remove after dead letter */
+
+typedef int (*purge_mtime_t)(int dirfd, const char *name, time_t *mtime);
+
+/*
+ * check if the element of a sidecar file is gone
+ */
+
+static int _purge_orphan (int dirfd, const char *name, int len)
+{
+  char element[MAXPATHLEN];
+
+  snprintf(element, sizeof(element), "%.*s", len - SUFFIX_LENGTH, name);
+  return(faccessat(dirfd, element, F_OK, 0) != 0 && errno == ENOENT);
+}
+
+/*
+ * tell what to do with the given entry of an intermediate directory:
+ * PURGE_* | -1 error (with errno set)
+ */
+
+static int purge_check (int dirfd, const char *name, int len,
+                        uint32_t oldlock, uint32_t oldtemp,
+                        purge_mtime_t purge_mtime)
+{
+  const char *suffix;
+  time_t mtime;
+  int result;
+
+  if (len == PACKED_ID_LENGTH + SUFFIX_LENGTH &&
+      strcmp(&name[PACKED_ID_LENGTH], SEGMENT_SUFFIX) == 0) {
+    /* packed segment to maybe remove... */
+    result = packed_purge_segment(dirfd, name);
+    if (result < 0)
+      return(-1);
+    return(result > 0 ? PURGE_DONE : PURGE_KEEP);
+  }
+  if ((oldlock == 0 && oldtemp == 0) ||
+      len < SUFFIX_LENGTH || name[len - SUFFIX_LENGTH] != '.')
+    return(PURGE_KEEP);
+  /* dot file to maybe remove... */
+  if (purge_mtime(dirfd, name, &mtime) != 0)
+    return((errno == ENOENT) ? PURGE_SKIP : -1);
+  suffix = &name[len - SUFFIX_LENGTH];
+  if (oldlock != 0 && strcmp(suffix, LOCKED_SUFFIX) == 0 && mtime < oldlock)
+    return(PURGE_LOCK);
+  if (oldtemp != 0 && strcmp(suffix, TEMPORARY_SUFFIX) == 0 && mtime < oldtemp)
+    return(PURGE_UNLINK);
+  if (oldtemp != 0 && mtime < oldtemp &&
+      (strcmp(suffix, META_SUFFIX) == 0 ||
+       strcmp(suffix, ATTEMPTS_SUFFIX) == 0) &&
+      _purge_orphan(dirfd, name, len))
+    return(PURGE_UNLINK);
+  return(PURGE_KEEP);
+}
+
+/*
+ * get the modification time of an entry in the given directory (the
+ * incremental engine uses plain stat, see _purge_mtime() for the other one)
+ */
+
+static int _purge_stat (int dirfd, const char *name, time_t *mtime)
+{
+  struct stat sb;
+
+  if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+    return(-1);
+  *mtime = sb.st_mtime;
+  return(0);
+}
+
+/*
+ * move the element of a stale lock (in tmp2) to the dead letter queue if it
+ * has used all its delivery attempts
+ */
+
+static int _purge_deadletter (dirq_t dirq, int len)
+{
+  char *suffix;
+  int result;
+
+  suffix = TMP2NAME(dirq) + DIRS_SIZE + 1 + len - SUFFIX_LENGTH;
+  *suffix = '\0';
+  result = 0;
+  if (get_attempts(dirq, TMP2BUF(dirq)) >= dirq->maxattempts &&
+      move_to_deadletter(dirq, TMP2BUF(dirq)) != 0 &&
+      dirq_get_errcode(dirq->deadletter) != ENOENT) {
+    error_set(dirq, dirq_get_errcode(dirq->deadletter), "%s",
+              dirq_get_errstr(dirq->deadletter));
+    result = -1;
+  }
+  *suffix = '.';
+  return(result);
+}
+
+/*
+ * purge the given entry (from the intermediate directory in tmp2 being read):
+ * return 1 if it has been removed, 0 if not (and count it as kept unless it
+ * vanished meanwhile) or -1 on error
+ */
+
+static int _purge_entry (dirq_t dirq, const char *name, int len, int *kept)
+{
+  int fd;
+
+  fd = dirfd(dirq->purge_dirp);
+  strncpy(TMP2NAME(dirq) + DIRS_SIZE + 1, name, len);
+  *(TMP2NAME(dirq) + DIRS_SIZE + 1 + len) = '\0';
+  switch (purge_check(fd, name, len, dirq->purge_oldlock,
+                      dirq->purge_oldtemp, _purge_stat)) {
+  case PURGE_KEEP:
+    /* count it to prevent parent directory removal */
+    (*kept)++;
+    return(0);
+  case PURGE_SKIP:
+    return(0);
+  case PURGE_DONE:
+    return(1);
+  case PURGE_LOCK:
+    if (dirq->deadletter && _purge_deadletter(dirq, len) != 0)
+      return(-1);
+    /* FALLTHROUGH */
+  case PURGE_UNLINK:
+    if (unlinkat(fd, name, 0) == 0)
       return(1);
-    }
+    if (errno == ENOENT)
+      return(0);
+    break;
+  }
+  error_set(dirq, errno, "cannot purge(%s): %s", TMP2BUF(dirq), ERROR);
+  return(-1);
+}
+
+/*
+ * dirq_purge_step(DIRQ, BUDGET): COUNT removals | -1 error
+ *
+ * the position (list of intermediate directories and directory being read) is
+ * kept in dedicated fields so that the iterator is left untouched
+ */
+
+static void purge_reset (dirq_t dirq)
+{
+  if (dirq->purge_dirp)
+    (void) closedir(dirq->purge_dirp); /* best effort cleanup... */
+  free((void *)dirq->purge_dirs);
+  dirq->purge_dirp = NULL;
+  dirq->purge_dirs = NULL;
+  dirq->purge_count = dirq->purge_index = 0;
+}
+
+static int _purge_dirs_cb (dirq_t dirq, const char *name, int len)
+{
+  if (len == DIR_NAME_LENGTH && _ishexstr(name, len)) {
+    if (dirq->purge_count % 256 == 0)
+      dirq->purge_dirs = (char *)safe_realloc((void *)dirq->purge_dirs,
+                            (dirq->purge_count + 256) * DIRS_SIZE);
+    memcpy(dirq->purge_dirs + dirq->purge_count * DIRS_SIZE, name, DIRS_SIZE);
+    dirq->purge_count++;
   }
-  /* count it to prevent parent directory removal */
-  dirq->elts_count++;
   return(0);
 }
 
-int dirq_purge (dirq_t dirq)
+static int _purge_start (dirq_t dirq)
 {
-  int count, result;
+  int result;
   uint32_t now;
 
-  count = 0;
-  result = _get_dirs(dirq);
+  dirq->purge_dirs = (char *)safe_malloc(256 * DIRS_SIZE);
+  result = _iterate(dirq, 0, _purge_dirs_cb);
   if (result < 0)
-    return(-1);
+    return(result);
+  if (dirq->purge_count > 0)
+    qsort(dirq->purge_dirs, dirq->purge_count, DIRS_SIZE, _get_dirs_cmp);
   now = (uint32_t)time(NULL);
-  dirq->purge_maxlock = dirq->maxlock ? (now - dirq->maxlock) : 0;
-  dirq->purge_maxtemp = dirq->maxtemp ? (now - dirq->maxtemp) : 0;
-  while (dirq->dirs_index < dirq->dirs_count) {
-    memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index), DIRS_SIZE);
-    *(TMP1NAME(dirq) + DIRS_SIZE) = '\0';
-    memmove(TMP2NAME(dirq), DIRBUF(dirq,dirq->dirs_index), DIRS_SIZE);
-    *(TMP2NAME(dirq) + DIRS_SIZE) = '/';
-    dirq->elts_count = 0;
-    result = _iterate(dirq, dirq->tmp1_offset, _purge_cb);
-    if (result < 0)
+  dirq->purge_oldlock = dirq->maxlock ? (now - dirq->maxlock) : 0;
+  dirq->purge_oldtemp = dirq->maxtemp ? (now - dirq->maxtemp) : 0;
+  return(0);
+}
+
+int dirq_purge_step (dirq_t dirq, int budget)
+{
+  struct dirent *dp;
+  int count, result;
+
+  count = 0;
+  if (!dirq->purge_dirs) {
+    /* start a new pass */
+    result = _purge_start(dirq);
+    if (result < 0) {
+      purge_reset(dirq);
       return(-1);
-    count += result;
-    if (dirq->elts_count == 0 && dirq->dirs_index < dirq->dirs_count - 1) {
-      /* remove empty intermediate directories except the last one */
-      if (rmdir(TMP1BUF(dirq)) != 0 && errno != ENOENT) {
-        error_set(dirq, errno, "cannot rmdir(%s): %s", TMP1BUF(dirq), ERROR);
+    }
+    /* the (small) tier is purged at once */
+    if (dirq->tier) {
+      result = tier_purge(dirq);
+      if (result < 0) {
+        purge_reset(dirq);
         return(-1);
       }
-      count++;
+      count += result;
     }
-    dirq->dirs_index++;
   }
-  iter_reset(dirq); /* we have messed up with the iterator... */
+  while (budget > 0) {
+    if (dirq->purge_index >= dirq->purge_count) {
+      /* end of this pass */
+      purge_reset(dirq);
+      break;
+    }
+    memmove(TMP2NAME(dirq), dirq->purge_dirs + dirq->purge_index * DIRS_SIZE,
+            DIRS_SIZE);
+    *(TMP2NAME(dirq) + DIRS_SIZE) = '\0';
+    if (!dirq->purge_dirp) {
+      dirq->purge_dirp = opendir(TMP2BUF(dirq));
+      if (!dirq->purge_dirp) {
+        if (errno != ENOENT) {
+          error_set(dirq, errno, "cannot opendir(%s): %s", TMP2BUF(dirq),
+                    ERROR);
+          purge_reset(dirq);
+          return(-1);
+        }
+        dirq->purge_index++;
+        continue;
+      }
+      dirq->purge_kept = 0;
+    }
+    errno = 0;
+    dp = readdir(dirq->purge_dirp);
+    budget--;
+    if (!dp) {
+      if (errno != 0) {
+        error_set(dirq, errno, "cannot readdir(%s): %s", TMP2BUF(dirq), ERROR);
+        purge_reset(dirq);
+        return(-1);
+      }
+      /* end of directory */
+      if (closedir(dirq->purge_dirp) < 0) {
+        dirq->purge_dirp = NULL;
+        error_set(dirq, errno, "cannot closedir(%s): %s", TMP2BUF(dirq),
+                  ERROR);
+        purge_reset(dirq);
+        return(-1);
+      }
+      dirq->purge_dirp = NULL;
+      if (dirq->purge_kept == 0 && dirq->purge_index < dirq->purge_count - 1) {
+        /* remove empty intermediate directories except the last one */
+        if (rmdir(TMP2BUF(dirq)) != 0 && errno != ENOENT) {
+          error_set(dirq, errno, "cannot rmdir(%s): %s", TMP2BUF(dirq), ERROR);
+          purge_reset(dirq);
+          return(-1);
+        }
+        count++;
+      }
+      dirq->purge_index++;
+      continue;
+    }
+    if (dp->d_name[0] == '.') {
+      if (dp->d_name[1] == '\0')
+        continue;
+      if (dp->d_name[1] == '.' && dp->d_name[2] == '\0')
+        continue;
+    }
+    *(TMP2NAME(dirq) + DIRS_SIZE) = '/';
+    result = _purge_entry(dirq, dp->d_name, strlen(dp->d_name),
+                          &dirq->purge_kept);
+    if (result < 0) {
+      purge_reset(dirq);
+      return(-1);
+    }
+    count += result;
+  }
   return(count);
 }
-
-#undef purge_maxlock
-#undef purge_maxtemp
@@ -14,3 +14,7 @@
  */
 
 static void iter_reset (dirq_t dirq);
+static const char *iter_start (dirq_t dirq, const char *key);
+static const char *iter_next (dirq_t dirq);
+static void purge_reset (dirq_t dirq);
+static int dirs_upper_bound (dirq_t dirq, const char *dir);
@@ -0,0 +1,423 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq local delivery support                                                *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * elements added via an object with local delivery are kept in memory, in a
+ * ring buffer shared by all the copies of this object (typically used by
+ * other threads), where they can be taken by local consumers; a write-behind
+ * thread persists the elements that are not acknowledged in time: pending
+ * ones are then only available from the queue while taken ones are kept so
+ * that their acknowledgment also removes them from the queue
+ */
+
+/*
+ * compare two times
+ */
+
+static int _local_cmp (const struct timespec *ts1, const struct timespec *ts2)
+{
+  if (ts1->tv_sec != ts2->tv_sec)
+    return((ts1->tv_sec < ts2->tv_sec) ? -1 : 1);
+  if (ts1->tv_nsec != ts2->tv_nsec)
+    return((ts1->tv_nsec < ts2->tv_nsec) ? -1 : 1);
+  return(0);
+}
+
+/*
+ * free a slot and forget about the free slots at the beginning of the ring
+ */
+
+static void _local_free (struct local_s *local, struct local_elt_s *elt)
+{
+  free((void *)elt->data);
+  elt->data = NULL;
+  elt->state = LOCAL_FREE;
+  while (local->used > 0 && local->elts[local->head].state == LOCAL_FREE) {
+    local->head = (local->head + 1) % local->capacity;
+    local->used--;
+  }
+}
+
+/*
+ * find the slot holding the given element (in the given state) or NULL
+ */
+
+static struct local_elt_s *_local_find (struct local_s *local,
+                                        const char *name, char state)
+{
+  struct local_elt_s *elt;
+  int i;
+
+  for (i = 0; i < local->used; i++) {
+    elt = &local->elts[(local->head + i) % local->capacity];
+    if (elt->state == state && (!name || strcmp(elt->name, name) == 0))
+      return(elt);
+  }
+  return(NULL);
+}
+
+/*
+ * share the local delivery state with a copy of the object
+ */
+
+static struct local_s *local_share (struct local_s *local)
+{
+  pthread_mutex_lock(&local->mutex);
+  local->refs++;
+  pthread_mutex_unlock(&local->mutex);
+  return(local);
+}
+
+/*
+ * add data (via callback) to the ring: 0 success (name in tmp2) | 1 ring full
+ * | -1 error
+ */
+
+static int local_add (dirq_t dirq, dirq_iow callback)
+{
+  struct local_s *local;
+  struct local_elt_s *elt;
+  struct timespec when;
+  uint32_t now;
+  size_t allocated;
+  ssize_t length;
+  char *data;
+
+  local = dirq->local;
+  dirq_now(dirq, &when);
+  pthread_mutex_lock(&local->mutex);
+  if (local->used == local->capacity) {
+    pthread_mutex_unlock(&local->mutex);
+    return(1);
+  }
+  elt = &local->elts[(local->head + local->used) % local->capacity];
+  local->used++;
+  elt->state = LOCAL_WRITING;
+  /* the element is named as if it had been added to the queue */
+  if (_local_cmp(&when, &local->last) <= 0) {
+    when = local->last;
+    if ((when.tv_nsec += 1000) >= 1000000000) {
+      when.tv_sec++;
+      when.tv_nsec -= 1000000000;
+    }
+  }
+  local->last = when;
+  now = (uint32_t)when.tv_sec;
+  if (dirq->granularity)
+    now -= now % dirq->granularity;
+  sprintf(elt->name, "%08x/%08x%05x%01x", now, (uint32_t)when.tv_sec,
+          (uint32_t)(when.tv_nsec / 1000), (uint32_t)dirq->rndhex);
+  elt->stored[0] = '\0';
+  elt->when = when;
+  elt->due = when;
+  elt->due.tv_sec += local->delay / 1000;
+  elt->due.tv_nsec += (local->delay % 1000) * 1000000;
+  if (elt->due.tv_nsec >= 1000000000) {
+    elt->due.tv_sec++;
+    elt->due.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_unlock(&local->mutex);
+  /* gather the data outside of the lock */
+  data = NULL;
+  allocated = 0;
+  length = gather_data(dirq, callback, &data, &allocated, 0);
+  if (length < 0) {
+    free((void *)data);
+    pthread_mutex_lock(&local->mutex);
+    _local_free(local, elt);
+    pthread_mutex_unlock(&local->mutex);
+    return(-1);
+  }
+  pthread_mutex_lock(&local->mutex);
+  elt->data = data;
+  elt->length = length;
+  elt->state = LOCAL_PENDING;
+  strcpy(TMP2NAME(dirq), elt->name);
+  pthread_cond_signal(&local->cond);
+  pthread_mutex_unlock(&local->mutex);
+  return(0);
+}
+
+/*
+ * remove a persisted element from the queue (too late if somebody else
+ * already locked it)
+ */
+
+static int _local_remove (dirq_t dirq, const char *name)
+{
+  int result;
+
+  result = dirq_lock(dirq, name, 1);
+  if (result != 0)
+    return((result < 0) ? -1 : 0);
+  return(dirq_remove(dirq, name));
+}
+
+/*
+ * write-behind thread: persist the elements not acknowledged in time
+ */
+
+static int _local_read (dirq_t dirq, char *buffer, size_t length)
+{
+  struct local_s *local;
+  size_t chunk;
+
+  local = dirq->local;
+  chunk = local->flength - local->foffset;
+  if (chunk > length)
+    chunk = length;
+  memcpy(buffer, local->fdata + local->foffset, chunk);
+  local->foffset += chunk;
+  return((int)chunk);
+}
+
+static void *_local_thread (void *arg)
+{
+  struct local_s *local;
+  struct local_elt_s *elt, *next;
+  struct timespec now, due, when;
+  char name[ELEMENT_LENGTH + 1];
+  const char *stored;
+  int i;
+
+  local = (struct local_s *)arg;
+  pthread_mutex_lock(&local->mutex);
+  while (1) {
+    dirq_now(local->dirq, &now);
+    due = now;
+    due.tv_sec++;
+    elt = NULL;
+    for (i = 0; i < local->used; i++) {
+      next = &local->elts[(local->head + i) % local->capacity];
+      if ((next->state != LOCAL_PENDING && next->state != LOCAL_TAKEN) ||
+          next->stored[0])
+        continue;
+      if (local->stop || _local_cmp(&next->due, &now) <= 0) {
+        elt = next;
+        break;
+      }
+      if (_local_cmp(&next->due, &due) < 0)
+        due = next->due;
+    }
+    if (!elt) {
+      if (local->stop)
+        break;
+      (void) pthread_cond_timedwait(&local->cond, &local->mutex, &due);
+      continue;
+    }
+    elt->flushing = 1;
+    local->fdata = elt->data;
+    local->flength = elt->length;
+    local->foffset = 0;
+    when = elt->when;
+    pthread_mutex_unlock(&local->mutex);
+    stored = _add(local->dirq, _local_read,
+                  local->dirq->packed ? NULL : &when);
+    pthread_mutex_lock(&local->mutex);
+    elt->flushing = 0;
+    if (!stored) {
+      dirq_clear_error(local->dirq);
+      if (local->stop || elt->state == LOCAL_DONE) {
+        /* nothing else can (or needs to) be done */
+        _local_free(local, elt);
+      } else {
+        /* try again later */
+        elt->due = now;
+        elt->due.tv_sec++;
+      }
+      continue;
+    }
+    strcpy(elt->stored, stored);
+    if (elt->state == LOCAL_PENDING) {
+      /* now only available from the queue */
+      _local_free(local, elt);
+    } else if (elt->state == LOCAL_DONE) {
+      /* acknowledged meanwhile */
+      strcpy(name, elt->stored);
+      _local_free(local, elt);
+      pthread_mutex_unlock(&local->mutex);
+      if (_local_remove(local->dirq, name) != 0)
+        dirq_clear_error(local->dirq);
+      pthread_mutex_lock(&local->mutex);
+    }
+  }
+  pthread_mutex_unlock(&local->mutex);
+  return(NULL);
+}
+
+/*
+ * stop using local delivery (the last object also persists what is left)
+ */
+
+static void local_release (dirq_t dirq)
+{
+  struct local_s *local;
+  int i, last;
+
+  local = dirq->local;
+  if (!local)
+    return;
+  dirq->local = NULL;
+  pthread_mutex_lock(&local->mutex);
+  last = (--local->refs == 0);
+  if (last) {
+    local->stop = 1;
+    pthread_cond_signal(&local->cond);
+  }
+  pthread_mutex_unlock(&local->mutex);
+  if (!last)
+    return;
+  pthread_join(local->thread, NULL);
+  for (i = 0; i < local->capacity; i++)
+    free((void *)local->elts[i].data);
+  free((void *)local->elts);
+  pthread_cond_destroy(&local->cond);
+  pthread_mutex_destroy(&local->mutex);
+  local->dirq->local = NULL;
+  dirq_free(local->dirq);
+  free((void *)local);
+}
+
+/*
+ * dirq_local_start(DIRQ, CAPACITY, DELAY): 0 success | -1 error
+ */
+
+int dirq_local_start (dirq_t dirq, int capacity, int delay)
+{
+  struct local_s *local;
+  int result;
+
+  if (dirq->local) {
+    error_set(dirq, EBUSY, "local delivery already started");
+    return(-1);
+  }
+  local = (struct local_s *)safe_malloc(sizeof(struct local_s));
+  memset((void *)local, 0, sizeof(struct local_s));
+  local->refs = 1;
+  local->capacity = (capacity < 1) ? 1 : capacity;
+  local->delay = (delay < 0) ? 0 : delay;
+  local->elts = (struct local_elt_s *)
+    safe_malloc(local->capacity * sizeof(struct local_elt_s));
+  memset((void *)local->elts, 0, local->capacity * sizeof(struct local_elt_s));
+  /* the thread works on its own copy as objects are not thread safe */
+  local->dirq = dirq_copy(dirq);
+  local->dirq->local = local; /* not counted, only used by _local_read() */
+  pthread_mutex_init(&local->mutex, NULL);
+  pthread_cond_init(&local->cond, NULL);
+  result = pthread_create(&local->thread, NULL, _local_thread, local);
+  if (result != 0) {
+    error_set(dirq, result, "cannot pthread_create(): %s", strerror(result));
+    pthread_cond_destroy(&local->cond);
+    pthread_mutex_destroy(&local->mutex);
+    local->dirq->local = NULL;
+    dirq_free(local->dirq);
+    free((void *)local->elts);
+    free((void *)local);
+    return(-1);
+  }
+  dirq->local = local;
+  return(0);
+}
+
+/*
+ * dirq_local_stop(DIRQ)
+ */
+
+void dirq_local_stop (dirq_t dirq)
+{
+  local_release(dirq);
+}
+
+/*
+ * dirq_local_take(DIRQ, CALLBACK): NAME | NULL none or error
+ */
+
+const char *dirq_local_take (dirq_t dirq, dirq_ior callback)
+{
+  struct local_s *local;
+  struct local_elt_s *elt;
+  char name[ELEMENT_LENGTH + 1];
+  size_t length;
+  char *data;
+  int result;
+
+  local = dirq->local;
+  if (!local)
+    return(NULL);
+  pthread_mutex_lock(&local->mutex);
+  elt = _local_find(local, NULL, LOCAL_PENDING);
+  if (elt) {
+    elt->state = LOCAL_TAKEN;
+    strcpy(name, elt->name);
+    /* the slot cannot be used once unlocked so its data is copied */
+    length = elt->length;
+    data = (char *)safe_malloc(length ? length : 1);
+    memcpy(data, elt->data, length);
+  }
+  pthread_mutex_unlock(&local->mutex);
+  if (!elt)
+    return(NULL);
+  result = callback(dirq, data, length);
+  if (result == 0 && length > 0)
+    result = callback(dirq, data + length, 0);
+  free((void *)data);
+  if (result != 0) {
+    pthread_mutex_lock(&local->mutex);
+    elt = _local_find(local, name, LOCAL_TAKEN);
+    if (elt) {
+      if (elt->stored[0] && !elt->flushing)
+        _local_free(local, elt); /* only available from the queue */
+      else
+        elt->state = LOCAL_PENDING;
+    }
+    pthread_mutex_unlock(&local->mutex);
+    error_set(dirq, result, "cannot read(%s): %d", name, result);
+    return(NULL);
+  }
+  strcpy(TMP1NAME(dirq), name);
+  return(TMP1NAME(dirq));
+}
+
+/*
+ * dirq_local_ack(DIRQ, NAME): 0 success | -1 error
+ */
+
+int dirq_local_ack (dirq_t dirq, const char *name)
+{
+  struct local_s *local;
+  struct local_elt_s *elt;
+  char stored[ELEMENT_LENGTH + 1];
+
+  local = dirq->local;
+  if (!local) {
+    error_set(dirq, EINVAL, "cannot ack(%s): %s", name, "no local delivery");
+    return(-1);
+  }
+  pthread_mutex_lock(&local->mutex);
+  elt = _local_find(local, name, LOCAL_TAKEN);
+  if (!elt) {
+    pthread_mutex_unlock(&local->mutex);
+    error_set(dirq, ENOENT, "cannot ack(%s): %s", name, strerror(ENOENT));
+    return(-1);
+  }
+  if (elt->flushing) {
+    /* the write-behind thread will take care of it */
+    elt->state = LOCAL_DONE;
+    pthread_mutex_unlock(&local->mutex);
+    return(0);
+  }
+  strcpy(stored, elt->stored);
+  _local_free(local, elt);
+  pthread_mutex_unlock(&local->mutex);
+  if (stored[0])
+    return(_local_remove(dirq, stored));
+  return(0);
+}
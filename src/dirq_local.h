@@ -0,0 +1,61 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq local delivery support                                                *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define LOCAL_FREE    0   /* unused slot */
+#define LOCAL_WRITING 'w' /* element being added */
+#define LOCAL_PENDING 'p' /* element waiting for a consumer */
+#define LOCAL_TAKEN   't' /* element given to a consumer */
+#define LOCAL_DONE    'd' /* element acknowledged while being persisted */
+
+/*
+ * types
+ */
+
+struct local_elt_s {
+  char        *data;          /* element data */
+  size_t       length;        /* element length */
+  struct timespec when;       /* insertion time */
+  struct timespec due;        /* time when it must be persisted */
+  char         state;         /* element state (see LOCAL_*) */
+  char         flushing;      /* true while being persisted */
+  char         name[32];      /* name given by dirq_add() */
+  char         stored[32];    /* name once persisted (if any) */
+};
+
+struct local_s {
+  pthread_mutex_t mutex;      /* mutex protecting all the fields */
+  pthread_cond_t cond;        /* condition used to wake up the thread */
+  pthread_t    thread;        /* write-behind thread */
+  int          refs;          /* number of objects sharing this */
+  int          stop;          /* true if the thread must stop */
+  int          delay;         /* persistence delay (in milliseconds) */
+  int          capacity;      /* number of slots */
+  int          head;          /* index of the oldest used slot */
+  int          used;          /* number of slots from the oldest one */
+  struct local_elt_s *elts;   /* slots (ring buffer) */
+  struct timespec last;       /* last insertion time (names are unique) */
+  dirq_t       dirq;          /* private copy used by the thread */
+  const char  *fdata;         /* data being persisted */
+  size_t       flength;       /* its length */
+  size_t       foffset;       /* how much has been persisted */
+};
+
+/*
+ * functions
+ */
+
+static struct local_s *local_share (struct local_s *local);
+static void local_release (dirq_t dirq);
+static int local_add (dirq_t dirq, dirq_iow callback);
@@ -0,0 +1,185 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq maintenance support                                                   *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define MAINT_TICKS 10 /* number of purge steps per second */
+
+/*
+ * wait until the given time or until the thread must stop: 1 stop | 0 timeout
+ */
+
+static int _maint_wait (struct maint_s *maint, const struct timespec *until)
+{
+  int stop;
+
+  pthread_mutex_lock(&maint->mutex);
+  while (!maint->stop) {
+    if (pthread_cond_timedwait(&maint->cond, &maint->mutex, until) != 0)
+      break;
+  }
+  stop = maint->stop;
+  pthread_mutex_unlock(&maint->mutex);
+  return(stop);
+}
+
+/*
+ * maintenance thread: purge the queue in budgeted steps, one pass per interval
+ */
+
+static void *_maint_thread (void *arg)
+{
+  struct maint_s *maint;
+  struct timespec next, tick;
+  int step, result, migrated;
+
+  maint = (struct maint_s *)arg;
+  step = maint->budget ? (maint->budget + MAINT_TICKS - 1) / MAINT_TICKS
+                       : INT_MAX;
+  while (1) {
+    dirq_now(maint->dirq, &next);
+    next.tv_sec += maint->interval;
+    while (1) {
+      dirq_now(maint->dirq, &tick);
+      migrated = 0;
+      result = dirq_purge_step(maint->dirq, step);
+      if (result >= 0 && maint->dirq->tier) {
+        /* old or excess elements of the tier are migrated at each step */
+        migrated = dirq_tier_migrate(maint->dirq);
+        if (migrated < 0)
+          result = -1;
+      }
+      /* the counter is synchronized here rather than by the producers */
+      if (result >= 0 && !maint->dirq->purge_dirs &&
+          count_refresh(maint->dirq) < 0)
+        result = -1;
+      pthread_mutex_lock(&maint->mutex);
+      maint->stats.steps++;
+      if (result < 0) {
+        maint->stats.errors++;
+        maint->stats.errcode = dirq_get_errcode(maint->dirq);
+      } else {
+        maint->stats.purged += result;
+        maint->stats.migrated += migrated;
+        if (!maint->dirq->purge_dirs) {
+          maint->stats.passes++;
+          maint->stats.last = tick.tv_sec;
+        }
+      }
+      pthread_mutex_unlock(&maint->mutex);
+      if (result < 0)
+        dirq_clear_error(maint->dirq);
+      /* incremental purge state is reset at the end of a pass or on error */
+      if (!maint->dirq->purge_dirs)
+        break;
+      tick.tv_nsec += 1000000000 / MAINT_TICKS;
+      if (tick.tv_nsec >= 1000000000) {
+        tick.tv_sec++;
+        tick.tv_nsec -= 1000000000;
+      }
+      if (maint->budget && _maint_wait(maint, &tick))
+        return(NULL);
+    }
+    if (_maint_wait(maint, &next))
+      return(NULL);
+  }
+}
+
+/*
+ * stop the maintenance thread (if any) and free its resources
+ */
+
+static void maint_cleanup (dirq_t dirq)
+{
+  struct maint_s *maint;
+
+  maint = dirq->maint;
+  if (!maint)
+    return;
+  pthread_mutex_lock(&maint->mutex);
+  maint->stop = 1;
+  pthread_cond_signal(&maint->cond);
+  pthread_mutex_unlock(&maint->mutex);
+  pthread_join(maint->thread, NULL);
+  pthread_cond_destroy(&maint->cond);
+  pthread_mutex_destroy(&maint->mutex);
+  dirq_free(maint->dirq);
+  free((void *)maint);
+  dirq->maint = NULL;
+}
+
+/*
+ * dirq_maint_start(DIRQ, INTERVAL, BUDGET): 0 success | -1 error
+ */
+
+int dirq_maint_start (dirq_t dirq, int interval, int budget)
+{
+  struct maint_s *maint;
+  int result;
+
+  if (dirq->maint) {
+    error_set(dirq, EBUSY, "maintenance thread already started");
+    return(-1);
+  }
+  if (interval <= 0) {
+    error_set(dirq, EINVAL, "invalid interval: %d", interval);
+    return(-1);
+  }
+  maint = (struct maint_s *)safe_malloc(sizeof(struct maint_s));
+  memset((void *)maint, 0, sizeof(struct maint_s));
+  /* the thread works on its own copy as objects are not thread safe */
+  maint->dirq = dirq_copy(dirq);
+  maint->interval = interval;
+  maint->budget = (budget < 0) ? 0 : budget;
+  pthread_mutex_init(&maint->mutex, NULL);
+  pthread_cond_init(&maint->cond, NULL);
+  result = pthread_create(&maint->thread, NULL, _maint_thread, maint);
+  if (result != 0) {
+    error_set(dirq, result, "cannot pthread_create(): %s", strerror(result));
+    pthread_cond_destroy(&maint->cond);
+    pthread_mutex_destroy(&maint->mutex);
+    dirq_free(maint->dirq);
+    free((void *)maint);
+    return(-1);
+  }
+  dirq->maint = maint;
+  return(0);
+}
+
+/*
+ * dirq_maint_stop(DIRQ)
+ */
+
+void dirq_maint_stop (dirq_t dirq)
+{
+  maint_cleanup(dirq);
+}
+
+/*
+ * dirq_maint_stats(DIRQ, STATS): 0 success | 1 not started (zeroed STATS)
+ */
+
+int dirq_maint_stats (dirq_t dirq, dirq_stats_t *stats)
+{
+  struct maint_s *maint;
+
+  maint = dirq->maint;
+  if (!maint) {
+    memset((void *)stats, 0, sizeof(dirq_stats_t));
+    return(1);
+  }
+  pthread_mutex_lock(&maint->mutex);
+  memcpy((void *)stats, (const void *)&maint->stats, sizeof(dirq_stats_t));
+  pthread_mutex_unlock(&maint->mutex);
+  return(0);
+}
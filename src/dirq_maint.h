@@ -0,0 +1,31 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq maintenance support                                                   *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * types
+ */
+
+struct maint_s {
+  dirq_t          dirq;         /* private copy of the directory queue */
+  int             interval;     /* minimum time between two passes */
+  int             budget;       /* entries examined per second (0: no limit) */
+  pthread_t       thread;       /* maintenance thread */
+  pthread_mutex_t mutex;        /* mutex protecting the fields below */
+  pthread_cond_t  cond;         /* condition used to wake up the thread */
+  int             stop;         /* true if the thread must stop */
+  dirq_stats_t    stats;        /* statistics */
+};
+
+/*
+ * functions
+ */
+
+static void maint_cleanup (dirq_t dirq);
@@ -0,0 +1,263 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq metadata support                                                      *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * the metadata of an element is stored in extended attributes named
+ * user.dirq.meta.<key> (shared by all the links of the element) or, if they
+ * cannot be used, in a sidecar file (element name plus .mta suffix) holding
+ * the null terminated keys and values
+ */
+
+/*
+ * set the metadata of the given path: 0 success | 1 use a sidecar | -1 error
+ */
+
+static int meta_set (dirq_t dirq, const char *path, const char **meta)
+{
+#ifdef __linux__
+  char attr[256];
+  int i;
+
+  for (i = 0; meta[i] && meta[i+1]; i += 2) {
+    snprintf(attr, sizeof(attr), META_XATTR "%s", meta[i]);
+    if (setxattr(path, attr, meta[i+1], strlen(meta[i+1]), 0) != 0) {
+      /* not supported or not enough space in the inode */
+      if (errno == ENOTSUP || errno == ENOSPC || errno == E2BIG)
+        return(1);
+      error_set(dirq, errno, "cannot setxattr(%s, %s): %s", path, attr, ERROR);
+      return(-1);
+    }
+  }
+  return(0);
+#else
+  return(1);
+#endif
+}
+
+/*
+ * write the metadata in the given (sidecar) file descriptor
+ */
+
+static int _meta_write (int fd, const char *string)
+{
+  int len, done;
+
+  len = strlen(string) + 1;
+  while (len > 0) {
+    done = write(fd, string, len);
+    if (done < 0)
+      return(-1);
+    string += done;
+    len -= done;
+  }
+  return(0);
+}
+
+/*
+ * add the given temporary path to the directory queue, together with a
+ * sidecar file holding its metadata (the sidecar is created first so that the
+ * element never appears without its metadata)
+ */
+
+static int meta_add_with_sidecar (dirq_t dirq, const char *path,
+                                  const char **meta, off_t size)
+{
+  int fd, restored, saved, i;
+
+  restored = 0;
+  while (1) {
+    set_new_name(dirq, dirq->tmp2_offset, NULL);
+    strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, META_SUFFIX);
+    fd = open(TMP2BUF(dirq), O_WRONLY|O_CREAT|O_EXCL, 0666);
+    if (fd < 0) {
+      if (errno == EEXIST)
+        continue;
+      if (errno == ENOENT && !restored) {
+        restored = 1;
+        if (restore_insertion_directory(dirq, dirq->tmp2_offset) != 0)
+          return(-1);
+        continue;
+      }
+      error_set(dirq, errno, "cannot open(%s): %s", TMP2BUF(dirq), ERROR);
+      return(-1);
+    }
+    for (i = 0; meta[i] && meta[i+1]; i += 2)
+      if (_meta_write(fd, meta[i]) != 0 || _meta_write(fd, meta[i+1]) != 0)
+        break;
+    if (meta[i] && meta[i+1]) {
+      error_set(dirq, errno, "cannot write(%s): %s", TMP2BUF(dirq), ERROR);
+      (void) close(fd); /* best effort cleanup... */
+      return(-1);
+    }
+    if (close(fd) != 0) {
+      error_set(dirq, errno, "cannot close(%s): %s", TMP2BUF(dirq), ERROR);
+      return(-1);
+    }
+    *(TMP2NAME(dirq) + ELEMENT_LENGTH) = '\0';
+    if (link(path, TMP2BUF(dirq)) == 0)
+      break;
+    saved = errno;
+    strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, META_SUFFIX);
+    (void) unlink(TMP2BUF(dirq)); /* best effort cleanup... */
+    *(TMP2NAME(dirq) + ELEMENT_LENGTH) = '\0';
+    if (saved != EEXIST) {
+      error_set(dirq, saved, "cannot link(%s, %s): %s", path, TMP2BUF(dirq),
+                strerror(saved));
+      return(-1);
+    }
+  }
+  count_update(dirq, 1, size);
+  if (unlink(path) != 0) {
+    error_set(dirq, errno, "cannot unlink(%s): %s", path, ERROR);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * look up the metadata of the element whose path is in tmp2 (the value is
+ * stored in dirq->meta): 0 found | 1 not found | -1 error (see errno)
+ */
+
+static int _meta_lookup (dirq_t dirq, const char *key)
+{
+  char buffer[8192];
+  char *cp, *end, *value;
+  ssize_t len;
+  int fd, klen, vlen;
+#ifdef __linux__
+  char attr[256];
+#endif
+
+  if (!dirq->meta)
+    dirq->meta = (char *)safe_malloc(META_SIZE);
+#ifdef __linux__
+  snprintf(attr, sizeof(attr), META_XATTR "%s", key);
+  len = getxattr(TMP2BUF(dirq), attr, dirq->meta, META_SIZE - 1);
+  if (len >= 0) {
+    dirq->meta[len] = '\0';
+    return(0);
+  }
+  if (errno != ENODATA && errno != ENOTSUP)
+    return(-1);
+#endif
+  /* try the sidecar file */
+  strcpy(TMP2NAME(dirq) + ELEMENT_LENGTH, META_SUFFIX);
+  fd = open(TMP2BUF(dirq), O_RDONLY);
+  *(TMP2NAME(dirq) + ELEMENT_LENGTH) = '\0';
+  if (fd < 0)
+    return((errno == ENOENT) ? 1 : -1);
+  len = read(fd, buffer, sizeof(buffer));
+  if (len < 0) {
+    klen = errno;
+    (void) close(fd); /* best effort cleanup... */
+    errno = klen;
+    return(-1);
+  }
+  (void) close(fd); /* read only so nothing to check... */
+  klen = strlen(key);
+  cp = buffer;
+  end = buffer + len;
+  while (cp < end) {
+    value = memchr(cp, '\0', end - cp);
+    if (!value++)
+      break;
+    if (value - cp - 1 == klen && memcmp(cp, key, klen) == 0) {
+      end = memchr(value, '\0', end - value);
+      if (!end)
+        break;
+      vlen = end - value;
+      if (vlen >= META_SIZE) {
+        errno = ERANGE;
+        return(-1);
+      }
+      memcpy(dirq->meta, value, vlen + 1);
+      return(0);
+    }
+    cp = memchr(value, '\0', end - value);
+    if (!cp++)
+      break;
+  }
+  return(1);
+}
+
+/*
+ * check if the given element matches the metadata filter (if any)
+ */
+
+static int meta_match (dirq_t dirq, const char *name)
+{
+  const char *key;
+
+  key = dirq->filter;
+  if (!key)
+    return(1);
+  memcpy(TMP2NAME(dirq), name, ELEMENT_LENGTH + 1);
+  if (_meta_lookup(dirq, key) != 0)
+    return(0);
+  return(strcmp(dirq->meta, key + strlen(key) + 1) == 0);
+}
+
+/*
+ * copy a metadata filter (if any)
+ */
+
+static char *meta_copy_filter (const char *filter)
+{
+  char *copy;
+  int len;
+
+  if (!filter)
+    return(NULL);
+  len = strlen(filter) + 1;
+  len += strlen(filter + len) + 1;
+  copy = (char *)safe_malloc(len);
+  memcpy(copy, filter, len);
+  return(copy);
+}
+
+/*
+ * dirq_get_meta(DIRQ, NAME, KEY): VALUE | NULL not found or error
+ */
+
+const char *dirq_get_meta (dirq_t dirq, const char *name, const char *key)
+{
+  int result;
+
+  assert(strlen(name) == ELEMENT_LENGTH);
+  strcpy(TMP2NAME(dirq), name);
+  result = _meta_lookup(dirq, key);
+  if (result < 0) {
+    error_set(dirq, errno, "cannot get metadata(%s, %s): %s",
+              TMP2BUF(dirq), key, ERROR);
+    return(NULL);
+  }
+  return(result == 0 ? dirq->meta : NULL);
+}
+
+/*
+ * dirq_set_filter(DIRQ, KEY, VALUE)
+ */
+
+void dirq_set_filter (dirq_t dirq, const char *key, const char *value)
+{
+  int klen, vlen;
+
+  free((void *)dirq->filter);
+  dirq->filter = NULL;
+  if (!key || !value)
+    return;
+  klen = strlen(key) + 1;
+  vlen = strlen(value) + 1;
+  dirq->filter = (char *)safe_malloc(klen + vlen);
+  memcpy(dirq->filter, key, klen);
+  memcpy(dirq->filter + klen, value, vlen);
+}
@@ -0,0 +1,26 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq metadata support                                                      *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define META_SIZE 1024 /* maximum size of a metadata value (plus one) */
+
+/*
+ * functions
+ */
+
+static int meta_set (dirq_t dirq, const char *path, const char **meta);
+static int meta_add_with_sidecar (dirq_t dirq, const char *path,
+                                  const char **meta, off_t size);
+static int meta_match (dirq_t dirq, const char *name);
+static char *meta_copy_filter (const char *filter);
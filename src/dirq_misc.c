@@ -19,6 +19,32 @@ static void allocate_more (dirq_t dirq)
   dirq->buffer = (char *)safe_realloc((void *)dirq->buffer, dirq->allocated);
 }
 
+/*
+ * gather data (via callback) in a growing buffer, after what it already holds:
+ * total length | -1 error
+ */
+
+static ssize_t gather_data (dirq_t dirq, dirq_iow callback, char **data,
+                            size_t *allocated, size_t length)
+{
+  int result;
+
+  while (1) {
+    while (length + 8192 > *allocated) {
+      *allocated = *allocated ? *allocated * 2 : 8192;
+      *data = (char *)safe_realloc((void *)*data, *allocated);
+    }
+    result = callback(dirq, *data + length, 8192);
+    if (result == 0)
+      return((ssize_t)length);
+    if (result < 0) {
+      error_set(dirq, result, "cannot write(%s): %d", dirq->buffer, result);
+      return(-1);
+    }
+    length += result;
+  }
+}
+
 /*
  * make sure a directory exists, non recursively
  */
@@ -85,13 +111,17 @@ static int ensure_directory_recursively (dirq_t dirq, const char *path)
 
 /*
  * set the name of a new element in a temporary path buffer
+ * (using the given insertion time or, if NULL, the current time)
  */
 
-static void set_new_name (dirq_t dirq, int offset)
+static void set_new_name (dirq_t dirq, int offset, const struct timespec *when)
 {
   struct timespec ts;
 
-  dirq_now(dirq, &ts);
+  if (when)
+    memcpy((void *)&ts, (const void *)when, sizeof(ts));
+  else
+    dirq_now(dirq, &ts);
   sprintf(dirq->buffer + offset + dirq->pathlen + 1 + DIR_NAME_LENGTH + 1,
           "%08x%05x%01x",
           (uint32_t)ts.tv_sec,
@@ -99,19 +129,120 @@ static void set_new_name (dirq_t dirq, int offset)
           (uint32_t)dirq->rndhex);
 }
 
+/*
+ * set the key (i.e. element name prefix) corresponding to the given time
+ */
+
+static void set_time_key (char *key, const struct timespec *ts)
+{
+  sprintf(key, "%08x%05x",
+          (uint32_t)ts->tv_sec,
+          (uint32_t)(ts->tv_nsec / 1000));
+}
+
+/*
+ * find the adaptive insertion bucket (i.e. intermediate directory time): the
+ * latest bucket is used as long as it holds less than the target number of
+ * elements and is not older than the granularity; as this requires listing
+ * the queue and the bucket, it is only checked again after a fraction of the
+ * target number of insertions so buckets may be a bit bigger than targeted
+ */
+
+static int _bucket_latest_cb (dirq_t dirq, const char *name, int len)
+{
+  uint32_t bucket;
+
+  if (len == DIR_NAME_LENGTH && _ishexstr(name, len)) {
+    bucket = (uint32_t)strtoul(name, NULL, 16);
+    /* newer buckets only hold delayed elements */
+    if (bucket > dirq->bucket && bucket <= dirq->bucket_now)
+      dirq->bucket = bucket;
+  }
+  return(0);
+}
+
+static int _bucket_count_cb (dirq_t dirq, const char *name, int len)
+{
+  UNUSED(dirq);
+  return(len == ELT_NAME_LENGTH && _ishexstr(name, len));
+}
+
+/*
+ * get the modification time of a file with its sub-second part
+ */
+
+static void _stat_mtime (const struct stat *sb, struct timespec *ts)
+{
+#ifdef __MACH__
+  *ts = sb->st_mtimespec;
+#else
+  *ts = sb->st_mtim;
+#endif
+}
+
+static int _adaptive_bucket (dirq_t dirq, uint32_t now)
+{
+  struct timespec mtime;
+  struct stat sb;
+  int count;
+
+  /* another producer may have rolled over (this changes the root) */
+  if (stat(dirq->buffer, &sb) != 0) {
+    error_set(dirq, errno, "cannot stat(%s): %s", dirq->buffer, ERROR);
+    return(-1);
+  }
+  _stat_mtime(&sb, &mtime);
+  if (dirq->bucket && dirq->bucket_left > 0 &&
+      (!dirq->granularity || now < dirq->bucket + dirq->granularity) &&
+      mtime.tv_sec == dirq->bucket_mtime.tv_sec &&
+      mtime.tv_nsec == dirq->bucket_mtime.tv_nsec) {
+    dirq->bucket_left--;
+    return(0);
+  }
+  dirq->bucket_mtime = mtime;
+  dirq->bucket = 0;
+  dirq->bucket_now = now;
+  if (_iterate(dirq, 0, _bucket_latest_cb) < 0)
+    return(-1);
+  count = 0;
+  if (dirq->bucket) {
+    sprintf(TMP1NAME(dirq), "%08x", dirq->bucket);
+    count = _iterate(dirq, dirq->tmp1_offset, _bucket_count_cb);
+    if (count < 0)
+      return(-1);
+  }
+  if (!dirq->bucket || count >= dirq->bucket_size ||
+      (dirq->granularity && now >= dirq->bucket + dirq->granularity)) {
+    /* roll over (names have a one second precision) */
+    if (now > dirq->bucket) {
+      dirq->bucket = now;
+      count = 0;
+    }
+  }
+  dirq->bucket_left = MIN(dirq->bucket_size - count, dirq->bucket_size / 8);
+  dirq->bucket_left = MAX(dirq->bucket_left, 1) - 1;
+  return(0);
+}
+
 /*
  * set the name of the intermediate directory to use and make sure it exists
  * (put it in _both_ temporary path buffers, with a trailing slash)
+ * (using the given insertion time or, if NULL, the current time)
  */
 
-static int set_insertion_directory (dirq_t dirq)
+static int set_insertion_directory (dirq_t dirq, const struct timespec *when)
 {
   uint32_t now;
   int result;
 
-  now = (uint32_t)time(NULL);
-  if (dirq->granularity)
+  now = when ? (uint32_t)when->tv_sec : (uint32_t)time(NULL);
+  if (!when && dirq->bucket_size) {
+    if (_adaptive_bucket(dirq, now) != 0)
+      return(-1);
+    now = dirq->bucket;
+  } else if (dirq->granularity) {
     now -= now % dirq->granularity;
+  }
   sprintf(TMP1NAME(dirq), "%08x", now);
   result = ensure_directory(dirq, TMP1BUF(dirq));
   if (result != 0)
@@ -122,26 +253,298 @@ static int set_insertion_directory (dirq_t dirq)
 }
 
 /*
- * add the given temporary path to the directory queue
+ * make sure the intermediate directory of the element path in the given
+ * temporary path buffer (still) exists: it may have been purged if it was
+ * empty and not the last one (which happens with delayed elements)
+ */
+
+static int restore_insertion_directory (dirq_t dirq, int offset)
+{
+  char *name;
+  int result;
+
+  name = dirq->buffer + offset + dirq->pathlen + 1;
+  name[DIR_NAME_LENGTH] = '\0';
+  result = ensure_directory(dirq, dirq->buffer + offset);
+  name[DIR_NAME_LENGTH] = '/';
+  return(result);
+}
+
+/*
+ * give the given temporary path a new element name (in tmp2) with the given
+ * operation (link or rename), retrying on name collisions (a given insertion
+ * time does not change by itself so it is bumped) and restoring the insertion
+ * directory once (it may have been purged): 0 success | -1 error (recorded)
+ * | 1 operation not supported (not recorded)
  */
 
-static int add_temporary_path (dirq_t dirq, const char *path)
+typedef int (*add_op_t)(const char *oldpath, const char *newpath);
+
+static int _add_with (dirq_t dirq, const char *path, struct timespec *when,
+                      add_op_t op, const char *opname)
 {
+  int restored;
+
+  restored = 0;
   while (1) {
-    set_new_name(dirq, dirq->tmp2_offset);
-    if (link(path, TMP2BUF(dirq)) == 0) {
-      if (unlink(path) == 0) {
-        return(0);
-      } else {
-        error_set(dirq, errno, "cannot unlink(%s): %s", path, ERROR);
-        return(-1);
+    set_new_name(dirq, dirq->tmp2_offset, when);
+    if (op(path, TMP2BUF(dirq)) == 0)
+      return(0);
+    if (errno == EEXIST) {
+      if (when && (when->tv_nsec += 1000) >= 1000000000) {
+        when->tv_sec++;
+        when->tv_nsec -= 1000000000;
       }
-    } else {
-      if (errno != EEXIST) {
-        error_set(dirq, errno, "cannot link(%s, %s): %s", path, TMP2BUF(dirq),
-                  ERROR);
+      continue;
+    }
+    if (errno == ENOENT && !restored) {
+      restored = 1;
+      if (restore_insertion_directory(dirq, dirq->tmp2_offset) != 0)
         return(-1);
-      }
+      continue;
     }
+    if (errno == EINVAL || errno == ENOSYS)
+      return(1);
+    error_set(dirq, errno, "cannot %s(%s, %s): %s", opname, path,
+              TMP2BUF(dirq), ERROR);
+    return(-1);
   }
 }
+
+#ifdef RENAME_NOREPLACE
+
+/*
+ * rename without replacing an existing element
+ */
+
+static int _rename_noreplace (const char *oldpath, const char *newpath)
+{
+  return(renameat2(AT_FDCWD, oldpath, AT_FDCWD, newpath, RENAME_NOREPLACE));
+}
+
+#endif /* RENAME_NOREPLACE */
+
+/*
+ * link the given temporary path into the directory queue
+ * (using the given insertion time or, if NULL, the current time)
+ */
+
+static int link_temporary_path (dirq_t dirq, const char *path,
+                                struct timespec *when)
+{
+  int result;
+
+  result = _add_with(dirq, path, when, link, "link");
+  if (result > 0) {
+    error_set(dirq, errno, "cannot link(%s, %s): %s", path, TMP2BUF(dirq),
+              ERROR);
+    return(-1);
+  }
+  return(result);
+}
+
+/*
+ * add the given temporary path (holding SIZE bytes) to the directory queue
+ * (using the given insertion time or, if NULL, the current time)
+ */
+
+static int add_temporary_path (dirq_t dirq, const char *path,
+                               struct timespec *when, off_t size)
+{
+#ifdef RENAME_NOREPLACE
+  int result;
+
+  /* try first to move it with a single system call */
+  result = _add_with(dirq, path, when, _rename_noreplace, "rename");
+  if (result < 0)
+    return(-1);
+  if (result == 0) {
+    count_update(dirq, 1, size);
+    return(0);
+  }
+  /* not supported (e.g. by the filesystem): use link() and unlink() */
+#endif
+  if (link_temporary_path(dirq, path, when) != 0)
+    return(-1);
+  count_update(dirq, 1, size);
+  if (unlink(path) != 0) {
+    error_set(dirq, errno, "cannot unlink(%s): %s", path, ERROR);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * the number of delivery attempts of an element is stored in an extended
+ * attribute named after the queue (hard links in several queues share their
+ * attributes) or, if they are not supported, in a sidecar file (element name
+ * plus .att suffix) holding the number
+ */
+
+static void _attempts_sidecar (char *sidecar, size_t size, const char *path)
+{
+  snprintf(sidecar, size, "%s%s", path, ATTEMPTS_SUFFIX);
+}
+
+/*
+ * get the number of delivery attempts of the given element of the queue
+ */
+
+static int get_attempts (dirq_t dirq, const char *path)
+{
+  char buffer[16], sidecar[MAXPATHLEN];
+  ssize_t len;
+  int fd;
+
+#ifdef __linux__
+  len = getxattr(path, dirq->attempts, buffer, sizeof(buffer) - 1);
+  if (len < 0 && errno != ENOTSUP)
+    return(0);
+  if (len >= 0) {
+    buffer[len] = '\0';
+    return(atoi(buffer));
+  }
+#endif
+  _attempts_sidecar(sidecar, sizeof(sidecar), path);
+  fd = open(sidecar, O_RDONLY);
+  if (fd < 0)
+    return(0);
+  len = read(fd, buffer, sizeof(buffer) - 1);
+  (void) close(fd); /* read only so nothing to check... */
+  if (len <= 0)
+    return(0);
+  buffer[len] = '\0';
+  return(atoi(buffer));
+}
+
+/*
+ * set the number of delivery attempts of the given element of the queue
+ * (best effort, zero meaning none)
+ */
+
+static void set_attempts (dirq_t dirq, const char *path, int attempts)
+{
+  char buffer[16], sidecar[MAXPATHLEN];
+  int fd;
+
+  snprintf(buffer, sizeof(buffer), "%d", attempts);
+#ifdef __linux__
+  if (attempts > 0) {
+    if (setxattr(path, dirq->attempts, buffer, strlen(buffer), 0) == 0 ||
+        errno != ENOTSUP)
+      return;
+  } else {
+    if (removexattr(path, dirq->attempts) == 0 || errno != ENOTSUP)
+      return;
+  }
+#endif
+  _attempts_sidecar(sidecar, sizeof(sidecar), path);
+  if (attempts <= 0) {
+    (void) unlink(sidecar); /* best effort... */
+    return;
+  }
+  fd = open(sidecar, O_WRONLY|O_CREAT|O_TRUNC, 0666 & ~dirq->umask);
+  if (fd < 0)
+    return;
+  if (write(fd, buffer, strlen(buffer)) < 0) {
+    /* best effort... */
+  }
+  (void) close(fd); /* best effort... */
+}
+
+/*
+ * move the given element path of the queue to the destination queue (whose
+ * insertion directory must have been setup), together with its sidecar file
+ * (if any) and with a fresh attempts counter (in case of error, it is
+ * recorded in the destination queue)
+ */
+
+static int move_element (dirq_t dirq, dirq_t dst, const char *path)
+{
+  char sidecar[MAXPATHLEN];
+  char *suffix;
+  off_t size;
+
+  size = count_size(dirq, path);
+  if (add_temporary_path(dst, path, NULL, size) != 0)
+    return(-1);
+  count_update(dirq, -1, -size);
+  /* the attempts do not matter anymore (an orphan sidecar will be purged) */
+  if (dirq->deadletter)
+    set_attempts(dirq, TMP2BUF(dst), 0);
+  /* the metadata follows the element (it is briefly missing meanwhile) */
+  snprintf(sidecar, sizeof(sidecar), "%s%s", path, META_SUFFIX);
+  suffix = TMP2NAME(dst) + ELEMENT_LENGTH;
+  strcpy(suffix, META_SUFFIX);
+  if (rename(sidecar, TMP2BUF(dst)) != 0 && errno != ENOENT) {
+    error_set(dst, errno, "cannot rename(%s, %s): %s", sidecar, TMP2BUF(dst),
+              ERROR);
+    *suffix = '\0';
+    return(-1);
+  }
+  *suffix = '\0';
+  return(0);
+}
+
+/*
+ * add a copy of the given file to the directory queue, for when it cannot be
+ * moved because it is on another filesystem (using the given insertion time
+ * or, if NULL, the current time)
+ */
+
+static int _copy_read (dirq_t dirq, char *buffer, size_t length)
+{
+  ssize_t done;
+
+  done = read(dirq->copy_fd, buffer, length);
+  return((done < 0) ? -errno : (int)done);
+}
+
+static int copy_path (dirq_t dirq, const char *path, struct timespec *when)
+{
+  off_t size;
+  int result;
+
+  dirq->copy_fd = open(path, O_RDONLY);
+  if (dirq->copy_fd < 0) {
+    error_set(dirq, errno, "cannot open(%s): %s", path, ERROR);
+    return(-1);
+  }
+  result = _add_data(dirq, _copy_read, when, &size);
+  (void) close(dirq->copy_fd); /* read only so nothing to check... */
+  dirq->copy_fd = -1;
+  if (result != 0)
+    return(-1);
+  return(add_temporary_path(dirq, TMP1BUF(dirq), when, size));
+}
+
+/*
+ * move the given element to the dead letter queue, copying it if they are not
+ * on the same filesystem, e.g. for the fast tier (in case of error, it is
+ * recorded in the dead letter queue)
+ */
+
+static int move_to_deadletter (dirq_t dirq, const char *path)
+{
+  dirq_t dst;
+  off_t size;
+
+  dst = dirq->deadletter;
+  if (set_insertion_directory(dst, NULL) != 0)
+    return(-1);
+  if (move_element(dirq, dst, path) == 0)
+    return(0);
+  if (dirq_get_errcode(dst) != EXDEV)
+    return(-1);
+  /* the copy does not keep the metadata (an orphan sidecar will be purged) */
+  dirq_clear_error(dst);
+  size = count_size(dirq, path);
+  if (copy_path(dst, path, NULL) != 0)
+    return(-1);
+  if (unlink(path) != 0) {
+    error_set(dst, errno, "cannot unlink(%s): %s", path, ERROR);
+    return(-1);
+  }
+  count_update(dirq, -1, -size);
+  return(0);
+}
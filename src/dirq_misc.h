@@ -14,8 +14,21 @@
  */
 
 static void allocate_more (dirq_t dirq);
+static ssize_t gather_data (dirq_t dirq, dirq_iow callback, char **data,
+                            size_t *allocated, size_t length);
 static int ensure_directory (dirq_t dirq, const char *path);
 static int ensure_directory_recursively (dirq_t dirq, const char *path);
-static void set_new_name (dirq_t dirq, int offset);
-static int set_insertion_directory (dirq_t dirq);
-static int add_temporary_path (dirq_t dirq, const char *path);
+static void set_new_name (dirq_t dirq, int offset,
+                          const struct timespec *when);
+static void set_time_key (char *key, const struct timespec *ts);
+static int set_insertion_directory (dirq_t dirq, const struct timespec *when);
+static int restore_insertion_directory (dirq_t dirq, int offset);
+static int link_temporary_path (dirq_t dirq, const char *path,
+                                struct timespec *when);
+static int add_temporary_path (dirq_t dirq, const char *path,
+                               struct timespec *when, off_t size);
+static int get_attempts (dirq_t dirq, const char *path);
+static void set_attempts (dirq_t dirq, const char *path, int attempts);
+static int move_element (dirq_t dirq, dirq_t dst, const char *path);
+static int copy_path (dirq_t dirq, const char *path, struct timespec *when);
+static int move_to_deadletter (dirq_t dirq, const char *path);
@@ -0,0 +1,258 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq multiplexing support                                                  *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define MUX_IDLE 0 /* iteration not started yet */
+#define MUX_BUSY 1 /* iteration in progress */
+#define MUX_DONE 2 /* iteration finished */
+
+/*
+ * create a new multiplexer (the queues are to be set by the caller)
+ */
+
+static struct mux_s *mux_new (int count, const int *weights)
+{
+  struct mux_s *mux;
+  int i;
+
+  mux = (struct mux_s *)safe_malloc(sizeof(struct mux_s));
+  mux->count = count;
+  mux->dirqs = (dirq_t *)safe_malloc(count * sizeof(dirq_t));
+  mux->states = (char *)safe_malloc(count);
+  mux->credits = (int *)safe_malloc(count * sizeof(int));
+  if (weights) {
+    mux->weights = (int *)safe_malloc(count * sizeof(int));
+    for (i = 0; i < count; i++)
+      mux->weights[i] = (weights[i] < 1) ? 1 : weights[i];
+  } else {
+    mux->weights = NULL;
+  }
+  for (i = 0; i < count; i++) {
+    mux->dirqs[i] = NULL;
+    mux->states[i] = MUX_DONE;
+    mux->credits[i] = 0;
+  }
+  mux->index = 0;
+  mux->failed = NULL;
+  return(mux);
+}
+
+/*
+ * copy a multiplexer (the queues are to be set by the caller)
+ */
+
+static struct mux_s *mux_copy (const struct mux_s *mux)
+{
+  return(mux_new(mux->count, mux->weights));
+}
+
+/*
+ * free a multiplexer (but not the queues)
+ */
+
+static void mux_free (struct mux_s *mux)
+{
+  free((void *)mux->dirqs);
+  free((void *)mux->states);
+  free((void *)mux->credits);
+  free((void *)mux->weights);
+  free((void *)mux);
+}
+
+/*
+ * get the next element of the given queue (if any)
+ */
+
+static const char *_mux_pull (struct mux_s *mux, int index)
+{
+  const char *name;
+  dirq_t dirq;
+
+  if (mux->states[index] == MUX_DONE)
+    return(NULL);
+  dirq = mux->dirqs[index];
+  if (mux->states[index] == MUX_IDLE) {
+    mux->states[index] = MUX_BUSY;
+    name = dirq_first(dirq);
+  } else {
+    name = dirq_next(dirq);
+  }
+  if (!name) {
+    mux->states[index] = MUX_DONE;
+    if (dirq_get_errcode(dirq))
+      mux->failed = dirq;
+  }
+  return(name);
+}
+
+/*
+ * iterate over the multiplexed queues: with strict priority, a queue is only
+ * served when all the previous ones have been exhausted; otherwise, weighted
+ * round robin is used (a queue is served as many times in a row as its weight)
+ */
+
+static const char *mux_first (struct mux_s *mux, dirq_t *which)
+{
+  int i;
+
+  for (i = 0; i < mux->count; i++) {
+    mux->states[i] = mux->dirqs[i] ? MUX_IDLE : MUX_DONE;
+    mux->credits[i] = mux->weights ? mux->weights[i] : 0;
+  }
+  /* mux->index is kept so that successive rounds start with different queues */
+  mux->failed = NULL;
+  return(mux_next(mux, which));
+}
+
+static const char *mux_next (struct mux_s *mux, dirq_t *which)
+{
+  const char *name;
+  int i, active;
+
+  if (!mux->weights) {
+    /* strict priority */
+    for (i = 0; i < mux->count; i++) {
+      name = _mux_pull(mux, i);
+      if (name) {
+        *which = mux->dirqs[i];
+        return(name);
+      }
+      if (mux->failed)
+        return(NULL);
+    }
+    return(NULL);
+  }
+  /* weighted round robin */
+  while (1) {
+    for (i = 0; i < mux->count; i++) {
+      if (mux->credits[mux->index] > 0) {
+        name = _mux_pull(mux, mux->index);
+        if (name) {
+          *which = mux->dirqs[mux->index];
+          if (--mux->credits[mux->index] == 0)
+            mux->index = (mux->index + 1) % mux->count;
+          return(name);
+        }
+        if (mux->failed)
+          return(NULL);
+        mux->credits[mux->index] = 0;
+      }
+      mux->index = (mux->index + 1) % mux->count;
+    }
+    /* end of round: refill the credits of the queues not yet exhausted */
+    active = 0;
+    for (i = 0; i < mux->count; i++) {
+      if (mux->states[i] != MUX_DONE) {
+        mux->credits[i] = mux->weights[i];
+        active++;
+      }
+    }
+    if (!active)
+      return(NULL);
+  }
+}
+
+/*
+ * priority lanes: sub-queues named lane0, lane1... under the queue path
+ */
+
+static void lanes_cleanup (dirq_t dirq)
+{
+  int i;
+
+  if (!dirq->lanes)
+    return;
+  for (i = 0; i < dirq->lanes->count; i++)
+    if (dirq->lanes->dirqs[i])
+      dirq_free(dirq->lanes->dirqs[i]);
+  mux_free(dirq->lanes);
+  dirq->lanes = NULL;
+}
+
+/*
+ * dirq_set_lanes(DIRQ, COUNT, WEIGHTS): 0 success | -1 error
+ */
+
+int dirq_set_lanes (dirq_t dirq, int count, const int *weights)
+{
+  struct mux_s *lanes;
+  char path[MAXPATHLEN];
+  dirq_t lane;
+  int i;
+
+  lanes_cleanup(dirq);
+  if (count <= 0)
+    return(0);
+  lanes = mux_new(count, weights);
+  for (i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "%s/lane%d", dirq->buffer, i);
+    lane = dirq_new(path);
+    lanes->dirqs[i] = lane;
+    if (dirq_get_errcode(lane)) {
+      error_set(dirq, dirq_get_errcode(lane), "%s", dirq_get_errstr(lane));
+      dirq->lanes = lanes;
+      lanes_cleanup(dirq);
+      return(-1);
+    }
+    inherit_attributes(lane, dirq);
+  }
+  dirq->lanes = lanes;
+  if (dirq->deadletter && deadletter_share(dirq, dirq->deadletter->buffer,
+                                           dirq->maxattempts) != 0) {
+    lanes_cleanup(dirq);
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * dirq_get_lane(DIRQ, LANE): DIRQ | NULL
+ */
+
+dirq_t dirq_get_lane (dirq_t dirq, int lane)
+{
+  if (!dirq->lanes || lane < 0 || lane >= dirq->lanes->count)
+    return(NULL);
+  return(dirq->lanes->dirqs[lane]);
+}
+
+/*
+ * dirq_lane_first(DIRQ, LANE): NAME | NULL end or error
+ * dirq_lane_next(DIRQ, LANE): NAME | NULL end or error
+ */
+
+static const char *_lane_check (dirq_t dirq, const char *name)
+{
+  dirq_t failed;
+
+  if (!name && dirq->lanes->failed) {
+    failed = dirq->lanes->failed;
+    error_set(dirq, dirq_get_errcode(failed), "%s", dirq_get_errstr(failed));
+  }
+  return(name);
+}
+
+const char *dirq_lane_first (dirq_t dirq, dirq_t *lane)
+{
+  if (!dirq->lanes)
+    return(NULL);
+  return(_lane_check(dirq, mux_first(dirq->lanes, lane)));
+}
+
+const char *dirq_lane_next (dirq_t dirq, dirq_t *lane)
+{
+  if (!dirq->lanes)
+    return(NULL);
+  return(_lane_check(dirq, mux_next(dirq->lanes, lane)));
+}
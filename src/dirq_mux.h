@@ -0,0 +1,35 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq multiplexing support                                                  *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * types
+ */
+
+struct mux_s {
+  int          count;         /* number of multiplexed queues */
+  dirq_t      *dirqs;         /* multiplexed queues */
+  int         *weights;       /* weights (NULL means strict priority) */
+  int         *credits;       /* remaining credits in the current round */
+  char        *states;        /* iteration states (see MUX_*) */
+  int          index;         /* index of the queue being served */
+  dirq_t       failed;        /* queue that had an iteration error (if any) */
+};
+
+/*
+ * functions
+ */
+
+static struct mux_s *mux_new (int count, const int *weights);
+static struct mux_s *mux_copy (const struct mux_s *mux);
+static void mux_free (struct mux_s *mux);
+static const char *mux_first (struct mux_s *mux, dirq_t *which);
+static const char *mux_next (struct mux_s *mux, dirq_t *which);
+static void lanes_cleanup (dirq_t dirq);
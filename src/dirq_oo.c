@@ -49,13 +49,46 @@ dirq_t dirq_new (const char *path)
   /* reset iterator */
   dirq->dirs_offset = dirq->tmp2_offset + offset;
   dirq->elts_offset = 0;
+  dirq->iter_dirp = dirq->iter_eltp = NULL;
   iter_reset(dirq);
+  dirq_set_range(dirq, NULL, NULL);
+  dirq->filter = dirq->meta = NULL;
+  /* reset incremental purge */
+  dirq->purge_dirp = NULL;
+  dirq->purge_dirs = NULL;
+  purge_reset(dirq);
+  dirq->oldest_dirs = NULL;
+  dirq->oldest_count = 0;
+  dirq->maint = NULL;
+  dirq->lanes = NULL;
+  dirq->deadletter = NULL;
+  dirq->maxattempts = 0;
+  dirq->packed = NULL;
+  dirq->tier = NULL;
+  dirq->local = NULL;
+  dirq->async = NULL;
+  dirq->counter = NULL;
+  dirq->prefetch = NULL;
+  dirq->checkpoint = NULL;
+  dirq->highcount = dirq->lowcount = 0;
+  dirq->highbytes = dirq->lowbytes = 0;
+  dirq->full = 0;
   /* set defaults */
   dirq->granularity = 60;
+  dirq->order = DIRQ_ORDER_FIFO;
+  dirq->bucket_size = 0;
+  dirq->bucket = 0;
+  dirq->bucket_left = 0;
+  dirq->bucket_now = 0;
+  memset(&dirq->bucket_mtime, 0, sizeof(dirq->bucket_mtime));
   dirq->rndhex = ts.tv_nsec % 16;
   dirq->umask = 0;
   dirq->maxlock = 600;
   dirq->maxtemp = 300;
+  dirq->purge_threads = 1;
+  dirq->copy_fd = -1;
+  dirq->full_policy = DIRQ_FULL_BLOCK;
+  dirq->full_timeout = -1;
   dirq->errcode = 0;
   /* make sure toplevel directory exists (up to caller to check for success!) */
   /* this is dirty but the only way to pass back the error message... */
@@ -70,12 +103,52 @@ dirq_t dirq_new (const char *path)
 dirq_t dirq_copy (dirq_t dirq1)
 {
   dirq_t dirq2;
+  int i;
 
   dirq2 = (dirq_t)safe_malloc(sizeof(struct dirq_s));
   memcpy((void *)dirq2, (const void *)dirq1, sizeof(struct dirq_s));
   clock_setup(dirq2);
   dirq2->buffer = (char *)safe_malloc(dirq2->allocated);
   memcpy((void *)dirq2->buffer, (const void *)dirq1->buffer, dirq2->allocated);
+  /* the unordered iteration state is not shared */
+  dirq2->iter_dirp = dirq2->iter_eltp = NULL;
+  iter_reset(dirq2);
+  /* the incremental purge state is not shared */
+  dirq2->purge_dirp = NULL;
+  dirq2->purge_dirs = NULL;
+  purge_reset(dirq2);
+  dirq2->copy_fd = -1;
+  /* the metadata filter is copied but not the buffer */
+  dirq2->filter = meta_copy_filter(dirq1->filter);
+  dirq2->meta = NULL;
+  /* the counter file is mapped again if needed */
+  dirq2->counter = NULL;
+  /* the maintenance and prefetch threads are not shared */
+  dirq2->maint = NULL;
+  dirq2->prefetch = NULL;
+  /* and neither is the checkpoint (it belongs to a consumer) */
+  dirq2->checkpoint = NULL;
+  /* the priority lanes are copied too */
+  if (dirq1->lanes) {
+    dirq2->lanes = mux_copy(dirq1->lanes);
+    for (i = 0; i < dirq1->lanes->count; i++)
+      dirq2->lanes->dirqs[i] = dirq_copy(dirq1->lanes->dirqs[i]);
+  }
+  /* and so is the dead letter queue */
+  if (dirq1->deadletter)
+    dirq2->deadletter = dirq_copy(dirq1->deadletter);
+  /* the packed state (open segments and locks) is not shared */
+  if (dirq1->packed)
+    dirq2->packed = packed_new();
+  /* and the tier is copied too */
+  if (dirq1->tier)
+    dirq2->tier = tier_copy(dirq1->tier);
+  /* while the local delivery is shared */
+  if (dirq1->local)
+    dirq2->local = local_share(dirq1->local);
+  /* and so are the asynchronous adds */
+  if (dirq1->async)
+    dirq2->async = async_share(dirq1->async);
   return(dirq2);
 }
 
@@ -85,11 +158,77 @@ dirq_t dirq_copy (dirq_t dirq1)
 
 void dirq_free (dirq_t dirq)
 {
+  maint_cleanup(dirq);
+  prefetch_cleanup(dirq);
+  checkpoint_free(dirq);
+  async_release(dirq);
+  local_release(dirq);
+  lanes_cleanup(dirq);
+  if (dirq->deadletter)
+    dirq_free(dirq->deadletter);
+  if (dirq->packed)
+    packed_free(dirq->packed);
+  if (dirq->tier)
+    tier_free(dirq->tier);
+  iter_reset(dirq);
+  purge_reset(dirq);
+  count_unmap(dirq);
+  free((void *)dirq->filter);
+  free((void *)dirq->meta);
   clock_cleanup(dirq);
   free((void *)dirq->buffer);
   free((void *)dirq);
 }
 
+/*
+ * make a sub-queue (lane, fast tier or dead letter queue) behave like its
+ * parent queue
+ */
+
+static void inherit_attributes (dirq_t dst, dirq_t src)
+{
+  dst->granularity = src->granularity;
+  dst->order = src->order;
+  dst->bucket_size = src->bucket_size;
+  dst->rndhex = src->rndhex;
+  dst->umask = src->umask;
+  dst->maxlock = src->maxlock;
+  dst->maxtemp = src->maxtemp;
+  dst->purge_threads = src->purge_threads;
+  if (src->packed && !dst->packed)
+    dst->packed = packed_new();
+}
+
+/*
+ * give the same dead letter queue to the lanes and to the fast tier of the
+ * queue (if any)
+ */
+
+static int _deadletter_share (dirq_t dirq, dirq_t sub, const char *path,
+                              int maxattempts)
+{
+  if (dirq_set_deadletter(sub, path, maxattempts) == 0)
+    return(0);
+  error_set(dirq, dirq_get_errcode(sub), "%s", dirq_get_errstr(sub));
+  return(-1);
+}
+
+static int deadletter_share (dirq_t dirq, const char *path, int maxattempts)
+{
+  dirq_t sub;
+  int i;
+
+  if (dirq->tier &&
+      _deadletter_share(dirq, dirq->tier->fast, path, maxattempts) != 0)
+    return(-1);
+  for (i = 0; dirq->lanes && i < dirq->lanes->count; i++) {
+    sub = dirq->lanes->dirqs[i];
+    if (_deadletter_share(dirq, sub, path, maxattempts) != 0)
+      return(-1);
+  }
+  return(0);
+}
+
 /*
  * granularity (assumed to be zero if negative)
  */
@@ -104,6 +243,22 @@ int dirq_get_granularity (dirq_t dirq)
   return(dirq->granularity);
 }
 
+/*
+ * bucket size (assumed to be zero if negative)
+ */
+
+void dirq_set_bucket_size (dirq_t dirq, int value)
+{
+  dirq->bucket_size = (value < 0) ? 0 : value;
+  dirq->bucket = 0;
+  dirq->bucket_left = 0;
+}
+
+int dirq_get_bucket_size (dirq_t dirq)
+{
+  return(dirq->bucket_size);
+}
+
 /*
  * rndhex (always forced to 0..15)
  */
@@ -159,3 +314,125 @@ int dirq_get_maxtemp (dirq_t dirq)
 {
   return(dirq->maxtemp);
 }
+
+/*
+ * purge_threads (assumed to be one if smaller)
+ */
+
+void dirq_set_purge_threads (dirq_t dirq, int value)
+{
+  dirq->purge_threads = (value < 1) ? 1 : value;
+}
+
+int dirq_get_purge_threads (dirq_t dirq)
+{
+  return(dirq->purge_threads);
+}
+
+/*
+ * dead letter queue (the maximum number of attempts must be positive)
+ */
+
+int dirq_set_deadletter (dirq_t dirq, const char *path, int maxattempts)
+{
+  struct stat sb;
+  dirq_t deadletter;
+
+  if (dirq->deadletter) {
+    dirq_free(dirq->deadletter);
+    dirq->deadletter = NULL;
+  }
+  dirq->maxattempts = 0;
+  if (!path || maxattempts <= 0)
+    return(deadletter_share(dirq, NULL, 0));
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "set_deadletter"));
+  /* the attempts are counted per queue, identified by its inode */
+  if (stat(dirq->buffer, &sb) != 0) {
+    error_set(dirq, errno, "cannot stat(%s): %s", dirq->buffer, ERROR);
+    return(-1);
+  }
+  snprintf(dirq->attempts, sizeof(dirq->attempts), "%s.%llx", ATTEMPTS_XATTR,
+           (unsigned long long)sb.st_ino);
+  deadletter = dirq_new(path);
+  if (dirq_get_errcode(deadletter)) {
+    error_set(dirq, dirq_get_errcode(deadletter), "%s",
+              dirq_get_errstr(deadletter));
+    dirq_free(deadletter);
+    return(-1);
+  }
+  inherit_attributes(deadletter, dirq);
+  dirq->deadletter = deadletter;
+  dirq->maxattempts = maxattempts;
+  return(deadletter_share(dirq, path, maxattempts));
+}
+
+dirq_t dirq_get_deadletter (dirq_t dirq)
+{
+  return(dirq->deadletter);
+}
+
+/*
+ * type (simple or packed)
+ */
+
+int dirq_set_type (dirq_t dirq, int value)
+{
+  if (value != DIRQ_TYPE_SIMPLE && value != DIRQ_TYPE_PACKED) {
+    error_set(dirq, EINVAL, "cannot set type(%s, %d): %s", dirq->buffer,
+              value, strerror(EINVAL));
+    return(-1);
+  }
+#ifndef F_OFD_SETLK
+  /* the packed type relies on open file description locks */
+  if (value == DIRQ_TYPE_PACKED) {
+    error_set(dirq, ENOTSUP, "cannot set type(%s, %d): %s", dirq->buffer,
+              value, "open file description locks are not available");
+    return(-1);
+  }
+#endif
+  /* the features not supported by packed queues must not be in use */
+  if (value == DIRQ_TYPE_PACKED &&
+      (dirq->order != DIRQ_ORDER_FIFO || dirq->deadletter || dirq->tier ||
+       dirq->prefetch || dirq->checkpoint))
+    return(packed_unsupported(dirq, "set_type"));
+  if (dirq->packed) {
+    packed_free(dirq->packed);
+    dirq->packed = NULL;
+  }
+  if (value == DIRQ_TYPE_PACKED)
+    dirq->packed = packed_new();
+  return(0);
+}
+
+int dirq_get_type (dirq_t dirq)
+{
+  return(dirq->packed ? DIRQ_TYPE_PACKED : DIRQ_TYPE_SIMPLE);
+}
+
+/*
+ * iteration order (changing it resets the iterator)
+ */
+
+int dirq_set_order (dirq_t dirq, int value)
+{
+  if (value != DIRQ_ORDER_FIFO && value != DIRQ_ORDER_NONE &&
+      value != DIRQ_ORDER_LIFO) {
+    error_set(dirq, EINVAL, "cannot set order(%s, %d): %s", dirq->buffer,
+              value, strerror(EINVAL));
+    return(-1);
+  }
+  if (dirq->packed && value != DIRQ_ORDER_FIFO)
+    return(packed_unsupported(dirq, "set_order"));
+  iter_reset(dirq);
+  dirq->order = value;
+  /* the fast tier (if any) is iterated along */
+  if (dirq->tier)
+    return(dirq_set_order(dirq->tier->fast, value));
+  return(0);
+}
+
+int dirq_get_order (dirq_t dirq)
+{
+  return(dirq->order);
+}
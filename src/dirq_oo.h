@@ -25,13 +25,65 @@ struct dirq_s {
   int          elts_offset;   /* offset to cached elements */
   int          elts_count;    /* number of cached elements */
   int          elts_index;    /* index of next cached element */
+  int          order;         /* iteration order */
+  DIR         *iter_dirp;     /* queue directory being read (if unordered) */
+  DIR         *iter_eltp;     /* intermediate directory being read (idem) */
+  char         iter_dir[16];  /* name of the latter */
+  char         from_key[16];  /* time key to start iterating from (if any) */
+  char         until_key[16]; /* time key to stop iterating at (if any) */
+  char         start_key[16]; /* time key of the current iteration (if any) */
+  char         limit_key[16]; /* time key of the current iteration limit */
+  char        *filter;        /* metadata filter as "key\0value" (if any) */
+  char        *meta;          /* buffer holding the last metadata value */
   int          errcode;       /* code of the "current" error */
   mode_t       umask;         /* umask to use */
   int          granularity;   /* granularity to use */
+  int          bucket_size;   /* target number of elements per bucket */
+  uint32_t     bucket;        /* current adaptive insertion bucket */
+  int          bucket_left;   /* insertions before checking it again */
+  uint32_t     bucket_now;    /* newest bucket that can be used */
+  struct timespec bucket_mtime; /* root modification time when listed */
   int          rndhex;        /* random hexadecimal digit to use */
   int          maxlock;       /* maximum age for a lock before purge */
   int          maxtemp;       /* maximum age for a temp file before purge */
+  int          purge_threads; /* number of threads to use for purging */
+  int          copy_fd;       /* element being copied into the queue */
+  DIR         *purge_dirp;    /* directory being incrementally purged */
+  char        *purge_dirs;    /* directories to incrementally purge */
+  int          purge_count;   /* number of directories to purge */
+  int          purge_index;   /* index of the directory being purged */
+  int          purge_kept;    /* number of entries kept in this directory */
+  uint32_t     purge_oldlock; /* locks older than this will be purged */
+  uint32_t     purge_oldtemp; /* temp files older than this will be purged */
+  char        *oldest_dirs;   /* directories listed to find the oldest */
+  int          oldest_count;  /* number of directories listed */
+  struct maint_s *maint;      /* maintenance thread (if any) */
+  struct mux_s *lanes;        /* priority lanes (if any) */
+  dirq_t       deadletter;    /* dead letter queue (if any) */
+  int          maxattempts;   /* maximum number of delivery attempts */
+  char         attempts[40];  /* extended attribute holding the attempts */
+  struct packed_s *packed;    /* packed queue state (if packed type) */
+  struct tier_s *tier;        /* memory backed tier (if any) */
+  struct local_s *local;      /* local delivery (if any) */
+  struct async_s *async;      /* asynchronous adds (if any) */
+  struct count_s *counter;    /* mapped counter file (if any) */
+  struct prefetch_s *prefetch; /* consumer prefetching (if any) */
+  struct checkpoint_s *checkpoint; /* consumer checkpoint (if any) */
+  int          highcount;     /* high watermark in elements (0: none) */
+  int          lowcount;      /* low watermark in elements */
+  size_t       highbytes;     /* high watermark in bytes (0: none) */
+  size_t       lowbytes;      /* low watermark in bytes */
+  int          full_policy;   /* what to do past the high watermark */
+  int          full_timeout;  /* how long to block (in milliseconds) */
+  int          full;          /* true if past the high watermark */
 #ifdef __MACH__
   clock_serv_t clock;         /* Mac OS X clock */
 #endif
 };
+
+/*
+ * functions
+ */
+
+static void inherit_attributes (dirq_t dst, dirq_t src);
+static int deadletter_share (dirq_t dirq, const char *path, int maxattempts);
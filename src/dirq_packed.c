@@ -0,0 +1,726 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq packed support                                                        *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * with the packed type, the elements are records appended to segment files
+ * (named after a random identifier, with a .seg suffix) in the intermediate
+ * directories; each segment has a single writer that holds a lock on a byte
+ * far beyond its end; the element name is made of the intermediate directory,
+ * the segment identifier and the record offset; records are locked with open
+ * file description locks on their state byte (so they vanish with their
+ * holder) and removed by changing this state byte; POSIX record locks cannot
+ * be used instead (any close of the file by the process drops them and the
+ * process does not see its own locks) so, without open file description
+ * locks, the packed type is not supported
+ */
+
+/*
+ * constants
+ */
+
+#ifdef F_OFD_SETLK
+#define PACKED_SETLK F_OFD_SETLK
+#define PACKED_GETLK F_OFD_GETLK
+#endif
+
+/*
+ * create a new packed state
+ */
+
+static struct packed_s *packed_new (void)
+{
+  struct packed_s *packed;
+
+  packed = (struct packed_s *)safe_malloc(sizeof(struct packed_s));
+  packed->wfd = -1;
+  packed->wdir[0] = '\0';
+  packed->wid = packed->wsize = 0;
+  packed->wallocated = 8192 + PACKED_HEADER_SIZE;
+  packed->wbuf = (char *)safe_malloc(packed->wallocated);
+  packed->rfd = -1;
+  packed->roffset = packed->rbase = packed->rlen = 0;
+  packed->rbuf = (char *)safe_malloc(PACKED_BUFFER_SIZE);
+  packed->count = 0;
+  packed->segments = NULL;
+  return(packed);
+}
+
+/*
+ * free a packed state (this releases all the locks)
+ */
+
+static void packed_free (struct packed_s *packed)
+{
+  int i;
+
+  if (packed->wfd >= 0)
+    (void) close(packed->wfd); /* best effort cleanup... */
+  if (packed->rfd >= 0)
+    (void) close(packed->rfd); /* best effort cleanup... */
+  for (i = 0; i < packed->count; i++)
+    (void) close(packed->segments[i].fd); /* best effort cleanup... */
+  free((void *)packed->segments);
+  free((void *)packed->wbuf);
+  free((void *)packed->rbuf);
+  free((void *)packed);
+}
+
+/*
+ * report an operation not supported with the packed type
+ */
+
+static int packed_unsupported (dirq_t dirq, const char *what)
+{
+  error_set(dirq, ENOTSUP, "cannot %s(%s): %s", what, dirq->buffer,
+            "not supported by packed queues");
+  return(-1);
+}
+
+/*
+ * set the path of a segment in tmp2 (the given strings are not terminated)
+ */
+
+static const char *packed_path (dirq_t dirq, const char *dir, const char *id)
+{
+  sprintf(TMP2NAME(dirq), "%.8s/%.6s%s", dir, id, SEGMENT_SUFFIX);
+  return(TMP2BUF(dirq));
+}
+
+/*
+ * get the record offset of an element
+ */
+
+static uint32_t _packed_offset (const char *name)
+{
+  return((uint32_t)strtoul(name + PACKED_NAME_LENGTH, NULL, 16));
+}
+
+/*
+ * lock or unlock one byte of a segment
+ */
+
+static int _packed_setlk (int fd, int type, off_t offset)
+{
+  struct flock fl;
+
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = offset;
+  fl.l_len = 1;
+#ifdef PACKED_SETLK
+  return(fcntl(fd, PACKED_SETLK, &fl));
+#else
+  errno = ENOTSUP;
+  return(-1);
+#endif
+}
+
+/*
+ * start writing to a new segment (in the current intermediate directory)
+ */
+
+static int _packed_roll (dirq_t dirq, const struct timespec *ts)
+{
+  struct packed_s *packed;
+  uint32_t id, tries;
+  int fd, restored, saved;
+
+  packed = dirq->packed;
+  if (packed->wfd >= 0) {
+    /* releasing the writer lock makes it purgeable once fully processed */
+    (void) close(packed->wfd); /* best effort cleanup... */
+    packed->wfd = -1;
+  }
+  if (set_insertion_directory(dirq, ts) != 0)
+    return(-1);
+  memcpy(packed->wdir, TMP1NAME(dirq), DIR_NAME_LENGTH);
+  packed->wdir[DIR_NAME_LENGTH] = '\0';
+  restored = 0;
+  for (tries = 0; ; tries++) {
+    id = ((uint32_t)ts->tv_nsec ^ ((uint32_t)getpid() << 4) ^
+          (tries * 0x9e3779b1)) & 0xffffff;
+    /* the segment is created and locked under a temporary name... */
+    sprintf(TMP1NAME(dirq) + DIR_NAME_LENGTH, "/%06x%s", id, TEMPORARY_SUFFIX);
+    fd = open(TMP1BUF(dirq), O_RDWR|O_CREAT|O_EXCL, 0666);
+    if (fd < 0) {
+      if (errno == EEXIST)
+        continue;
+      if (errno == ENOENT && !restored) {
+        restored = 1;
+        if (restore_insertion_directory(dirq, dirq->tmp1_offset) != 0)
+          return(-1);
+        continue;
+      }
+      error_set(dirq, errno, "cannot open(%s): %s", TMP1BUF(dirq), ERROR);
+      return(-1);
+    }
+    if (_packed_setlk(fd, F_WRLCK, PACKED_WRITER_LOCK) != 0) {
+      error_set(dirq, errno, "cannot lock(%s): %s", TMP1BUF(dirq), ERROR);
+      (void) close(fd); /* best effort cleanup... */
+      (void) unlink(TMP1BUF(dirq)); /* best effort cleanup... */
+      return(-1);
+    }
+    /* ... and then published */
+    sprintf(TMP2NAME(dirq), "%s/%06x%s", packed->wdir, id, SEGMENT_SUFFIX);
+    if (link(TMP1BUF(dirq), TMP2BUF(dirq)) != 0) {
+      saved = errno;
+      (void) close(fd); /* best effort cleanup... */
+      (void) unlink(TMP1BUF(dirq)); /* best effort cleanup... */
+      if (saved == EEXIST)
+        continue;
+      error_set(dirq, saved, "cannot link(%s, %s): %s", TMP1BUF(dirq),
+                TMP2BUF(dirq), strerror(saved));
+      return(-1);
+    }
+    if (unlink(TMP1BUF(dirq)) != 0) {
+      error_set(dirq, errno, "cannot unlink(%s): %s", TMP1BUF(dirq), ERROR);
+      (void) close(fd); /* best effort cleanup... */
+      return(-1);
+    }
+    break;
+  }
+  packed->wfd = fd;
+  packed->wid = id;
+  packed->wsize = 0;
+  return(0);
+}
+
+/*
+ * report a failed write to the segment being written, which is then left
+ * (the next record goes to a new segment) as what follows the failed record
+ * is unknown: NULL
+ */
+
+static const char *_packed_failed (dirq_t dirq)
+{
+  struct packed_s *packed;
+
+  packed = dirq->packed;
+  error_set(dirq, errno, "cannot write(%s/%s/%06x%s): %s", dirq->buffer,
+            packed->wdir, packed->wid, SEGMENT_SUFFIX, ERROR);
+  (void) close(packed->wfd); /* best effort cleanup... */
+  packed->wfd = -1;
+  return(NULL);
+}
+
+/*
+ * add data (via callback) as a new record
+ */
+
+static const char *packed_add (dirq_t dirq, dirq_iow callback)
+{
+  struct packed_s *packed;
+  struct packed_header_s header;
+  struct timespec ts;
+  char dir[DIR_NAME_LENGTH + 1];
+  uint32_t now, offset;
+  size_t total;
+  ssize_t done;
+  char state;
+
+  packed = dirq->packed;
+  /* gather the data after the record header */
+  done = gather_data(dirq, callback, &packed->wbuf, &packed->wallocated,
+                     PACKED_HEADER_SIZE);
+  if (done < 0)
+    return(NULL);
+  total = (size_t)done;
+  /* find out which segment to use */
+  dirq_now(dirq, &ts);
+  now = (uint32_t)ts.tv_sec;
+  if (dirq->granularity)
+    now -= now % dirq->granularity;
+  sprintf(dir, "%08x", now);
+  if (packed->wfd < 0 || strcmp(dir, packed->wdir) != 0 ||
+      (packed->wsize > 0 && packed->wsize + total > PACKED_SEGMENT_SIZE)) {
+    if (_packed_roll(dirq, &ts) != 0)
+      return(NULL);
+  }
+  /* write the record, still marked as being written */
+  memset(&header, 0, sizeof(header));
+  header.magic = PACKED_MAGIC;
+  header.state = PACKED_TEMP;
+  header.length = total - PACKED_HEADER_SIZE;
+  header.sec = (uint32_t)ts.tv_sec;
+  header.usec = (uint32_t)(ts.tv_nsec / 1000);
+  memcpy(packed->wbuf, &header, PACKED_HEADER_SIZE);
+  offset = packed->wsize;
+  while (packed->wsize - offset < total) {
+    done = pwrite(packed->wfd, packed->wbuf + (packed->wsize - offset),
+                  total - (packed->wsize - offset), packed->wsize);
+    if (done < 0)
+      return(_packed_failed(dirq));
+    packed->wsize += done;
+  }
+  /* and commit it */
+  state = PACKED_READY;
+  if (pwrite(packed->wfd, &state, 1, offset + 1) != 1)
+    return(_packed_failed(dirq));
+  count_update(dirq, 1, header.length);
+  sprintf(TMP2NAME(dirq), "%s/%06x%08x", packed->wdir, packed->wid, offset);
+  return(TMP2NAME(dirq));
+}
+
+/*
+ * get the list of segments (from the intermediate directory in tmp1)
+ */
+
+static int _packed_segments_cmp (const void *elt1, const void *elt2)
+{
+  return(strcmp((const char *)elt1, (const char *)elt2));
+}
+
+static int _packed_segments_cb (dirq_t dirq, const char *name, int len)
+{
+  if (dirq->elts_offset + (dirq->elts_count + 1) * ELTS_SIZE >= dirq->allocated)
+    allocate_more(dirq);
+  if (len == PACKED_ID_LENGTH + SUFFIX_LENGTH &&
+      _ishexstr(name, PACKED_ID_LENGTH) &&
+      strcmp(name + PACKED_ID_LENGTH, SEGMENT_SUFFIX) == 0) {
+    strncpy(ELTBUF(dirq,dirq->elts_count), name, PACKED_ID_LENGTH);
+    *(ELTBUF(dirq,dirq->elts_count) + PACKED_ID_LENGTH) = '\0';
+    dirq->elts_count++;
+  }
+  return(0);
+}
+
+static int _packed_segments (dirq_t dirq)
+{
+  int result;
+
+  dirq->elts_index = dirq->elts_count = 0;
+  result = _iterate(dirq, dirq->tmp1_offset, _packed_segments_cb);
+  if (result < 0)
+    return(result);
+  if (dirq->elts_count > 0)
+    qsort(ELTBUF(dirq,0), dirq->elts_count, ELTS_SIZE, _packed_segments_cmp);
+  return(0);
+}
+
+/*
+ * read the next ready record of the segment being iterated:
+ * 1 found (name in tmp1) | 0 end of segment | -1 error
+ */
+
+static int _packed_read (dirq_t dirq)
+{
+  struct packed_s *packed;
+  struct packed_header_s header;
+  uint32_t offset;
+  ssize_t done;
+
+  packed = dirq->packed;
+  while (1) {
+    offset = packed->roffset;
+    if (offset < packed->rbase ||
+        offset + PACKED_HEADER_SIZE > packed->rbase + packed->rlen) {
+      done = pread(packed->rfd, packed->rbuf, PACKED_BUFFER_SIZE, offset);
+      if (done < 0) {
+        packed_path(dirq, DIRBUF(dirq,dirq->dirs_index-1),
+                     ELTBUF(dirq,dirq->elts_index-1));
+        error_set(dirq, errno, "cannot read(%s): %s", TMP2BUF(dirq), ERROR);
+        return(-1);
+      }
+      packed->rbase = offset;
+      packed->rlen = done;
+      if (done < PACKED_HEADER_SIZE)
+        return(0);
+    }
+    memcpy(&header, packed->rbuf + (offset - packed->rbase),
+           PACKED_HEADER_SIZE);
+    if (header.magic != PACKED_MAGIC ||
+        offset + PACKED_HEADER_SIZE + header.length < offset)
+      return(0);
+    /* records being written or left by failed writes are skipped too */
+    packed->roffset = offset + PACKED_HEADER_SIZE + header.length;
+    if (header.state == PACKED_READY) {
+      memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index-1), DIRS_SIZE);
+      *(TMP1NAME(dirq) + DIRS_SIZE) = '/';
+      memmove(TMP1NAME(dirq) + DIRS_SIZE + 1, ELTBUF(dirq,dirq->elts_index-1),
+              PACKED_ID_LENGTH);
+      sprintf(TMP1NAME(dirq) + PACKED_NAME_LENGTH, "%08x", offset);
+      return(1);
+    }
+  }
+}
+
+/*
+ * iterate over the ready records (in segment order):
+ * 1 found (name in tmp1) | 0 end | -1 error
+ */
+
+static int _packed_next (dirq_t dirq)
+{
+  struct packed_s *packed;
+  const char *path;
+  int result;
+
+  packed = dirq->packed;
+  while (1) {
+    if (packed->rfd >= 0 && dirq->elts_index > 0 &&
+        dirq->elts_index <= dirq->elts_count) {
+      result = _packed_read(dirq);
+      if (result != 0)
+        return(result);
+    }
+    if (packed->rfd >= 0) {
+      (void) close(packed->rfd); /* read only so nothing to check... */
+      packed->rfd = -1;
+    }
+    if (dirq->elts_index < dirq->elts_count) {
+      path = packed_path(dirq, DIRBUF(dirq,dirq->dirs_index-1),
+                          ELTBUF(dirq,dirq->elts_index));
+      dirq->elts_index++;
+      packed->rfd = open(path, O_RDONLY);
+      if (packed->rfd < 0) {
+        /* the segment may have been purged meanwhile */
+        if (errno == ENOENT)
+          continue;
+        error_set(dirq, errno, "cannot open(%s): %s", path, ERROR);
+        return(-1);
+      }
+      packed->roffset = packed->rbase = packed->rlen = 0;
+      continue;
+    }
+    if (dirq->dirs_index >= dirq->dirs_count)
+      return(0);
+    memmove(TMP1NAME(dirq), DIRBUF(dirq,dirq->dirs_index), DIRS_SIZE);
+    *(TMP1NAME(dirq) + DIRS_SIZE) = '\0';
+    result = _packed_segments(dirq);
+    if (result < 0)
+      return(-1);
+    dirq->dirs_index++;
+  }
+}
+
+static const char *packed_next (dirq_t dirq)
+{
+  return(_packed_next(dirq) > 0 ? TMP1NAME(dirq) : NULL);
+}
+
+/*
+ * count the ready records
+ */
+
+static int packed_count (dirq_t dirq)
+{
+  int count, result;
+
+  count = 0;
+  if (_get_dirs(dirq) < 0)
+    return(-1);
+  while ((result = _packed_next(dirq)) > 0)
+    count++;
+  if (result < 0)
+    return(-1);
+  iter_reset(dirq); /* we have messed up with the iterator... */
+  return(count);
+}
+
+/*
+ * find (or open) the segment holding the given element
+ */
+
+static struct packed_segment_s *_packed_segment (dirq_t dirq, const char *name,
+                                                 int create)
+{
+  struct packed_s *packed;
+  const char *path;
+  int i, j, fd;
+
+  packed = dirq->packed;
+  for (i = 0; i < packed->count; i++)
+    if (strncmp(packed->segments[i].name, name,
+                PACKED_NAME_LENGTH) == 0)
+      return(&packed->segments[i]);
+  if (!create) {
+    errno = ENOENT;
+    return(NULL);
+  }
+  path = packed_path(dirq, name, name + DIR_NAME_LENGTH + 1);
+  fd = open(path, O_RDWR);
+  if (fd < 0)
+    return(NULL);
+  if (packed->count >= PACKED_MAX_OPEN) {
+    /* close the segments without locks */
+    for (i = j = 0; i < packed->count; i++) {
+      if (packed->segments[i].locks > 0)
+        packed->segments[j++] = packed->segments[i];
+      else
+        (void) close(packed->segments[i].fd); /* best effort cleanup... */
+    }
+    packed->count = j;
+  }
+  packed->segments = (struct packed_segment_s *)
+    safe_realloc(packed->segments,
+                 (packed->count + 1) * sizeof(struct packed_segment_s));
+  i = packed->count++;
+  memcpy(packed->segments[i].name, name, PACKED_NAME_LENGTH);
+  packed->segments[i].name[PACKED_NAME_LENGTH] = '\0';
+  packed->segments[i].fd = fd;
+  packed->segments[i].locks = 0;
+  return(&packed->segments[i]);
+}
+
+/*
+ * read the header of the given record
+ */
+
+static int _packed_header (dirq_t dirq, struct packed_segment_s *segment,
+                           const char *name, struct packed_header_s *header)
+{
+  ssize_t done;
+
+  done = pread(segment->fd, header, PACKED_HEADER_SIZE, _packed_offset(name));
+  if (done < 0) {
+    error_set(dirq, errno, "cannot read(%s/%s): %s", dirq->buffer, name,
+              ERROR);
+    return(-1);
+  }
+  if (done != PACKED_HEADER_SIZE || header->magic != PACKED_MAGIC) {
+    error_set(dirq, EINVAL, "cannot read(%s/%s): %s", dirq->buffer, name,
+              "invalid record");
+    return(-1);
+  }
+  return(0);
+}
+
+/*
+ * packed version of dirq_lock()
+ */
+
+static int packed_lock (dirq_t dirq, const char *name, int permissive)
+{
+  struct packed_segment_s *segment;
+  uint32_t offset;
+  char state;
+
+  segment = _packed_segment(dirq, name, 1);
+  if (!segment) {
+    if (permissive && errno == ENOENT)
+      return(1);
+    error_set(dirq, errno, "cannot open(%s): %s", TMP2BUF(dirq), ERROR);
+    return(-1);
+  }
+  offset = _packed_offset(name);
+  if (_packed_setlk(segment->fd, F_WRLCK, offset + 1) != 0) {
+    if (permissive && (errno == EAGAIN || errno == EACCES))
+      return(1);
+    error_set(dirq, errno, "cannot lock(%s/%s): %s", dirq->buffer, name,
+              ERROR);
+    return(-1);
+  }
+  if (pread(segment->fd, &state, 1, offset + 1) != 1)
+    state = PACKED_DONE;
+  if (state != PACKED_READY) {
+    /* already removed */
+    (void) _packed_setlk(segment->fd, F_UNLCK, offset + 1);
+    if (permissive)
+      return(1);
+    error_set(dirq, ENOENT, "cannot lock(%s/%s): %s", dirq->buffer, name,
+              strerror(ENOENT));
+    return(-1);
+  }
+  segment->locks++;
+  return(0);
+}
+
+/*
+ * packed version of dirq_unlock()
+ */
+
+static int packed_unlock (dirq_t dirq, const char *name, int permissive)
+{
+  struct packed_segment_s *segment;
+
+  segment = _packed_segment(dirq, name, 0);
+  if (!segment || segment->locks == 0) {
+    if (permissive)
+      return(1);
+    error_set(dirq, ENOENT, "cannot unlock(%s/%s): %s", dirq->buffer, name,
+              strerror(ENOENT));
+    return(-1);
+  }
+  if (_packed_setlk(segment->fd, F_UNLCK, _packed_offset(name) + 1) != 0) {
+    error_set(dirq, errno, "cannot unlock(%s/%s): %s", dirq->buffer, name,
+              ERROR);
+    return(-1);
+  }
+  segment->locks--;
+  return(0);
+}
+
+/*
+ * packed version of dirq_remove()
+ */
+
+static int packed_remove (dirq_t dirq, const char *name)
+{
+  struct packed_segment_s *segment;
+  struct packed_header_s header;
+  char state;
+
+  segment = _packed_segment(dirq, name, 0);
+  if (!segment || segment->locks == 0) {
+    error_set(dirq, ENOENT, "cannot remove(%s/%s): %s", dirq->buffer, name,
+              "not locked");
+    return(-1);
+  }
+  if (_packed_header(dirq, segment, name, &header) != 0)
+    return(-1);
+  state = PACKED_DONE;
+  if (pwrite(segment->fd, &state, 1, _packed_offset(name) + 1) != 1) {
+    error_set(dirq, errno, "cannot write(%s/%s): %s", dirq->buffer, name,
+              ERROR);
+    return(-1);
+  }
+  count_update(dirq, -1, -(off_t)header.length);
+  return(packed_unlock(dirq, name, 0));
+}
+
+/*
+ * packed version of dirq_get()
+ */
+
+static int packed_get (dirq_t dirq, const char *name, dirq_ior callback)
+{
+  struct packed_segment_s *segment;
+  struct packed_header_s header;
+  uint32_t offset, length;
+  ssize_t done;
+  int result;
+  char buffer[8192];
+
+  segment = _packed_segment(dirq, name, 1);
+  if (!segment) {
+    error_set(dirq, errno, "cannot open(%s): %s", TMP2BUF(dirq), ERROR);
+    return(-1);
+  }
+  if (_packed_header(dirq, segment, name, &header) != 0)
+    return(-1);
+  offset = _packed_offset(name) + PACKED_HEADER_SIZE;
+  length = header.length;
+  while (1) {
+    done = 0;
+    if (length > 0) {
+      done = pread(segment->fd, buffer,
+                   (length < sizeof(buffer)) ? length : sizeof(buffer), offset);
+      if (done <= 0) {
+        error_set(dirq, done < 0 ? errno : EINVAL, "cannot read(%s/%s): %s",
+                  dirq->buffer, name, done < 0 ? ERROR : "truncated record");
+        return(-1);
+      }
+      offset += done;
+      length -= done;
+    }
+    result = callback(dirq, buffer, done);
+    if (result != 0) {
+      error_set(dirq, result, "cannot read(%s/%s): %d", dirq->buffer, name,
+                result);
+      return(-1);
+    }
+    if (done == 0)
+      break;
+  }
+  return(0);
+}
+
+/*
+ * packed version of dirq_get_size()
+ */
+
+static int packed_get_size (dirq_t dirq, const char *name)
+{
+  struct packed_segment_s *segment;
+  struct packed_header_s header;
+
+  segment = _packed_segment(dirq, name, 1);
+  if (!segment) {
+    error_set(dirq, errno, "cannot open(%s): %s", TMP2BUF(dirq), ERROR);
+    return(-1);
+  }
+  if (_packed_header(dirq, segment, name, &header) != 0)
+    return(-1);
+  return(header.length);
+}
+
+/*
+ * purge a segment if it is not used anymore (i.e. without writer and without
+ * ready records): 1 removed | 0 kept | -1 error (see errno)
+ */
+
+static int packed_purge_segment (int dirfd, const char *name)
+{
+  struct packed_header_s header;
+  struct flock fl;
+  uint32_t offset, base, length;
+  ssize_t done;
+  char *buffer;
+  int fd, saved, ready;
+
+  fd = openat(dirfd, name, O_RDONLY);
+  if (fd < 0)
+    return((errno == ENOENT) ? 0 : -1);
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = PACKED_WRITER_LOCK;
+  fl.l_len = 1;
+#ifdef PACKED_GETLK
+  if (fcntl(fd, PACKED_GETLK, &fl) != 0)
+    goto error;
+#else
+  errno = ENOTSUP;
+  goto error;
+#endif
+  if (fl.l_type != F_UNLCK) {
+    /* still being written */
+    (void) close(fd); /* read only so nothing to check... */
+    return(0);
+  }
+  buffer = (char *)safe_malloc(PACKED_BUFFER_SIZE);
+  offset = base = length = 0;
+  ready = 0;
+  while (!ready) {
+    if (offset < base || offset + PACKED_HEADER_SIZE > base + length) {
+      done = pread(fd, buffer, PACKED_BUFFER_SIZE, offset);
+      if (done < 0) {
+        free((void *)buffer);
+        goto error;
+      }
+      base = offset;
+      length = done;
+      if (done < PACKED_HEADER_SIZE)
+        break;
+    }
+    memcpy(&header, buffer + (offset - base), PACKED_HEADER_SIZE);
+    if (header.magic != PACKED_MAGIC ||
+        offset + PACKED_HEADER_SIZE + header.length < offset)
+      break;
+    /* records left being written (by failed writes) are lost anyway */
+    if (header.state == PACKED_READY)
+      ready = 1;
+    offset += PACKED_HEADER_SIZE + header.length;
+  }
+  free((void *)buffer);
+  (void) close(fd); /* read only so nothing to check... */
+  if (ready)
+    return(0);
+  if (unlinkat(dirfd, name, 0) != 0)
+    return((errno == ENOENT) ? 0 : -1);
+  return(1);
+ error:
+  saved = errno;
+  (void) close(fd); /* best effort cleanup... */
+  errno = saved;
+  return(-1);
+}
@@ -0,0 +1,79 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq packed support                                                        *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define PACKED_ID_LENGTH    6
+#define PACKED_NAME_LENGTH  (DIR_NAME_LENGTH + 1 + PACKED_ID_LENGTH)
+#define PACKED_HEADER_SIZE  16
+#define PACKED_MAGIC        'q'
+#define PACKED_TEMP         't' /* record being written */
+#define PACKED_READY        'r' /* record ready to be processed */
+#define PACKED_DONE         'd' /* record removed */
+#define PACKED_SEGMENT_SIZE (4 * 1024 * 1024)
+#define PACKED_BUFFER_SIZE  (64 * 1024)
+#define PACKED_MAX_OPEN     16
+#define PACKED_WRITER_LOCK  0x7fffffff
+
+/*
+ * types
+ */
+
+struct packed_header_s {
+  char         magic;         /* always PACKED_MAGIC */
+  char         state;         /* record state (see PACKED_*) */
+  uint16_t     unused;        /* padding */
+  uint32_t     length;        /* length of the data following the header */
+  uint32_t     sec;           /* insertion time (seconds) */
+  uint32_t     usec;          /* insertion time (microseconds) */
+};
+
+struct packed_segment_s {
+  char         name[16];      /* intermediate directory and segment id */
+  int          fd;            /* file descriptor */
+  int          locks;         /* number of records locked via this fd */
+};
+
+struct packed_s {
+  int          wfd;           /* segment being written (-1 if none) */
+  char         wdir[16];      /* its intermediate directory */
+  uint32_t     wid;           /* its identifier */
+  uint32_t     wsize;         /* its size */
+  char        *wbuf;          /* buffer holding the record being written */
+  size_t       wallocated;    /* size of this buffer */
+  int          rfd;           /* segment being iterated (-1 if none) */
+  uint32_t     roffset;       /* offset of the next record to read */
+  uint32_t     rbase;         /* offset of the data in the read buffer */
+  uint32_t     rlen;          /* length of the data in the read buffer */
+  char        *rbuf;          /* read buffer */
+  int          count;         /* number of open segments */
+  struct packed_segment_s *segments; /* open segments (holding locks) */
+};
+
+/*
+ * functions
+ */
+
+static struct packed_s *packed_new (void);
+static void packed_free (struct packed_s *packed);
+static int packed_unsupported (dirq_t dirq, const char *what);
+static const char *packed_path (dirq_t dirq, const char *dir, const char *id);
+static const char *packed_add (dirq_t dirq, dirq_iow callback);
+static const char *packed_next (dirq_t dirq);
+static int packed_count (dirq_t dirq);
+static int packed_lock (dirq_t dirq, const char *name, int permissive);
+static int packed_unlock (dirq_t dirq, const char *name, int permissive);
+static int packed_remove (dirq_t dirq, const char *name);
+static int packed_get (dirq_t dirq, const char *name, dirq_ior callback);
+static int packed_get_size (dirq_t dirq, const char *name);
+static int packed_purge_segment (int dirfd, const char *name);
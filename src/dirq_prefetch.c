@@ -0,0 +1,231 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq prefetch support                                                      *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * while a consumer processes an element, the iterator hands the paths of the
+ * next few elements it will return to a helper thread which asks the kernel
+ * to read them in advance (and, once the end of the intermediate directory is
+ * near, lists the next one), so that the consumer finds them in the page cache;
+ * these are only hints: elements taken by others in the meantime are simply
+ * ignored and, if the thread lags behind, the hints are given again later
+ */
+
+/*
+ * prefetch thread: read ahead the given elements and directories
+ */
+
+static void _prefetch_path (const char *path)
+{
+  DIR *dirp;
+  int fd;
+
+  if (path[strlen(path) - 1] == '/') {
+    /* listing the directory is enough to bring its entries in the cache */
+    dirp = opendir(path);
+    if (!dirp)
+      return;
+    while (readdir(dirp))
+      ;
+    (void) closedir(dirp); /* read only so nothing to check... */
+    return;
+  }
+  fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return;
+#ifdef POSIX_FADV_WILLNEED
+  (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED); /* only a hint... */
+#endif
+  (void) close(fd); /* read only so nothing to check... */
+}
+
+static void *_prefetch_thread (void *arg)
+{
+  struct prefetch_s *prefetch;
+  char *path;
+
+  prefetch = (struct prefetch_s *)arg;
+  path = (char *)safe_malloc(prefetch->size);
+  pthread_mutex_lock(&prefetch->mutex);
+  while (1) {
+    if (prefetch->stop)
+      break;
+    if (prefetch->used == 0) {
+      pthread_cond_wait(&prefetch->cond, &prefetch->mutex);
+      continue;
+    }
+    strcpy(path, prefetch->paths + prefetch->head * prefetch->size);
+    prefetch->head = (prefetch->head + 1) % prefetch->capacity;
+    prefetch->used--;
+    pthread_mutex_unlock(&prefetch->mutex);
+    _prefetch_path(path);
+    pthread_mutex_lock(&prefetch->mutex);
+  }
+  pthread_mutex_unlock(&prefetch->mutex);
+  free((void *)path);
+  return(NULL);
+}
+
+/*
+ * give a path to the prefetch thread (with the mutex held): 0 given | 1 full
+ */
+
+static int _prefetch_push (dirq_t dirq, const char *dir, const char *elt)
+{
+  struct prefetch_s *prefetch;
+  char *path;
+
+  prefetch = dirq->prefetch;
+  if (prefetch->used == prefetch->capacity)
+    return(1);
+  path = prefetch->paths +
+    ((prefetch->head + prefetch->used) % prefetch->capacity) * prefetch->size;
+  sprintf(path, "%s/%.8s/%s", dirq->buffer, dir, elt);
+  prefetch->used++;
+  return(0);
+}
+
+/*
+ * give hints about the elements the iterator will return next
+ */
+
+static void prefetch_hint (dirq_t dirq)
+{
+  struct prefetch_s *prefetch;
+  char name[ELEMENT_LENGTH + 1];
+  const char *dir, *elt;
+  int end, given, full;
+
+  prefetch = dirq->prefetch;
+  if (!prefetch || dirq->dirs_index == 0)
+    return;
+  if (prefetch->next < dirq->elts_index)
+    prefetch->next = dirq->elts_index;
+  end = MIN(dirq->elts_index + prefetch->depth, dirq->elts_count);
+  dir = DIRBUF(dirq,dirq->dirs_index-1);
+  given = 0;
+  while (prefetch->next < end) {
+    elt = ELTBUF(dirq,prefetch->next);
+    /* skip what the iterator will not return, as it does */
+    if (strncmp(elt, dirq->limit_key, TIME_KEY_LENGTH) > 0) {
+      /* too recent: this one only in LIFO order, the rest otherwise */
+      if (dirq->order == DIRQ_ORDER_LIFO) {
+        prefetch->next++;
+        continue;
+      }
+      prefetch->next = dirq->elts_count;
+      break;
+    }
+    if (dirq->order == DIRQ_ORDER_LIFO && dirq->start_key[0] &&
+        strncmp(elt, dirq->start_key, TIME_KEY_LENGTH) < 0) {
+      /* too old: this and all the following elements */
+      prefetch->next = dirq->elts_count;
+      break;
+    }
+    /* the filter may do I/O so it runs without the mutex held */
+    if (dirq->filter) {
+      sprintf(name, "%.8s/%s", dir, elt);
+      if (!meta_match(dirq, name)) {
+        prefetch->next++;
+        continue;
+      }
+    }
+    pthread_mutex_lock(&prefetch->mutex);
+    full = _prefetch_push(dirq, dir, elt);
+    pthread_mutex_unlock(&prefetch->mutex);
+    if (full)
+      break;
+    prefetch->next++;
+    given++;
+  }
+  pthread_mutex_lock(&prefetch->mutex);
+  /* the end of this directory is near so the next one can be listed */
+  if (prefetch->next == dirq->elts_count &&
+      dirq->dirs_index < dirq->dirs_count) {
+    dir = DIRBUF(dirq,dirq->dirs_index);
+    if (memcmp(prefetch->listed, dir, DIRS_SIZE) != 0 &&
+        strncmp(dir, dirq->limit_key, DIRS_SIZE) <= 0 &&
+        _prefetch_push(dirq, dir, "") == 0) {
+      memcpy(prefetch->listed, dir, DIRS_SIZE);
+      given++;
+    }
+  }
+  if (given)
+    pthread_cond_signal(&prefetch->cond);
+  pthread_mutex_unlock(&prefetch->mutex);
+}
+
+/*
+ * stop the prefetch thread (if any) and free everything
+ */
+
+static void prefetch_cleanup (dirq_t dirq)
+{
+  struct prefetch_s *prefetch;
+
+  prefetch = dirq->prefetch;
+  if (!prefetch)
+    return;
+  dirq->prefetch = NULL;
+  pthread_mutex_lock(&prefetch->mutex);
+  prefetch->stop = 1;
+  pthread_cond_signal(&prefetch->cond);
+  pthread_mutex_unlock(&prefetch->mutex);
+  pthread_join(prefetch->thread, NULL);
+  pthread_cond_destroy(&prefetch->cond);
+  pthread_mutex_destroy(&prefetch->mutex);
+  free((void *)prefetch->paths);
+  free((void *)prefetch);
+}
+
+/*
+ * dirq_set_prefetch(DIRQ, DEPTH): 0 success | -1 error
+ */
+
+int dirq_set_prefetch (dirq_t dirq, int depth)
+{
+  struct prefetch_s *prefetch;
+  int result;
+
+  prefetch_cleanup(dirq);
+  if (depth <= 0)
+    return(0);
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "set_prefetch"));
+  prefetch = (struct prefetch_s *)safe_malloc(sizeof(struct prefetch_s));
+  memset((void *)prefetch, 0, sizeof(struct prefetch_s));
+  prefetch->depth = MIN(depth, PREFETCH_MAX_DEPTH);
+  /* room for the elements plus the next directory */
+  prefetch->capacity = prefetch->depth + 1;
+  prefetch->size = dirq->pathlen + 1 + ELEMENT_LENGTH + 1;
+  prefetch->paths = (char *)safe_malloc(prefetch->capacity * prefetch->size);
+  pthread_mutex_init(&prefetch->mutex, NULL);
+  pthread_cond_init(&prefetch->cond, NULL);
+  result = pthread_create(&prefetch->thread, NULL, _prefetch_thread, prefetch);
+  if (result != 0) {
+    pthread_cond_destroy(&prefetch->cond);
+    pthread_mutex_destroy(&prefetch->mutex);
+    free((void *)prefetch->paths);
+    free((void *)prefetch);
+    error_set(dirq, result, "cannot pthread_create(): %s", strerror(result));
+    return(-1);
+  }
+  dirq->prefetch = prefetch;
+  return(0);
+}
+
+/*
+ * dirq_get_prefetch(DIRQ): DEPTH
+ */
+
+int dirq_get_prefetch (dirq_t dirq)
+{
+  return(dirq->prefetch ? dirq->prefetch->depth : 0);
+}
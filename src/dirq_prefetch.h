@@ -0,0 +1,42 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq prefetch support                                                      *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+#define PREFETCH_MAX_DEPTH 256
+
+/*
+ * types
+ */
+
+struct prefetch_s {
+  int          depth;         /* number of elements to prefetch ahead */
+  int          next;          /* index of the next element to prefetch */
+  char         listed[8];     /* last directory listed (no NUL) */
+  pthread_mutex_t mutex;      /* mutex protecting the fields below */
+  pthread_cond_t cond;        /* condition used to wake up the thread */
+  pthread_t    thread;        /* prefetch thread */
+  int          stop;          /* true if the thread must stop */
+  int          capacity;      /* number of slots */
+  int          head;          /* index of the oldest used slot */
+  int          used;          /* number of used slots */
+  int          size;          /* size of a slot */
+  char        *paths;         /* slots (ring buffer of paths) */
+};
+
+/*
+ * functions
+ */
+
+static void prefetch_hint (dirq_t dirq);
+static void prefetch_cleanup (dirq_t dirq);
@@ -0,0 +1,798 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq purge support                                                         *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * the intermediate directories are purged in parallel by worker threads,
+ * using file descriptor relative system calls (no path building) and sharing
+ * the (read only) list of intermediate directories in dirq->buffer
+ */
+
+/*
+ * record a purge error (only the first one is kept)
+ */
+
+static void _purge_error (struct purge_job_s *job, int errcode,
+                          const char *fmt, ...)
+{
+  va_list ap;
+
+  pthread_mutex_lock(&job->mutex);
+  if (job->errcode == 0) {
+    job->errcode = errcode;
+    va_start(ap, fmt);
+    vsnprintf(job->errstr, sizeof(job->errstr), fmt, ap);
+    va_end(ap);
+  }
+  pthread_mutex_unlock(&job->mutex);
+}
+
+/*
+ * get the modification time of an entry in the given directory (using the
+ * lighter statx when available, see purge_check() for the rules)
+ */
+
+static int _purge_mtime (int dirfd, const char *name, time_t *mtime)
+{
+#ifdef STATX_MTIME
+  struct statx sx;
+
+  if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW|AT_STATX_DONT_SYNC,
+            STATX_MTIME, &sx) != 0)
+    return(-1);
+  *mtime = sx.stx_mtime.tv_sec;
+#else
+  struct stat sb;
+
+  if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+    return(-1);
+  *mtime = sb.st_mtime;
+#endif
+  return(0);
+}
+
+/*
+ * move the element of a stale lock to the dead letter queue if it has used all
+ * its delivery attempts (the dead letter queue object is protected by the job
+ * mutex as it is shared by the workers)
+ */
+
+static int _purge_job_deadletter (struct purge_job_s *job, const char *dir,
+                                  const char *name, int len)
+{
+  char path[MAXPATHLEN];
+  char errstr[1024];
+  dirq_t deadletter;
+  int errcode;
+
+  snprintf(path, sizeof(path), "%s/%s/%.*s", job->dirq->buffer, dir,
+           len - SUFFIX_LENGTH, name);
+  if (get_attempts(job->dirq, path) < job->dirq->maxattempts)
+    return(0);
+  deadletter = job->dirq->deadletter;
+  errcode = 0;
+  pthread_mutex_lock(&job->mutex);
+  if (move_to_deadletter(job->dirq, path) != 0 &&
+      dirq_get_errcode(deadletter) != ENOENT) {
+    errcode = dirq_get_errcode(deadletter);
+    snprintf(errstr, sizeof(errstr), "%s", dirq_get_errstr(deadletter));
+  }
+  pthread_mutex_unlock(&job->mutex);
+  if (errcode == 0)
+    return(0);
+  _purge_error(job, errcode, "%s", errstr);
+  return(-1);
+}
+
+/*
+ * purge one intermediate directory: COUNT removals | -1 error
+ */
+
+static int _purge_dir (struct purge_job_s *job, const char *dir, int last)
+{
+  DIR *dirp;
+  struct dirent *dp;
+  int dirfd, count, kept, len;
+
+  count = kept = 0;
+  dirfd = openat(job->rootfd, dir, O_RDONLY|O_DIRECTORY);
+  if (dirfd < 0) {
+    if (errno == ENOENT)
+      return(0);
+    _purge_error(job, errno, "cannot open(%s/%s): %s",
+                 job->dirq->buffer, dir, ERROR);
+    return(-1);
+  }
+  dirp = fdopendir(dirfd);
+  if (!dirp) {
+    _purge_error(job, errno, "cannot fdopendir(%s/%s): %s",
+                 job->dirq->buffer, dir, ERROR);
+    (void) close(dirfd); /* best effort cleanup... */
+    return(-1);
+  }
+  while (1) {
+    errno = 0;
+    dp = readdir(dirp);
+    if (!dp) {
+      if (errno != 0) {
+        _purge_error(job, errno, "cannot readdir(%s/%s): %s",
+                     job->dirq->buffer, dir, ERROR);
+        (void) closedir(dirp); /* best effort cleanup... */
+        return(-1);
+      }
+      /* end of directory */
+      break;
+    }
+    if (dp->d_name[0] == '.') {
+      if (dp->d_name[1] == '\0')
+        continue;
+      if (dp->d_name[1] == '.' && dp->d_name[2] == '\0')
+        continue;
+    }
+    len = strlen(dp->d_name);
+    switch (purge_check(dirfd, dp->d_name, len, job->oldlock, job->oldtemp,
+                        _purge_mtime)) {
+    case PURGE_KEEP:
+      /* count it to prevent parent directory removal */
+      kept++;
+      continue;
+    case PURGE_SKIP:
+      continue;
+    case PURGE_DONE:
+      count++;
+      continue;
+    case PURGE_LOCK:
+      if (job->dirq->deadletter &&
+          _purge_job_deadletter(job, dir, dp->d_name, len) != 0) {
+        (void) closedir(dirp); /* best effort cleanup... */
+        return(-1);
+      }
+      /* FALLTHROUGH */
+    case PURGE_UNLINK:
+      if (unlinkat(dirfd, dp->d_name, 0) == 0) {
+        count++;
+        continue;
+      }
+      if (errno == ENOENT)
+        continue;
+      break;
+    }
+    _purge_error(job, errno, "cannot purge(%s/%s/%s): %s",
+                 job->dirq->buffer, dir, dp->d_name, ERROR);
+    (void) closedir(dirp); /* best effort cleanup... */
+    return(-1);
+  }
+  if (closedir(dirp) < 0) {
+    _purge_error(job, errno, "cannot closedir(%s/%s): %s",
+                 job->dirq->buffer, dir, ERROR);
+    return(-1);
+  }
+  if (kept == 0 && !last) {
+    /* remove empty intermediate directories except the last one */
+    if (unlinkat(job->rootfd, dir, AT_REMOVEDIR) != 0 && errno != ENOENT) {
+      _purge_error(job, errno, "cannot rmdir(%s/%s): %s",
+                   job->dirq->buffer, dir, ERROR);
+      return(-1);
+    }
+    count++;
+  }
+  return(count);
+}
+
+/*
+ * purge worker: grab the next intermediate directory until none is left
+ */
+
+static void *_purge_worker (void *arg)
+{
+  struct purge_job_s *job;
+  dirq_t dirq;
+  char dir[DIR_NAME_LENGTH + 1];
+  int index, result;
+
+  job = (struct purge_job_s *)arg;
+  dirq = job->dirq;
+  dir[DIR_NAME_LENGTH] = '\0';
+  while (1) {
+    pthread_mutex_lock(&job->mutex);
+    index = job->errcode ? dirq->dirs_count : job->index++;
+    pthread_mutex_unlock(&job->mutex);
+    if (index >= dirq->dirs_count)
+      break;
+    memcpy(dir, DIRBUF(dirq,index), DIRS_SIZE);
+    result = _purge_dir(job, dir, index == dirq->dirs_count - 1);
+    if (result < 0)
+      break;
+    pthread_mutex_lock(&job->mutex);
+    job->count += result;
+    pthread_mutex_unlock(&job->mutex);
+  }
+  return(NULL);
+}
+
+/*
+ * dirq_purge(DIRQ): COUNT removals | -1 error
+ */
+
+int dirq_purge (dirq_t dirq)
+{
+  struct purge_job_s job;
+  pthread_t *threads;
+  int started, result;
+  uint32_t now;
+
+  result = _get_dirs(dirq);
+  if (result < 0)
+    return(-1);
+  job.rootfd = open(dirq->buffer, O_RDONLY|O_DIRECTORY);
+  if (job.rootfd < 0) {
+    error_set(dirq, errno, "cannot open(%s): %s", dirq->buffer, ERROR);
+    return(-1);
+  }
+  now = (uint32_t)time(NULL);
+  job.dirq = dirq;
+  job.oldlock = dirq->maxlock ? (now - dirq->maxlock) : 0;
+  job.oldtemp = dirq->maxtemp ? (now - dirq->maxtemp) : 0;
+  job.index = job.count = job.errcode = 0;
+  pthread_mutex_init(&job.mutex, NULL);
+  /* the calling thread is also a worker */
+  threads = NULL;
+  started = 0;
+  if (dirq->purge_threads > 1 && dirq->dirs_count > 1) {
+    threads = (pthread_t *)safe_malloc(dirq->purge_threads * sizeof(pthread_t));
+    while (started < dirq->purge_threads - 1 &&
+           started < dirq->dirs_count - 1) {
+      /* failing to start more threads is not fatal: we simply use less */
+      if (pthread_create(&threads[started], NULL, _purge_worker, &job) != 0)
+        break;
+      started++;
+    }
+  }
+  (void) _purge_worker(&job);
+  while (started > 0)
+    pthread_join(threads[--started], NULL);
+  free((void *)threads);
+  pthread_mutex_destroy(&job.mutex);
+  (void) close(job.rootfd); /* nothing written so the error can be ignored */
+  iter_reset(dirq); /* we have messed up with the iterator... */
+  if (job.errcode) {
+    error_set(dirq, job.errcode, "%s", job.errstr);
+    return(-1);
+  }
+  if (dirq->tier) {
+    result = tier_purge(dirq);
+    if (result < 0)
+      return(-1);
+    job.count += result;
+  }
+  return(job.count);
+}
+
+/*
+ * remove all the entries of an intermediate directory without locking and
+ * then the directory itself (unless it is the last one), adding the size of
+ * the removed elements to the given one: COUNT elements removed | -1 error
+ */
+
+static int _expire_dir (dirq_t dirq, int rootfd, const char *dir, int last,
+                        off_t *bytes)
+{
+  DIR *dirp;
+  struct dirent *dp;
+  struct stat sb;
+  int dirfd, count, len, element;
+
+  count = 0;
+  dirfd = openat(rootfd, dir, O_RDONLY|O_DIRECTORY);
+  if (dirfd < 0) {
+    if (errno == ENOENT)
+      return(0);
+    error_set(dirq, errno, "cannot open(%s/%s): %s", dirq->buffer, dir, ERROR);
+    return(-1);
+  }
+  dirp = fdopendir(dirfd);
+  if (!dirp) {
+    error_set(dirq, errno, "cannot fdopendir(%s/%s): %s",
+              dirq->buffer, dir, ERROR);
+    (void) close(dirfd); /* best effort cleanup... */
+    return(-1);
+  }
+  while (1) {
+    errno = 0;
+    dp = readdir(dirp);
+    if (!dp) {
+      if (errno != 0) {
+        error_set(dirq, errno, "cannot readdir(%s/%s): %s",
+                  dirq->buffer, dir, ERROR);
+        (void) closedir(dirp); /* best effort cleanup... */
+        return(-1);
+      }
+      /* end of directory */
+      break;
+    }
+    if (dp->d_name[0] == '.') {
+      if (dp->d_name[1] == '\0')
+        continue;
+      if (dp->d_name[1] == '.' && dp->d_name[2] == '\0')
+        continue;
+    }
+    len = strlen(dp->d_name);
+    element = len == ELT_NAME_LENGTH && _ishexstr(dp->d_name, len);
+    if (element && fstatat(dirfd, dp->d_name, &sb, 0) != 0)
+      sb.st_size = 0;
+    if (unlinkat(dirfd, dp->d_name, 0) != 0) {
+      if (errno == ENOENT)
+        continue;
+      error_set(dirq, errno, "cannot unlink(%s/%s/%s): %s",
+                dirq->buffer, dir, dp->d_name, ERROR);
+      (void) closedir(dirp); /* best effort cleanup... */
+      return(-1);
+    }
+    if (element) {
+      count++;
+      *bytes += sb.st_size;
+    }
+  }
+  if (closedir(dirp) < 0) {
+    error_set(dirq, errno, "cannot closedir(%s/%s): %s",
+              dirq->buffer, dir, ERROR);
+    return(-1);
+  }
+  /* a late insertion may have happened: the directory is then left as is */
+  if (!last && unlinkat(rootfd, dir, AT_REMOVEDIR) != 0 &&
+      errno != ENOENT && errno != ENOTEMPTY && errno != EEXIST) {
+    error_set(dirq, errno, "cannot rmdir(%s/%s): %s", dirq->buffer, dir, ERROR);
+    return(-1);
+  }
+  return(count);
+}
+
+/*
+ * remove all the elements older than the given key: the intermediate
+ * directories before the given index are removed wholesale while, in the one
+ * at the given index, only the (unlocked) elements with a name smaller than
+ * the key are removed (the list of intermediate directories must have been
+ * obtained by _get_dirs): COUNT elements removed | -1 error
+ */
+
+static int expire_older (dirq_t dirq, int index, const char *key, int keylen)
+{
+  char dir[DIR_NAME_LENGTH + 1], name[ELEMENT_LENGTH + 1];
+  int rootfd, count, result, i;
+  off_t bytes;
+
+  count = 0;
+  if (index > 0) {
+    rootfd = open(dirq->buffer, O_RDONLY|O_DIRECTORY);
+    if (rootfd < 0) {
+      error_set(dirq, errno, "cannot open(%s): %s", dirq->buffer, ERROR);
+      return(-1);
+    }
+    dir[DIR_NAME_LENGTH] = '\0';
+    for (i = 0; i < index; i++) {
+      memcpy(dir, DIRBUF(dirq,i), DIRS_SIZE);
+      bytes = 0;
+      result = _expire_dir(dirq, rootfd, dir, i == dirq->dirs_count - 1,
+                           &bytes);
+      if (result < 0) {
+        (void) close(rootfd); /* best effort cleanup... */
+        return(-1);
+      }
+      count_update(dirq, -result, -bytes);
+      count += result;
+    }
+    (void) close(rootfd); /* nothing written so the error can be ignored */
+  }
+  if (index >= dirq->dirs_count || keylen == 0)
+    return(count);
+  /* trim the boundary intermediate directory, element by element */
+  memmove(TMP1NAME(dirq), DIRBUF(dirq,index), DIRS_SIZE);
+  *(TMP1NAME(dirq) + DIRS_SIZE) = '\0';
+  memcpy(name, DIRBUF(dirq,index), DIRS_SIZE);
+  name[DIRS_SIZE] = '/';
+  result = _get_elts(dirq);
+  if (result < 0)
+    return(-1);
+  for (i = 0; i < dirq->elts_count; i++) {
+    if (strncmp(ELTBUF(dirq,i), key, keylen) >= 0)
+      break;
+    strcpy(name + DIRS_SIZE + 1, ELTBUF(dirq,i));
+    /* this is not a delivery attempt */
+    result = lock_element(dirq, name, 1);
+    if (result < 0)
+      return(-1);
+    if (result > 0)
+      continue;
+    result = dirq_remove(dirq, name);
+    if (result < 0)
+      return(-1);
+    count++;
+  }
+  return(count);
+}
+
+/*
+ * remove all the elements older than the given time key: COUNT elements
+ * removed | -1 error
+ */
+
+static int _expire_key (dirq_t dirq, char *key)
+{
+  int result, index, fast;
+
+  fast = 0;
+  if (dirq->tier) {
+    /* the fast queue holds elements of the same age too */
+    fast = tier_expire(dirq, key);
+    if (fast < 0)
+      return(-1);
+  }
+  result = _get_dirs(dirq);
+  if (result < 0)
+    return(-1);
+  /* the boundary is the last intermediate directory not after the cutoff */
+  index = dirs_upper_bound(dirq, key);
+  if (index > 0)
+    index--;
+  else
+    key[0] = '\0';
+  result = expire_older(dirq, index, key, key[0] ? TIME_KEY_LENGTH : 0);
+  iter_reset(dirq); /* we have messed up with the iterator... */
+  return((result < 0) ? -1 : result + fast);
+}
+
+/*
+ * dirq_expire(DIRQ, MAXAGE): COUNT elements removed | -1 error
+ */
+
+int dirq_expire (dirq_t dirq, int maxage)
+{
+  char key[TIME_KEY_LENGTH + 1];
+  struct timespec ts;
+
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "expire"));
+  dirq_now(dirq, &ts);
+  ts.tv_sec -= (maxage < 0) ? 0 : maxage;
+  set_time_key(key, &ts);
+  return(_expire_key(dirq, key));
+}
+
+/*
+ * dirq_trim_older(DIRQ, NAME): COUNT elements removed | -1 error
+ */
+
+int dirq_trim_older (dirq_t dirq, const char *name)
+{
+  char key[TIME_KEY_LENGTH + 1];
+
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "trim_older"));
+  if (strlen(name) != ELEMENT_LENGTH || name[DIR_NAME_LENGTH] != '/' ||
+      !_ishexstr(name, DIR_NAME_LENGTH) ||
+      !_ishexstr(name + DIR_NAME_LENGTH + 1, ELT_NAME_LENGTH)) {
+    error_set(dirq, EINVAL, "cannot trim_older(%s): %s", name,
+              strerror(EINVAL));
+    return(-1);
+  }
+  /* the cutoff is the insertion time of the given element */
+  memcpy(key, name + DIR_NAME_LENGTH + 1, TIME_KEY_LENGTH);
+  key[TIME_KEY_LENGTH] = '\0';
+  return(_expire_key(dirq, key));
+}
+
+/*
+ * compaction moves elements between intermediate directories the way
+ * consumers take them, i.e. only once locked (so never while somebody else
+ * holds them), making them visible under their new name before the old one
+ * vanishes; as an intermediate directory is named after a time not after the
+ * one of its elements, merging runs of small consecutive directories into the
+ * first one and splitting big ones at element time boundaries (into new
+ * directories named after the time of their first element) preserve the
+ * iteration order, as long as no element gets past a locked one that has to
+ * stay where it is; the directories that may still receive new elements are
+ * left untouched
+ */
+
+/*
+ * get the time of an intermediate directory or element name
+ */
+
+static uint32_t _compact_time (const char *name)
+{
+  char buffer[DIR_NAME_LENGTH + 1];
+
+  memcpy(buffer, name, DIR_NAME_LENGTH);
+  buffer[DIR_NAME_LENGTH] = '\0';
+  return((uint32_t)strtoul(buffer, NULL, 16));
+}
+
+/*
+ * move an element (with its metadata sidecar, if any) to another intermediate
+ * directory: 1 moved | 0 gone | 2 locked (left in place) | -1 error
+ */
+
+static int _compact_move (dirq_t dirq, uint32_t from, const char *elt,
+                          uint32_t to)
+{
+  char path[MAXPATHLEN], dest[MAXPATHLEN], dir[MAXPATHLEN];
+  char lock[MAXPATHLEN + SUFFIX_LENGTH], meta[MAXPATHLEN + SUFFIX_LENGTH];
+  char dmeta[MAXPATHLEN + SUFFIX_LENGTH];
+  int saved, restored;
+
+  snprintf(path, sizeof(path), "%s/%08x/%s", dirq->buffer, from, elt);
+  snprintf(lock, sizeof(lock), "%s%s", path, LOCKED_SUFFIX);
+  snprintf(meta, sizeof(meta), "%s%s", path, META_SUFFIX);
+  snprintf(dest, sizeof(dest), "%s/%08x/%s", dirq->buffer, to, elt);
+  snprintf(dmeta, sizeof(dmeta), "%s%s", dest, META_SUFFIX);
+  /* lock it (and touch it to indicate the lock time), as in dirq_lock() */
+  if (link(path, lock) != 0) {
+    if (errno == ENOENT)
+      return(0);
+    if (errno == EEXIST)
+      return(2);
+    error_set(dirq, errno, "cannot link(%s, %s): %s", path, lock, ERROR);
+    return(-1);
+  }
+  if (utime(path, NULL) != 0) {
+    saved = errno;
+    (void) unlink(lock); /* best effort cleanup... */
+    error_set(dirq, saved, "cannot utime(%s, NULL): %s", path,
+              strerror(saved));
+    return(-1);
+  }
+  restored = 0;
+  while (1) {
+    /* the metadata must be there as soon as the element is visible */
+    if (link(meta, dmeta) != 0 && errno != ENOENT) {
+      saved = errno;
+      (void) unlink(lock); /* best effort cleanup... */
+      error_set(dirq, saved, "cannot link(%s, %s): %s", meta, dmeta,
+                strerror(saved));
+      return(-1);
+    }
+    if (link(path, dest) == 0)
+      break;
+    saved = errno;
+    (void) unlink(dmeta); /* best effort cleanup... */
+    if (saved == ENOENT && !restored) {
+      /* the target may have been purged meanwhile (if it was empty) */
+      restored = 1;
+      snprintf(dir, sizeof(dir), "%s/%08x", dirq->buffer, to);
+      if (ensure_directory(dirq, dir) == 0)
+        continue;
+      (void) unlink(lock); /* best effort cleanup... */
+      return(-1);
+    }
+    (void) unlink(lock); /* best effort cleanup... */
+    if (saved == EEXIST)
+      return(2);
+    error_set(dirq, saved, "cannot link(%s, %s): %s", path, dest,
+              strerror(saved));
+    return(-1);
+  }
+  /* the element is now only available (unlocked) under its new name */
+  if (unlink(path) != 0) {
+    error_set(dirq, errno, "cannot unlink(%s): %s", path, ERROR);
+    return(-1);
+  }
+  if (unlink(lock) != 0) {
+    error_set(dirq, errno, "cannot unlink(%s): %s", lock, ERROR);
+    return(-1);
+  }
+  (void) unlink(meta); /* an orphan sidecar would be purged anyway... */
+  return(1);
+}
+
+/*
+ * move all the elements of an intermediate directory (in tmp1) to a previous
+ * one, stopping at the first locked one (the following ones would otherwise
+ * come before it): COUNT moved | -1 error
+ */
+
+static int _compact_dir (dirq_t dirq, uint32_t to)
+{
+  uint32_t from;
+  int moved, result, i;
+
+  from = _compact_time(TMP1NAME(dirq));
+  if (_get_elts(dirq) < 0)
+    return(-1);
+  /* the consumers may have gone through the target already */
+  if (dirq->elts_count > 0)
+    checkpoint_reset(dirq, to);
+  moved = 0;
+  for (i = 0; i < dirq->elts_count; i++) {
+    result = _compact_move(dirq, from, ELTBUF(dirq,i), to);
+    if (result < 0)
+      return(-1);
+    if (result == 2)
+      break;
+    moved += result;
+  }
+  return(moved);
+}
+
+/*
+ * split an intermediate directory (in tmp1) by keeping its first elements and
+ * switching to new directories every given number of elements, but only at
+ * time boundaries and before the given limit; the newest elements are moved
+ * first, stopping at the first locked one (the previous ones would otherwise
+ * come after it): COUNT moved | -1 error
+ */
+
+static int _compact_split (dirq_t dirq, int target, uint32_t limit)
+{
+  char path[MAXPATHLEN];
+  uint32_t *dest, from, time, to, made;
+  int keep, moved, result, i;
+
+  from = _compact_time(TMP1NAME(dirq));
+  if (_get_elts(dirq) < 0)
+    return(-1);
+  if (dirq->elts_count == 0)
+    return(0);
+  dest = (uint32_t *)safe_malloc(dirq->elts_count * sizeof(uint32_t));
+  to = from;
+  keep = target;
+  for (i = 0; i < dirq->elts_count; i++) {
+    time = _compact_time(ELTBUF(dirq,i));
+    if (keep <= 0 && time > to && time < limit) {
+      to = time;
+      keep = target;
+    }
+    keep--;
+    dest[i] = to;
+  }
+  moved = 0;
+  made = from;
+  /* the consumers may have gone through the targets already */
+  if (dest[dirq->elts_count - 1] != from)
+    checkpoint_reset(dirq, from);
+  for (i = dirq->elts_count - 1; i >= 0 && dest[i] != from; i--) {
+    if (dest[i] != made) {
+      made = dest[i];
+      snprintf(path, sizeof(path), "%s/%08x", dirq->buffer, made);
+      if (ensure_directory(dirq, path) != 0)
+        goto error;
+    }
+    result = _compact_move(dirq, from, ELTBUF(dirq,i), dest[i]);
+    if (result < 0)
+      goto error;
+    if (result == 2)
+      break;
+    moved += result;
+  }
+  free((void *)dest);
+  return(moved);
+ error:
+  free((void *)dest);
+  return(-1);
+}
+
+/*
+ * remove an intermediate directory: 0 removed | 1 not empty | -1 error
+ */
+
+static int _compact_rmdir (dirq_t dirq, uint32_t dir)
+{
+  char path[MAXPATHLEN];
+
+  snprintf(path, sizeof(path), "%s/%08x", dirq->buffer, dir);
+  if (rmdir(path) == 0 || errno == ENOENT)
+    return(0);
+  if (errno == ENOTEMPTY || errno == EEXIST)
+    return(1);
+  error_set(dirq, errno, "cannot rmdir(%s): %s", path, ERROR);
+  return(-1);
+}
+
+/*
+ * merge a run of intermediate directories into the first one (or into the
+ * last one that could not be emptied): COUNT moved | -1 error
+ */
+
+static int _compact_merge (dirq_t dirq, const uint32_t *dirs, int first,
+                           int last)
+{
+  int moved, result, i;
+
+  moved = 0;
+  for (i = first + 1; i <= last; i++) {
+    sprintf(TMP1NAME(dirq), "%08x", dirs[i]);
+    result = _compact_dir(dirq, dirs[first]);
+    if (result < 0)
+      return(-1);
+    moved += result;
+    result = _compact_rmdir(dirq, dirs[i]);
+    if (result < 0)
+      return(-1);
+    if (result > 0)
+      first = i;
+  }
+  return(moved);
+}
+
+/*
+ * dirq_compact(DIRQ, TARGET): COUNT elements moved | -1 error
+ */
+
+int dirq_compact (dirq_t dirq, int target)
+{
+  uint32_t *dirs, active, now;
+  int ndirs, eligible, first, total, moved, count, result, i;
+
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "compact"));
+  if (target <= 0)
+    target = dirq->bucket_size;
+  if (target <= 0) {
+    error_set(dirq, EINVAL, "cannot compact(%s): %s", dirq->buffer,
+              "no target size");
+    return(-1);
+  }
+  if (_get_dirs(dirq) < 0)
+    return(-1);
+  ndirs = dirq->dirs_count;
+  dirs = (uint32_t *)safe_malloc((ndirs + 1) * sizeof(uint32_t));
+  for (i = 0; i < ndirs; i++)
+    dirs[i] = _compact_time(DIRBUF(dirq,i));
+  /* skip the directories that may still receive new elements */
+  now = (uint32_t)time(NULL);
+  active = 0;
+  for (i = 0; i < ndirs && dirs[i] <= now; i++)
+    active = dirs[i];
+  for (eligible = 0; eligible < ndirs - 1; eligible++)
+    if (dirs[eligible] == active ||
+        dirs[eligible] + MAX(dirq->granularity, 1) > now)
+      break;
+  /* greedily merge runs of small directories and split big ones */
+  moved = total = 0;
+  first = -1;
+  for (i = 0; i < eligible; i++) {
+    sprintf(TMP1NAME(dirq), "%08x", dirs[i]);
+    result = _iterate(dirq, dirq->tmp1_offset, _bucket_count_cb);
+    if (result < 0)
+      goto error;
+    if (first >= 0 && total + result <= target) {
+      total += result;
+      continue;
+    }
+    if (first >= 0 && i - 1 > first) {
+      count = _compact_merge(dirq, dirs, first, i - 1);
+      if (count < 0)
+        goto error;
+      moved += count;
+    }
+    first = -1;
+    if (result > 2 * target) {
+      sprintf(TMP1NAME(dirq), "%08x", dirs[i]);
+      count = _compact_split(dirq, target, dirs[i + 1]);
+      if (count < 0)
+        goto error;
+      moved += count;
+      continue;
+    }
+    first = i;
+    total = result;
+  }
+  if (first >= 0 && eligible - 1 > first) {
+    count = _compact_merge(dirq, dirs, first, eligible - 1);
+    if (count < 0)
+      goto error;
+    moved += count;
+  }
+  free((void *)dirs);
+  iter_reset(dirq); /* we have messed up with the iterator... */
+  return(moved);
+ error:
+  free((void *)dirs);
+  return(-1);
+}
@@ -0,0 +1,32 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq purge support                                                         *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * types
+ */
+
+struct purge_job_s {
+  dirq_t          dirq;         /* directory queue being purged (read only) */
+  int             rootfd;       /* file descriptor of the toplevel directory */
+  uint32_t        oldlock;      /* locks older than this will be purged */
+  uint32_t        oldtemp;      /* temp files older than this will be purged */
+  pthread_mutex_t mutex;        /* mutex protecting the fields below */
+  int             index;        /* index of next directory to purge */
+  int             count;        /* number of removals */
+  int             errcode;      /* code of the first error */
+  char            errstr[1024]; /* string of the first error */
+};
+
+/*
+ * functions
+ */
+
+static int expire_older (dirq_t dirq, int index, const char *key, int keylen);
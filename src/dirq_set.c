@@ -0,0 +1,478 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq set support                                                           *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * constants
+ */
+
+/*
+ * some changes are not notified (unlocks in older intermediate directories,
+ * delayed elements becoming visible, packed appends, fast tiers...) so all the
+ * queues are reported at least once per rescan interval (in milliseconds)
+ */
+
+#define SET_RESCAN 1000
+
+#ifdef __linux__
+#define SET_ROOT_MASK   (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+#define SET_BUCKET_MASK (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_ONLYDIR)
+#endif
+
+/*
+ * macros
+ */
+
+#define WDDIR(_s,_i) (_s->wddirs + (_i) * DIRS_SIZE)
+
+/*
+ * record an error (both code and string)
+ */
+
+static void _set_error (dirq_set_t set, int errcode, const char *fmt, ...)
+{
+  va_list ap;
+
+  assert(errcode != 0);
+  set->errcode = errcode;
+  va_start(ap, fmt);
+  vsnprintf(set->errstr, sizeof(set->errstr), fmt, ap);
+  va_end(ap);
+}
+
+/*
+ * count the queues that may have new elements
+ */
+
+static int _set_ready (dirq_set_t set)
+{
+  int i, count;
+
+  count = 0;
+  for (i = 0; i < set->count; i++)
+    if (set->ready[i])
+      count++;
+  return(count);
+}
+
+/*
+ * report all the queues as maybe having new elements: COUNT
+ */
+
+static int _set_rescan (dirq_set_t set)
+{
+  int i;
+
+  for (i = 0; i < set->count; i++)
+    set->ready[i] = 1;
+  clock_gettime(CLOCK_MONOTONIC, &set->rescanned);
+  return(set->count);
+}
+
+#ifdef __linux__
+
+/*
+ * milliseconds elapsed since the given (monotonic) time
+ */
+
+static int _set_elapsed (const struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return((now.tv_sec - since->tv_sec) * 1000 +
+         (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+/*
+ * forget the given watch (in the list only)
+ */
+
+static void _set_forget (dirq_set_t set, int i)
+{
+  set->watches--;
+  set->wds[i] = set->wds[set->watches];
+  set->wdqs[i] = set->wdqs[set->watches];
+  memcpy(WDDIR(set,i), WDDIR(set,set->watches), DIRS_SIZE);
+}
+
+/*
+ * watch a directory on behalf of the given queue (a missing directory is fine)
+ */
+
+static int _set_watch (dirq_set_t set, int index, const char *dir)
+{
+  char path[MAXPATHLEN];
+  int wd, i;
+
+  if (dir) {
+    /* only the most recent intermediate directory is watched */
+    for (i = 0; i < set->watches; i++)
+      if (set->wdqs[i] == index && WDDIR(set,i)[0] &&
+          memcmp(WDDIR(set,i), dir, DIR_NAME_LENGTH) >= 0)
+        return(0);
+    snprintf(path, sizeof(path), "%s/%s", set->dirqs[index]->buffer, dir);
+    wd = inotify_add_watch(set->fd, path, SET_BUCKET_MASK);
+  } else {
+    snprintf(path, sizeof(path), "%s", set->dirqs[index]->buffer);
+    wd = inotify_add_watch(set->fd, path, SET_ROOT_MASK);
+  }
+  if (wd < 0) {
+    if (errno == ENOENT)
+      return(0);
+    _set_error(set, errno, "cannot inotify_add_watch(%s): %s", path, ERROR);
+    return(-1);
+  }
+  /* the same directory always gives the same watch descriptor */
+  for (i = 0; i < set->watches; i++)
+    if (set->wds[i] == wd)
+      return(0);
+  if (dir) {
+    /* the previous intermediate directory is not watched anymore */
+    for (i = 0; i < set->watches; i++) {
+      if (set->wdqs[i] == index && WDDIR(set,i)[0]) {
+        (void) inotify_rm_watch(set->fd, set->wds[i]); /* maybe gone... */
+        _set_forget(set, i);
+        break;
+      }
+    }
+    i = set->watches;
+  }
+  set->wds = (int *)safe_realloc(set->wds, (i + 1) * sizeof(int));
+  set->wdqs = (int *)safe_realloc(set->wdqs, (i + 1) * sizeof(int));
+  set->wddirs = (char *)safe_realloc(set->wddirs, (i + 1) * DIRS_SIZE);
+  set->wds[i] = wd;
+  set->wdqs[i] = index;
+  /* the toplevel directory is recorded with an empty name */
+  memset(WDDIR(set,i), 0, DIRS_SIZE);
+  if (dir)
+    memcpy(WDDIR(set,i), dir, DIR_NAME_LENGTH);
+  set->watches++;
+  return(0);
+}
+
+/*
+ * watch the toplevel directory and the most recent intermediate directory of
+ * the given queue (found in tmp2 by listing the toplevel directory, so that its
+ * iterator is left untouched), forgetting all its watches on error
+ */
+
+static int _set_latest_cb (dirq_t dirq, const char *name, int len)
+{
+  if (len == DIR_NAME_LENGTH && _ishexstr(name, len) &&
+      strncmp(name, TMP2NAME(dirq), DIR_NAME_LENGTH) > 0)
+    memcpy(TMP2NAME(dirq), name, DIR_NAME_LENGTH);
+  return(0);
+}
+
+static int _set_watch_queue (dirq_set_t set, int index)
+{
+  char dir[DIR_NAME_LENGTH + 1];
+  dirq_t dirq;
+  int i;
+
+  dirq = set->dirqs[index];
+  if (_set_watch(set, index, NULL) == 0) {
+    memset(TMP2NAME(dirq), 0, DIR_NAME_LENGTH + 1);
+    if (_iterate(dirq, 0, _set_latest_cb) == 0) {
+      strcpy(dir, TMP2NAME(dirq));
+      if (!dir[0] || _set_watch(set, index, dir) == 0)
+        return(0);
+    } else {
+      _set_error(set, dirq_get_errcode(dirq), "%s", dirq_get_errstr(dirq));
+    }
+  }
+  for (i = set->watches - 1; i >= 0; i--) {
+    if (set->wdqs[i] == index) {
+      (void) inotify_rm_watch(set->fd, set->wds[i]); /* maybe gone... */
+      _set_forget(set, i);
+    }
+  }
+  return(-1);
+}
+
+/*
+ * handle one inotify event
+ */
+
+static int _set_event (dirq_set_t set, const struct inotify_event *event)
+{
+  char path[MAXPATHLEN];
+  int i, index, len;
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    /* events have been lost so all the queues must be checked */
+    (void) _set_rescan(set);
+    return(0);
+  }
+  for (i = 0; i < set->watches; i++)
+    if (set->wds[i] == event->wd)
+      break;
+  if (i == set->watches)
+    return(0);
+  index = set->wdqs[i];
+  if (event->mask & IN_IGNORED) {
+    /* the directory is gone (e.g. purged) */
+    _set_forget(set, i);
+    return(0);
+  }
+  len = event->len ? strlen(event->name) : 0;
+  if (event->mask & IN_ISDIR) {
+    /* new intermediate directory: watch it too */
+    if (len != DIR_NAME_LENGTH || !_ishexstr(event->name, len))
+      return(0);
+    set->ready[index] = 1;
+    return(_set_watch(set, index, event->name));
+  }
+  if (event->mask & IN_DELETE) {
+    /* unlocked element: it is available again unless it has been removed */
+    if (len == ELT_NAME_LENGTH + 4 && _ishexstr(event->name, ELT_NAME_LENGTH)
+        && strcmp(event->name + ELT_NAME_LENGTH, LOCKED_SUFFIX) == 0) {
+      snprintf(path, sizeof(path), "%s/%.*s/%.*s",
+               set->dirqs[index]->buffer, DIR_NAME_LENGTH, WDDIR(set,i),
+               ELT_NAME_LENGTH, event->name);
+      if (access(path, F_OK) == 0)
+        set->ready[index] = 1;
+    }
+    return(0);
+  }
+  /* new element (temporary and locked files are ignored) */
+  if (len == ELT_NAME_LENGTH && _ishexstr(event->name, len))
+    set->ready[index] = 1;
+  return(0);
+}
+
+/*
+ * read and handle all the pending inotify events
+ */
+
+static int _set_read (dirq_set_t set)
+{
+  char buffer[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *event;
+  ssize_t result;
+  char *ptr;
+
+  while (1) {
+    result = read(set->fd, buffer, sizeof(buffer));
+    if (result < 0) {
+      if (errno == EAGAIN)
+        return(0);
+      if (errno == EINTR)
+        continue;
+      _set_error(set, errno, "cannot read(inotify): %s", ERROR);
+      return(-1);
+    }
+    for (ptr = buffer; ptr < buffer + result;
+         ptr += sizeof(struct inotify_event) + event->len) {
+      event = (const struct inotify_event *)ptr;
+      if (_set_event(set, event) < 0)
+        return(-1);
+    }
+  }
+}
+
+#endif /* __linux__ */
+
+/*
+ * dirq_set_new(): SET
+ */
+
+dirq_set_t dirq_set_new (void)
+{
+  dirq_set_t set;
+
+  set = (dirq_set_t)safe_malloc(sizeof(struct dirq_set_s));
+  set->count = 0;
+  set->dirqs = NULL;
+  set->weights = NULL;
+  set->ready = NULL;
+  set->mux = NULL;
+  set->watches = 0;
+  set->wds = NULL;
+  set->wdqs = NULL;
+  set->wddirs = NULL;
+  set->errcode = 0;
+  clock_gettime(CLOCK_MONOTONIC, &set->rescanned);
+#ifdef __linux__
+  set->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (set->fd < 0)
+    _set_error(set, errno, "cannot inotify_init1(): %s", ERROR);
+#else
+  set->fd = -1;
+#endif
+  return(set);
+}
+
+/*
+ * dirq_set_free(SET)
+ */
+
+void dirq_set_free (dirq_set_t set)
+{
+  if (set->fd >= 0)
+    (void) close(set->fd); /* best effort cleanup... */
+  if (set->mux)
+    mux_free(set->mux);
+  free((void *)set->dirqs);
+  free((void *)set->weights);
+  free((void *)set->ready);
+  free((void *)set->wds);
+  free((void *)set->wdqs);
+  free((void *)set->wddirs);
+  free((void *)set);
+}
+
+/*
+ * dirq_set_add(SET, DIRQ, WEIGHT): 0 success | -1 error
+ */
+
+int dirq_set_add (dirq_set_t set, dirq_t dirq, int weight)
+{
+  int index;
+
+  index = set->count;
+  set->dirqs = (dirq_t *)safe_realloc(set->dirqs, (index + 1) * sizeof(dirq_t));
+  set->weights = (int *)safe_realloc(set->weights, (index + 1) * sizeof(int));
+  set->ready = (char *)safe_realloc(set->ready, index + 1);
+  set->dirqs[index] = dirq;
+  set->weights[index] = weight;
+  set->ready[index] = 1; /* the queue may already contain elements */
+#ifdef __linux__
+  if (set->fd >= 0 && _set_watch_queue(set, index) < 0)
+    return(-1);
+#endif
+  /* the queue only becomes part of the set once watched */
+  set->count++;
+  /* the multiplexer cannot grow so we simply create a new one */
+  if (set->mux)
+    mux_free(set->mux);
+  set->mux = mux_new(set->count, set->weights);
+  return(0);
+}
+
+/*
+ * dirq_set_wait(SET, TIMEOUT): COUNT ready queues | 0 timeout | -1 error
+ */
+
+int dirq_set_wait (dirq_set_t set, int timeout)
+{
+#ifdef __linux__
+  struct pollfd pfd;
+  struct timespec start;
+  int remaining, rescan;
+#endif
+  int result;
+
+  result = _set_ready(set);
+  if (result > 0 || set->count == 0)
+    return(result);
+  if (set->fd < 0) {
+    /* no notifications: sleep and then check all the queues */
+    if (timeout > 0)
+      (void) poll(NULL, 0, timeout);
+    return(_set_rescan(set));
+  }
+#ifdef __linux__
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  remaining = timeout;
+  while (1) {
+    /* never wait past the next rescan */
+    rescan = SET_RESCAN - _set_elapsed(&set->rescanned);
+    if (rescan <= 0)
+      return(_set_rescan(set));
+    pfd.fd = set->fd;
+    pfd.events = POLLIN;
+    result = poll(&pfd, 1, (remaining < 0 || remaining > rescan) ?
+                  rescan : remaining);
+    if (result < 0 && errno != EINTR) {
+      _set_error(set, errno, "cannot poll(inotify): %s", ERROR);
+      return(-1);
+    }
+    if (result > 0) {
+      if (_set_read(set) < 0)
+        return(-1);
+      result = _set_ready(set);
+      if (result > 0)
+        return(result);
+    }
+    if (timeout < 0)
+      continue;
+    remaining = timeout - _set_elapsed(&start);
+    if (remaining <= 0)
+      return(0);
+  }
+#else
+  return(0);
+#endif
+}
+
+/*
+ * dirq_set_first(SET, DIRQ): NAME | NULL end or error
+ * dirq_set_next(SET, DIRQ): NAME | NULL end or error
+ */
+
+static const char *_set_check (dirq_set_t set, const char *name)
+{
+  dirq_t failed;
+
+  if (!name && set->mux && set->mux->failed) {
+    failed = set->mux->failed;
+    _set_error(set, dirq_get_errcode(failed), "%s", dirq_get_errstr(failed));
+  }
+  return(name);
+}
+
+const char *dirq_set_first (dirq_set_t set, dirq_t *dirq)
+{
+  struct mux_s *mux;
+  int i;
+
+  mux = set->mux;
+  if (!mux)
+    return(NULL);
+  for (i = 0; i < set->count; i++) {
+    /* queues not exhausted during the previous round must be checked again */
+    if (mux->dirqs[i] &&
+        (mux->states[i] != MUX_DONE || mux->dirqs[i] == mux->failed))
+      set->ready[i] = 1;
+  }
+  for (i = 0; i < set->count; i++) {
+    mux->dirqs[i] = set->ready[i] ? set->dirqs[i] : NULL;
+    set->ready[i] = 0;
+  }
+  return(_set_check(set, mux_first(mux, dirq)));
+}
+
+const char *dirq_set_next (dirq_set_t set, dirq_t *dirq)
+{
+  if (!set->mux)
+    return(NULL);
+  return(_set_check(set, mux_next(set->mux, dirq)));
+}
+
+/*
+ * return the "current" error code
+ */
+
+int dirq_set_get_errcode (dirq_set_t set)
+{
+  return(set->errcode);
+}
+
+/*
+ * return the "current" error string (or NULL if there is no error)
+ */
+
+const char *dirq_set_get_errstr (dirq_set_t set)
+{
+  return(set->errcode ? set->errstr : NULL);
+}
@@ -0,0 +1,31 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq set support                                                           *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * types
+ */
+
+struct dirq_set_s {
+  int          count;         /* number of queues in the set */
+  dirq_t      *dirqs;         /* queues in the set (not owned) */
+  int         *weights;       /* weights of the queues */
+  char        *ready;         /* true if the queue may have new elements */
+  struct mux_s *mux;          /* multiplexer for iteration */
+  int          fd;            /* inotify file descriptor (-1 if none) */
+  int          watches;       /* number of watches */
+  int         *wds;           /* watch descriptors */
+  int         *wdqs;          /* queue indexes of the watch descriptors */
+  char        *wddirs;        /* intermediate directories of the watches */
+  struct timespec rescanned;  /* time when all the queues were last reported */
+  int          errcode;       /* code of the "current" error */
+  char         errstr[1024];  /* string of the "current" error */
+};
+
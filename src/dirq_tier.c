@@ -0,0 +1,345 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq tier support                                                          *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * a tiered queue adds new elements to a (memory backed) fast queue as long as
+ * it is not too full; old or excess elements are migrated to the (persistent)
+ * queue itself, keeping their insertion time; since elements are named after
+ * their insertion time, iterating over both queues in parallel and always
+ * returning the smallest name gives elements in insertion time order
+ */
+
+/*
+ * copy a tier (the fast queue is copied too)
+ */
+
+static struct tier_s *tier_copy (const struct tier_s *tier)
+{
+  struct tier_s *copy;
+
+  copy = (struct tier_s *)safe_malloc(sizeof(struct tier_s));
+  memcpy((void *)copy, (const void *)tier, sizeof(struct tier_s));
+  copy->fast = dirq_copy(tier->fast);
+  return(copy);
+}
+
+/*
+ * free a tier (including its fast queue)
+ */
+
+static void tier_free (struct tier_s *tier)
+{
+  dirq_free(tier->fast);
+  free((void *)tier);
+}
+
+/*
+ * report the error of the fast queue (if any) as an error of the queue
+ */
+
+static int tier_error (dirq_t dirq, int result)
+{
+  dirq_t fast;
+
+  fast = dirq->tier->fast;
+  if (result < 0 && dirq_get_errcode(fast)) {
+    error_set(dirq, dirq_get_errcode(fast), "%s", dirq_get_errstr(fast));
+    dirq_clear_error(fast);
+  }
+  return(result);
+}
+
+/*
+ * find out which queue holds the given element: the fast queue or NULL
+ */
+
+static dirq_t tier_route (dirq_t dirq, const char *name)
+{
+  dirq_t fast;
+
+  fast = dirq->tier->fast;
+  strcpy(TMP1NAME(fast), name);
+  return(access(TMP1BUF(fast), F_OK) == 0 ? fast : NULL);
+}
+
+/*
+ * check if the fast queue can accept one more element (it is counted at most
+ * once per second and the count is then estimated); the count uses its own
+ * listing as dirq_count() would reset the iterator of the fast queue, which
+ * the iteration of the queue relies on (e.g. when adding while iterating)
+ */
+
+static int _tier_count_cb (dirq_t fast, const char *name, int len)
+{
+  if (len != DIR_NAME_LENGTH || !_ishexstr(name, len))
+    return(0);
+  strcpy(TMP1NAME(fast), name);
+  return(_iterate(fast, fast->tmp1_offset, _bucket_count_cb));
+}
+
+static int tier_accept (dirq_t dirq)
+{
+  struct tier_s *tier;
+  time_t now;
+  int count;
+
+  tier = dirq->tier;
+  if (tier->maxcount <= 0)
+    return(1);
+  now = time(NULL);
+  if (now != tier->counted) {
+    count = _iterate(tier->fast, 0, _tier_count_cb);
+    if (count < 0) {
+      /* the persistent queue will be used instead */
+      dirq_clear_error(tier->fast);
+      return(0);
+    }
+    tier->count = count;
+    tier->counted = now;
+  }
+  if (tier->count >= tier->maxcount)
+    return(0);
+  tier->count++;
+  return(1);
+}
+
+/*
+ * add data (via callback) to the fast queue: NAME success | NULL error
+ */
+
+static const char *tier_add (dirq_t dirq, dirq_iow callback)
+{
+  const char *name;
+
+  name = _add(dirq->tier->fast, callback, NULL);
+  if (!name) {
+    tier_error(dirq, -1);
+    return(NULL);
+  }
+  strcpy(TMP2NAME(dirq), name);
+  return(TMP2NAME(dirq));
+}
+
+/*
+ * merge the iterations of both queues: NAME (in tmp1) | NULL end or error
+ */
+
+static const char *_tier_pick (dirq_t dirq)
+{
+  struct tier_s *tier;
+  int i;
+
+  tier = dirq->tier;
+  if (tier->heads[0][0] && tier->heads[1][0] &&
+      dirq->order == DIRQ_ORDER_LIFO)
+    i = (strcmp(tier->heads[0], tier->heads[1]) >= 0) ? 0 : 1;
+  else if (tier->heads[0][0] && tier->heads[1][0])
+    i = (strcmp(tier->heads[0], tier->heads[1]) <= 0) ? 0 : 1;
+  else if (tier->heads[0][0])
+    i = 0;
+  else if (tier->heads[1][0])
+    i = 1;
+  else
+    return(NULL);
+  strcpy(TMP1NAME(dirq), tier->heads[i]);
+  tier->heads[i][0] = '\0';
+  return(TMP1NAME(dirq));
+}
+
+static int _tier_head (dirq_t dirq, int i, const char *name)
+{
+  struct tier_s *tier;
+
+  tier = dirq->tier;
+  if (name) {
+    strcpy(tier->heads[i], name);
+    return(0);
+  }
+  tier->done[i] = 1;
+  if (i == 1 && dirq_get_errcode(tier->fast))
+    return(tier_error(dirq, -1));
+  return(0);
+}
+
+static const char *tier_first (dirq_t dirq, const char *key)
+{
+  struct tier_s *tier;
+
+  tier = dirq->tier;
+  tier->heads[0][0] = tier->heads[1][0] = '\0';
+  tier->done[0] = tier->done[1] = 0;
+  if (_tier_head(dirq, 0, iter_next(dirq)) < 0)
+    return(NULL);
+  strcpy(tier->fast->until_key, dirq->until_key);
+  if (_tier_head(dirq, 1, iter_start(tier->fast, key)) < 0)
+    return(NULL);
+  return(_tier_pick(dirq));
+}
+
+static const char *tier_next (dirq_t dirq)
+{
+  struct tier_s *tier;
+
+  tier = dirq->tier;
+  if (!tier->done[0] && !tier->heads[0][0] &&
+      _tier_head(dirq, 0, iter_next(dirq)) < 0)
+    return(NULL);
+  if (!tier->done[1] && !tier->heads[1][0] &&
+      _tier_head(dirq, 1, dirq_next(tier->fast)) < 0)
+    return(NULL);
+  return(_tier_pick(dirq));
+}
+
+/*
+ * purge the fast queue (in one incremental pass to keep its iterator)
+ */
+
+static int tier_purge (dirq_t dirq)
+{
+  return(tier_error(dirq, dirq_purge_step(dirq->tier->fast, INT_MAX)));
+}
+
+/*
+ * remove the elements of the fast queue older than the given time key (which
+ * is left untouched): COUNT elements removed | -1 error
+ */
+
+static int tier_expire (dirq_t dirq, const char *key)
+{
+  char copy[TIME_KEY_LENGTH + 1];
+
+  strcpy(copy, key);
+  return(tier_error(dirq, _expire_key(dirq->tier->fast, copy)));
+}
+
+/*
+ * migrate one locked element from the fast queue to the queue, keeping its
+ * insertion time
+ */
+
+static int _tier_migrate (dirq_t dirq, const char *name,
+                          struct timespec *when)
+{
+  if (copy_path(dirq, dirq_get_path(dirq->tier->fast, name), when) != 0)
+    return(-1);
+  /* the element is only removed once safely stored */
+  return(tier_error(dirq, dirq_remove(dirq->tier->fast, name)));
+}
+
+/*
+ * dirq_set_tier(DIRQ, PATH, MAXCOUNT, MAXAGE): 0 success | -1 error
+ */
+
+int dirq_set_tier (dirq_t dirq, const char *path, int maxcount, int maxage)
+{
+  struct tier_s *tier;
+  struct stat sb;
+  dirq_t fast;
+
+  if (dirq->tier) {
+    tier_free(dirq->tier);
+    dirq->tier = NULL;
+  }
+  if (!path)
+    return(0);
+  if (dirq->packed)
+    return(packed_unsupported(dirq, "set_tier"));
+  fast = dirq_new(path);
+  if (dirq_get_errcode(fast)) {
+    error_set(dirq, dirq_get_errcode(fast), "%s", dirq_get_errstr(fast));
+    dirq_free(fast);
+    return(-1);
+  }
+  if (stat(fast->buffer, &sb) != 0) {
+    error_set(dirq, errno, "cannot stat(%s): %s", fast->buffer, ERROR);
+    dirq_free(fast);
+    return(-1);
+  }
+  inherit_attributes(fast, dirq);
+  if (dirq->deadletter && dirq_set_deadletter(fast, dirq->deadletter->buffer,
+                                              dirq->maxattempts) != 0) {
+    error_set(dirq, dirq_get_errcode(fast), "%s", dirq_get_errstr(fast));
+    dirq_free(fast);
+    return(-1);
+  }
+  tier = (struct tier_s *)safe_malloc(sizeof(struct tier_s));
+  memset((void *)tier, 0, sizeof(struct tier_s));
+  tier->fast = fast;
+  tier->maxcount = (maxcount < 0) ? 0 : maxcount;
+  tier->maxage = (maxage < 0) ? 0 : maxage;
+  tier->dev = sb.st_dev;
+  dirq->tier = tier;
+  return(0);
+}
+
+/*
+ * dirq_get_tier(DIRQ): DIRQ | NULL
+ */
+
+dirq_t dirq_get_tier (dirq_t dirq)
+{
+  return(dirq->tier ? dirq->tier->fast : NULL);
+}
+
+/*
+ * dirq_tier_migrate(DIRQ): COUNT elements migrated | -1 error
+ */
+
+int dirq_tier_migrate (dirq_t dirq)
+{
+  struct tier_s *tier;
+  struct timespec when;
+  char name[ELEMENT_LENGTH + 1];
+  const char *next;
+  unsigned int sec, usec;
+  int count, excess, migrated, result;
+  time_t now;
+
+  tier = dirq->tier;
+  if (!tier)
+    return(0);
+  count = dirq_count(tier->fast);
+  if (count < 0)
+    return(tier_error(dirq, -1));
+  excess = tier->maxcount ? count - tier->maxcount : 0;
+  now = time(NULL);
+  migrated = 0;
+  /* the oldest elements come first */
+  for (next = dirq_first(tier->fast); next; next = dirq_next(tier->fast)) {
+    strcpy(name, next);
+    if (sscanf(name + DIR_NAME_LENGTH + 1, "%8x%5x", &sec, &usec) != 2)
+      continue;
+    if (excess <= 0 && (tier->maxage == 0 || sec + tier->maxage > now))
+      break;
+    result = dirq_lock(tier->fast, name, 1);
+    if (result < 0)
+      return(tier_error(dirq, -1));
+    if (result > 0)
+      continue;
+    when.tv_sec = sec;
+    when.tv_nsec = usec * 1000;
+    /* the oldest migrated element goes to the oldest target directory */
+    if (migrated == 0)
+      checkpoint_reset(dirq, dirq->granularity ?
+                       sec - sec % dirq->granularity : sec);
+    if (_tier_migrate(dirq, name, &when) != 0) {
+      (void) dirq_unlock(tier->fast, name, 1); /* best effort cleanup... */
+      return(-1);
+    }
+    migrated++;
+    excess--;
+  }
+  if (dirq_get_errcode(tier->fast))
+    return(tier_error(dirq, -1));
+  tier->count = count - migrated;
+  tier->counted = now;
+  return(migrated);
+}
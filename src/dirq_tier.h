@@ -0,0 +1,40 @@
+/*+*****************************************************************************
+*                                                                              *
+* C dirq tier support                                                          *
+*                                                                              *
+**-****************************************************************************/
+
+/*
+ * Author: Lionel Cons (http://cern.ch/lionel.cons)
+ * Copyright (C) CERN 2012-2024
+ */
+
+/*
+ * types
+ */
+
+struct tier_s {
+  dirq_t       fast;          /* memory backed queue (e.g. in /dev/shm) */
+  int          maxcount;      /* maximum number of elements in the tier */
+  int          maxage;        /* maximum age of the elements in the tier */
+  int          count;         /* (estimated) number of elements in the tier */
+  time_t       counted;       /* time when the elements were last counted */
+  dev_t        dev;           /* device holding the fast queue */
+  char         heads[2][32];  /* next element of each tier (iteration) */
+  char         done[2];       /* true if the tier has been fully iterated */
+};
+
+/*
+ * functions
+ */
+
+static struct tier_s *tier_copy (const struct tier_s *tier);
+static void tier_free (struct tier_s *tier);
+static int tier_error (dirq_t dirq, int result);
+static dirq_t tier_route (dirq_t dirq, const char *name);
+static int tier_accept (dirq_t dirq);
+static const char *tier_add (dirq_t dirq, dirq_iow callback);
+static const char *tier_first (dirq_t dirq, const char *key);
+static const char *tier_next (dirq_t dirq);
+static int tier_purge (dirq_t dirq);
+static int tier_expire (dirq_t dirq, const char *key);
@@ -25,6 +25,7 @@
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <utime.h>
 
 #include "dirq.h"
 
@@ -52,6 +53,8 @@ size_t BufOffset, BufLength;
  */
 
 struct option Options[] = {
+  { "async",       required_argument, 0,  0  },
+  { "bucket-size", required_argument, 0,  0  },
   { "count",       required_argument, 0, 'c' },
   { "debug",       no_argument,       0, 'd' },
   { "granularity", required_argument, 0,  0  },
@@ -61,25 +64,33 @@ struct option Options[] = {
   { "manual",      no_argument,       0, 'm' },
   { "maxlock",     required_argument, 0,  0  },
   { "maxtemp",     required_argument, 0,  0  },
+  { "order",       required_argument, 0,  0  },
   { "path",        required_argument, 0, 'p' },
+  { "prefetch",    required_argument, 0,  0  },
   { "random",      no_argument,       0, 'r' },
   { "size",        required_argument, 0,  0  },
   { "sleep",       required_argument, 0,  0  },
+  { "threads",     required_argument, 0,  0  },
   { "type",        required_argument, 0,  0  },
   { "umask",       required_argument, 0,  0  },
   { NULL,          0,                 0,  0  }
 };
 
+int     OptAsync       = 0;
+int     OptBucketSize  = 0;
 int     OptCount       = 0;
 int     OptDebug       = 0;
 int     OptGranularity = 0;
 int     OptHeader      = 0;
 int     OptMaxLock     = 0;
 int     OptMaxTemp     = 0;
+char   *OptOrder       = "fifo";
 char   *OptPath        = NULL;
+int     OptPrefetch    = 0;
 int     OptRandom      = 0;
 int     OptSize        = 0;
 double  OptSleep       = 0;
+int     OptThreads     = 0;
 char   *OptType        = "simple";
 int     OptUmask       = 0;
 
@@ -142,12 +153,24 @@ static void setup (void)
     die("queue creation failed: %s", errstr);
   if (OptGranularity)
     dirq_set_granularity(DirQ, OptGranularity);
+  if (OptBucketSize)
+    dirq_set_bucket_size(DirQ, OptBucketSize);
   if (OptMaxLock)
     dirq_set_maxlock(DirQ, OptMaxLock);
   if (OptMaxTemp)
     dirq_set_maxlock(DirQ, OptMaxTemp);
   if (OptUmask)
     dirq_set_umask(DirQ, OptUmask);
+  if (OptThreads)
+    dirq_set_purge_threads(DirQ, OptThreads);
+  if (strcmp(OptType, "packed") == 0)
+    dirq_set_type(DirQ, DIRQ_TYPE_PACKED);
+  if (strcmp(OptOrder, "none") == 0)
+    dirq_set_order(DirQ, DIRQ_ORDER_NONE);
+  else if (strcmp(OptOrder, "lifo") == 0)
+    dirq_set_order(DirQ, DIRQ_ORDER_LIFO);
+  if (OptPrefetch && dirq_set_prefetch(DirQ, OptPrefetch) != 0)
+    die("cannot set prefetch: %s", dirq_get_errstr(DirQ));
   dirq_now(DirQ, &Start);
 }
 
@@ -251,6 +274,51 @@ static void test_count (void)
   debug(1, "queue has %d elements", count);
 }
 
+/*
+ * fast count test (this creates the counter file)
+ */
+
+static void test_fast (void)
+{
+  int count;
+  const char *errstr;
+
+  setup();
+  count = dirq_count_fast(DirQ);
+  if (count < 0) {
+      errstr = dirq_get_errstr(DirQ);
+      assert(errstr != NULL);
+      die("fast counting failed: %s", errstr);
+  }
+  cleanup();
+  debug(1, "queue has about %d elements", count);
+}
+
+static void check_oldest (void)
+{
+  char oldest[64];
+  const char *name, *first;
+  int result;
+
+  if (strcmp(OptType, "packed") == 0)
+    return;
+  setup();
+  result = dirq_oldest(DirQ, &name, NULL);
+  if (result < 0)
+    die("oldest element lookup failed: %s", dirq_get_errstr(DirQ));
+  oldest[0] = '\0';
+  if (result > 0)
+    strcpy(oldest, name);
+  dirq_set_order(DirQ, DIRQ_ORDER_FIFO);
+  first = dirq_first(DirQ);
+  if (!first && dirq_get_errstr(DirQ))
+    die("iteration failed: %s", dirq_get_errstr(DirQ));
+  if (strcmp(oldest, first ? first : "") != 0)
+    die("unexpected oldest element: %s instead of %s", oldest,
+        first ? first : "none");
+  cleanup();
+}
+
 /*
  * add test
  */
@@ -300,16 +368,41 @@ static int test_add_iow (dirq_t dirq, char *buffer, size_t length)
   return(chunk);
 }
 
+static const char *add_element (dirq_t dirq, int count,
+                                const struct timespec *ts)
+{
+  const char *name;
+
+  new_element(count);
+  BufOffset = 0;
+  if (ts)
+    name = dirq_add_at(dirq, test_add_iow, ts);
+  else
+    name = dirq_add(dirq, test_add_iow);
+  if (!name)
+    die("adding failed: %s", dirq_get_errstr(dirq));
+  return(name);
+}
+
 static void test_add (void)
 {
   int i;
+  long ticket;
   const char *name, *errstr;
 
   debug(0, "adding %d elements to the queue...", OptCount);
   setup();
+  if (OptAsync && dirq_async_start(DirQ, 64, OptAsync, DIRQ_ASYNC_BLOCK) != 0)
+    die("cannot start asynchronous adds: %s", dirq_get_errstr(DirQ));
   for (i=0; i<OptCount; i++) {
     new_element(i);
     BufOffset = 0;
+    if (OptAsync) {
+      ticket = dirq_async_add(DirQ, test_add_iow);
+      if (ticket <= 0)
+        die("asynchronous adding failed: %s", dirq_get_errstr(DirQ));
+      continue;
+    }
     name = dirq_add(DirQ, test_add_iow);
     if (name == NULL) {
       errstr = dirq_get_errstr(DirQ);
@@ -319,10 +412,103 @@ static void test_add (void)
     if (OptDebug > 1)
       debug(0, "added element %s", name);
   }
+  if (OptAsync && dirq_async_flush(DirQ) != 0)
+    die("flushing failed: %s", dirq_get_errstr(DirQ));
+  if (OptAsync && dirq_async_failed(DirQ) != 0)
+    die("asynchronous adding failed");
   cleanup();
   debug(1, "added %d elements", OptCount);
 }
 
+/*
+ * delayed element check (it must not hide the elements added after it)
+ */
+
+static void check_delayed (void)
+{
+  char delayed[64], added[64];
+  const char *name;
+
+  if (strcmp(OptType, "packed") == 0)
+    return;
+  setup();
+  new_element(0);
+  BufOffset = 0;
+  name = dirq_add_delayed(DirQ, test_add_iow, 3600);
+  if (!name)
+    die("delayed adding failed: %s", dirq_get_errstr(DirQ));
+  strcpy(delayed, name);
+  new_element(1);
+  BufOffset = 0;
+  name = dirq_add(DirQ, test_add_iow);
+  if (!name)
+    die("adding failed: %s", dirq_get_errstr(DirQ));
+  strcpy(added, name);
+  name = dirq_first(DirQ);
+  if (!name || strcmp(name, added) != 0)
+    die("unexpected first element: %s instead of %s", name ? name : "none",
+        added);
+  if (!safe_lock(added) || !safe_lock(delayed))
+    die("cannot lock the added elements");
+  safe_remove(added);
+  safe_remove(delayed);
+  cleanup();
+}
+
+/*
+ * local delivery test (add+take+ack, nothing must reach the queue)
+ */
+
+static int test_get_ior (dirq_t dirq, const char *buffer, size_t length)
+{
+  UNUSED(dirq);
+  if (OptSize == 0) {
+    if (BufOffset + length > BufLength ||
+        memcmp(&Buffer[BufOffset], buffer, length) != 0)
+      die("unexpected element data");
+  }
+  BufOffset += length;
+  return(0);
+}
+
+static void test_local (void)
+{
+  int i, count;
+  const char *name, *errstr;
+
+  debug(0, "adding and taking %d local elements...", OptCount);
+  setup();
+  if (dirq_local_start(DirQ, OptCount, 3600000) != 0)
+    die("cannot start local delivery: %s", dirq_get_errstr(DirQ));
+  for (i=0; i<OptCount; i++) {
+    new_element(i);
+    BufOffset = 0;
+    if (dirq_add(DirQ, test_add_iow) == NULL)
+      die("local adding failed: %s", dirq_get_errstr(DirQ));
+  }
+  for (count=0; ; count++) {
+    /* elements are taken in order so that the expected data is known */
+    new_element(count);
+    BufOffset = 0;
+    name = dirq_local_take(DirQ, test_get_ior);
+    if (!name)
+      break;
+    if (OptSize == 0 && BufOffset != BufLength)
+      die("unexpected local element length: %d", (int) BufOffset);
+    if (OptDebug > 1)
+      debug(0, "took element %s", name);
+    if (dirq_local_ack(DirQ, name) != 0)
+      die("acknowledging failed: %s", dirq_get_errstr(DirQ));
+  }
+  errstr = dirq_get_errstr(DirQ);
+  if (errstr)
+    die("taking failed: %s", errstr);
+  cleanup();
+  if (count != OptCount)
+    die("unexpected local count: %d instead of %d", count, OptCount);
+  debug(1, "took %d elements", count);
+}
+
 /*
  * remove test
  */
@@ -459,6 +645,764 @@ static void test_purge (void)
   debug(1, "purged %d elements or directories", count);
 }
 
+/*
+ * purge step test (old empty directories are removed in budgeted steps)
+ */
+
+static int count_dirs (const char *path)
+{
+  DIR *dirp;
+  struct dirent *dp;
+  int count;
+
+  dirp = opendir(path);
+  if (!dirp)
+    die("cannot opendir(%s): %s", path, ERROR);
+  count = 0;
+  while ((dp = readdir(dirp)) != NULL)
+    if (dp->d_name[0] != '.' && strlen(dp->d_name) == 8)
+      count++;
+  if (closedir(dirp) < 0)
+    die("cannot closedir(%s): %s", path, ERROR);
+  return(count);
+}
+
+static void fill_dirs (int dirs)
+{
+  struct timespec ts;
+  int i;
+
+  /* one hour apart so that each directory holds its own elements */
+  for (i=0; i<OptCount; i++) {
+    dirq_now(DirQ, &ts);
+    ts.tv_sec -= (dirs - i % dirs) * 3600;
+    add_element(DirQ, i, &ts);
+  }
+  if (count_dirs(OptPath) != dirs)
+    die("unexpected number of directories: %d", count_dirs(OptPath));
+}
+
+static void empty_queue (void)
+{
+  const char *name;
+
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ))
+    if (safe_lock(name))
+      safe_remove(name);
+  if (dirq_get_errstr(DirQ))
+    die("iteration failed: %s", dirq_get_errstr(DirQ));
+}
+
+static void test_step (void)
+{
+  int count, steps, result;
+
+  debug(0, "purging 10 empty directories in steps...");
+  setup();
+  fill_dirs(10);
+  empty_queue();
+  for (count=steps=0; count < 9 && steps < 1000; steps++) {
+    result = dirq_purge_step(DirQ, 1);
+    if (result < 0)
+      die("purging failed: %s", dirq_get_errstr(DirQ));
+    if (result > 1)
+      die("too many removals for one step: %d", result);
+    count += result;
+  }
+  if (count != 9 || count_dirs(OptPath) != 1)
+    die("unexpected number of directories: %d", count_dirs(OptPath));
+  cleanup();
+  debug(1, "purged %d directories in %d steps", count, steps);
+  debug(0, "finished step test successfully");
+}
+
+/*
+ * maintenance test (the background thread purges old empty directories)
+ */
+
+static void test_maint (void)
+{
+  dirq_stats_t stats;
+  int i;
+
+  debug(0, "purging 10 empty directories in the background...");
+  setup();
+  if (dirq_maint_start(DirQ, 0, 0) == 0 || dirq_get_errcode(DirQ) != EINVAL)
+    die("unexpected maintenance with a null interval");
+  dirq_clear_error(DirQ);
+  fill_dirs(10);
+  empty_queue();
+  if (dirq_maint_start(DirQ, 1, OptCount) != 0)
+    die("cannot start maintenance: %s", dirq_get_errstr(DirQ));
+  for (i=0; i<100; i++) {
+    if (dirq_maint_stats(DirQ, &stats) != 0)
+      die("maintenance thread not running");
+    if (stats.passes > 0)
+      break;
+    usleep(100000);
+  }
+  dirq_maint_stop(DirQ);
+  if (stats.passes == 0 || stats.errors != 0)
+    die("unexpected maintenance: %lu passes, %lu errors", stats.passes,
+        stats.errors);
+  if (stats.purged != 9 || count_dirs(OptPath) != 1)
+    die("unexpected number of directories: %d", count_dirs(OptPath));
+  cleanup();
+  debug(1, "purged %lu directories in %lu steps", stats.purged, stats.steps);
+  debug(0, "finished maint test successfully");
+}
+
+/*
+ * expire test (old directories are dropped, locked elements are kept in the
+ * boundary one)
+ */
+
+static void test_expire (void)
+{
+  char locked[64];
+  const char *name;
+  int count;
+
+  if (OptCount % 10)
+    die("unsupported count for expire test: %d", OptCount);
+  debug(0, "expiring half of %d elements...", OptCount);
+  setup();
+  fill_dirs(10);
+  /* lock the first element of the boundary (six hours old) directory */
+  count = 0;
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ))
+    if (count++ == OptCount / 10 * 4)
+      break;
+  if (!name || !safe_lock(name))
+    die("cannot lock the boundary element");
+  strcpy(locked, name);
+  count = dirq_expire(DirQ, 5 * 3600 + 1800);
+  if (count < 0)
+    die("expiring failed: %s", dirq_get_errstr(DirQ));
+  if (count != OptCount / 2 - 1)
+    die("unexpected number of expired elements: %d", count);
+  if (dirq_count(DirQ) != OptCount / 2 + 1 || count_dirs(OptPath) != 6)
+    die("unexpected queue after expiry: %d elements in %d directories",
+        dirq_count(DirQ), count_dirs(OptPath));
+  /* the locked element must have been kept */
+  safe_remove(locked);
+  cleanup();
+  debug(1, "expired %d elements", count);
+  debug(0, "finished expire test successfully");
+}
+
+/*
+ * lanes test (strict priority then weighted round robin)
+ */
+
+static void check_lanes (const char *expected)
+{
+  char seen[16];
+  const char *name;
+  dirq_t lane;
+  int count;
+
+  count = 0;
+  for (name=dirq_lane_first(DirQ, &lane); name;
+       name=dirq_lane_next(DirQ, &lane)) {
+    if (count >= (int) sizeof(seen) - 1)
+      die("too many elements in the lanes");
+    seen[count++] = (lane == dirq_get_lane(DirQ, 0)) ? '0' : '1';
+  }
+  seen[count] = '\0';
+  if (dirq_get_errstr(DirQ))
+    die("lane iteration failed: %s", dirq_get_errstr(DirQ));
+  if (strcmp(seen, expected) != 0)
+    die("unexpected lanes order: %s instead of %s", seen, expected);
+}
+
+static void test_lanes (void)
+{
+  char path[1024];
+  int i, weights[2] = { 2, 1 };
+
+  debug(0, "serving two lanes...");
+  setup();
+  sprintf(path, "%s.dead", OptPath);
+  if (dirq_set_deadletter(DirQ, path, 3) != 0 ||
+      dirq_set_lanes(DirQ, 2, NULL) != 0)
+    die("cannot set lanes: %s", dirq_get_errstr(DirQ));
+  for (i=0; i<2; i++)
+    if (!dirq_get_deadletter(dirq_get_lane(DirQ, i)))
+      die("missing dead letter queue for lane %d", i);
+  /* the low priority lane gets the oldest elements */
+  for (i=0; i<6; i++)
+    add_element(dirq_get_lane(DirQ, i < 3 ? 1 : 0), i, NULL);
+  check_lanes("000111");
+  if (dirq_set_lanes(DirQ, 2, weights) != 0)
+    die("cannot set lanes: %s", dirq_get_errstr(DirQ));
+  check_lanes("001011");
+  cleanup();
+  debug(0, "finished lanes test successfully");
+}
+
+/*
+ * queue set test (waiting wakes up on new elements)
+ */
+
+static void test_set (void)
+{
+  char path[1024], first[64];
+  const char *name;
+  dirq_set_t set;
+  dirq_t other, dirq;
+  int count;
+
+  debug(0, "waiting for two queues...");
+  setup();
+  sprintf(path, "%s.other", OptPath);
+  other = dirq_new(path);
+  if (dirq_get_errstr(other))
+    die("queue creation failed: %s", dirq_get_errstr(other));
+  add_element(DirQ, 0, NULL);
+  add_element(DirQ, 1, NULL);
+  set = dirq_set_new();
+  /* adding a queue must not disturb its iteration */
+  strcpy(first, dirq_first(DirQ));
+  if (dirq_set_add(set, DirQ, 1) != 0 || dirq_set_add(set, other, 1) != 0)
+    die("cannot add to set: %s", dirq_set_get_errstr(set));
+  name = dirq_next(DirQ);
+  if (!name || strcmp(name, first) <= 0)
+    die("iteration disturbed by the set");
+  /* both queues are initially reported */
+  if (dirq_set_wait(set, 0) != 2)
+    die("unexpected number of ready queues");
+  count = 0;
+  for (name=dirq_set_first(set, &dirq); name;
+       name=dirq_set_next(set, &dirq)) {
+    if (dirq_lock(dirq, name, 0) != 0 || dirq_remove(dirq, name) != 0)
+      die("cannot consume %s: %s", name, dirq_get_errstr(dirq));
+    count++;
+  }
+  if (dirq_set_get_errstr(set) || count != 2)
+    die("unexpected set iteration: %d elements", count);
+  /* then only the ones with new elements */
+  if (dirq_set_wait(set, 100) != 0)
+    die("unexpected ready queues");
+  add_element(other, 2, NULL);
+  if (dirq_set_wait(set, 100) != 1)
+    die("new element not notified");
+  name = dirq_set_first(set, &dirq);
+  if (!name || dirq != other)
+    die("unexpected set element: %s", name ? name : "none");
+  dirq_set_free(set);
+  dirq_free(other);
+  cleanup();
+  debug(0, "finished set test successfully");
+}
+
+/*
+ * fan-out test (the queues share the element files)
+ */
+
+static void test_fanout (void)
+{
+  char path[1024];
+  const char *names[3];
+  dirq_t dirqs[3];
+  struct stat sb;
+  ino_t inode;
+  int i, j;
+
+  debug(0, "adding %d elements to 3 queues...", OptCount);
+  setup();
+  dirqs[0] = DirQ;
+  for (i=1; i<3; i++) {
+    sprintf(path, "%s.fanout%d", OptPath, i);
+    dirqs[i] = dirq_new(path);
+    if (dirq_get_errstr(dirqs[i]))
+      die("queue creation failed: %s", dirq_get_errstr(dirqs[i]));
+  }
+  for (i=0; i<OptCount; i++) {
+    new_element(i);
+    BufOffset = 0;
+    if (dirq_add_fanout(dirqs, 3, test_add_iow, names) != 0) {
+      for (j=0; j<3 && !dirq_get_errstr(dirqs[j]); j++)
+        ;
+      die("fan-out adding failed: %s",
+          j < 3 ? dirq_get_errstr(dirqs[j]) : "unknown error");
+    }
+    inode = 0;
+    for (j=0; j<3; j++) {
+      sprintf(path, "%s/%s", dirq_get_path(dirqs[j], NULL), names[j]);
+      if (stat(path, &sb) != 0)
+        die("cannot stat(%s): %s", path, ERROR);
+      if (sb.st_nlink != 3 || (inode && sb.st_ino != inode))
+        die("element not shared: %s", path);
+      inode = sb.st_ino;
+    }
+  }
+  /* removing the elements from one queue leaves the others untouched */
+  empty_queue();
+  for (i=0; i<3; i++)
+    if (dirq_count(dirqs[i]) != (i ? OptCount : 0))
+      die("unexpected count for queue %d: %d", i, dirq_count(dirqs[i]));
+  for (i=1; i<3; i++)
+    dirq_free(dirqs[i]);
+  cleanup();
+  debug(0, "finished fanout test successfully");
+}
+
+/*
+ * move test (elements and their metadata are moved to another queue, one by
+ * one and in batches)
+ */
+
+static void move_batch (dirq_t dst, const char **names, int count)
+{
+  if (dirq_move_batch(DirQ, dst, names, count) != count)
+    die("moving failed: %s", dirq_get_errstr(DirQ) ? dirq_get_errstr(DirQ)
+        : dirq_get_errstr(dst));
+}
+
+static void test_move (void)
+{
+  char path[1024], index[16], batch[16][64];
+  const char *meta[3], *names[16], *name, *value;
+  dirq_t dst;
+  int i, count;
+
+  debug(0, "moving %d elements to another queue...", OptCount);
+  setup();
+  sprintf(path, "%s.moved", OptPath);
+  dst = dirq_new(path);
+  if (dirq_get_errstr(dst))
+    die("queue creation failed: %s", dirq_get_errstr(dst));
+  meta[0] = "index";
+  meta[1] = index;
+  meta[2] = NULL;
+  for (i=0; i<OptCount; i++) {
+    new_element(i);
+    BufOffset = 0;
+    sprintf(index, "%d", i);
+    if (!dirq_add_meta(DirQ, test_add_iow, meta))
+      die("adding failed: %s", dirq_get_errstr(DirQ));
+  }
+  i = count = 0;
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ)) {
+    if (!safe_lock(name))
+      continue;
+    if (i++ % 2 == 0) {
+      if (!dirq_move(DirQ, dst, name))
+        die("moving failed: %s", dirq_get_errstr(DirQ) ?
+            dirq_get_errstr(DirQ) : dirq_get_errstr(dst));
+      continue;
+    }
+    strcpy(batch[count], name);
+    names[count] = batch[count];
+    if (++count == 16) {
+      move_batch(dst, names, count);
+      count = 0;
+    }
+  }
+  if (count > 0)
+    move_batch(dst, names, count);
+  if (dirq_count(DirQ) != 0 || dirq_count(dst) != OptCount)
+    die("unexpected counts after moving: %d and %d", dirq_count(DirQ),
+        dirq_count(dst));
+  /* the moved elements are unlocked and keep their data and metadata */
+  count = 0;
+  for (name=dirq_first(dst); name; name=dirq_next(dst)) {
+    if (dirq_lock(dst, name, 0) != 0)
+      die("locking failed: %s", dirq_get_errstr(dst));
+    value = dirq_get_meta(dst, name, "index");
+    if (!value)
+      die("missing metadata: %s", name);
+    new_element(atoi(value));
+    BufOffset = 0;
+    if (dirq_get(dst, name, test_get_ior) != 0)
+      die("getting failed: %s", dirq_get_errstr(dst));
+    if (OptSize == 0 && BufOffset != BufLength)
+      die("unexpected element length: %d", (int) BufOffset);
+    count++;
+  }
+  if (count != OptCount)
+    die("unexpected number of moved elements: %d", count);
+  dirq_free(dst);
+  cleanup();
+  debug(1, "moved %d elements", count);
+  debug(0, "finished move test successfully");
+}
+
+/*
+ * dead letter test (elements locked too many times are moved aside, by
+ * dirq_lock() or when purging their stale lock)
+ */
+
+static void lock_attempts (const char *name, int count)
+{
+  int i;
+
+  for (i=0; i<count; i++) {
+    if (!safe_lock(name))
+      die("cannot lock %s", name);
+    if (i < count - 1)
+      safe_unlock(name);
+  }
+}
+
+static void test_deadletter (void)
+{
+  char path[1024], name[64];
+  struct utimbuf times;
+  dirq_t dead;
+  FILE *fp;
+
+  debug(0, "moving poison elements to the dead letter queue...");
+  setup();
+  sprintf(path, "%s.dead", OptPath);
+  if (dirq_set_deadletter(DirQ, path, 3) != 0)
+    die("cannot set dead letter queue: %s", dirq_get_errstr(DirQ));
+  dead = dirq_get_deadletter(DirQ);
+  /* too many locks */
+  strcpy(name, add_element(DirQ, 0, NULL));
+  lock_attempts(name, 3);
+  safe_unlock(name);
+  if (dirq_lock(DirQ, name, 0) == 0 || dirq_get_errcode(DirQ) != ENOENT)
+    die("element not moved to the dead letter queue: %s", name);
+  dirq_clear_error(DirQ);
+  if (dirq_count(DirQ) != 0 || dirq_count(dead) != 1)
+    die("unexpected counts: %d and %d", dirq_count(DirQ), dirq_count(dead));
+  /* stale lock of the last attempt (the lock is a hard link to the element) */
+  strcpy(name, add_element(DirQ, 1, NULL));
+  lock_attempts(name, 3);
+  sprintf(path, "%s/%s", dirq_get_path(DirQ, NULL), name);
+  times.actime = times.modtime = time(NULL) - 2 * dirq_get_maxlock(DirQ);
+  if (utime(path, &times) != 0)
+    die("cannot utime(%s): %s", path, ERROR);
+  if (dirq_purge(DirQ) < 0)
+    die("purging failed: %s", dirq_get_errstr(DirQ));
+  if (dirq_count(DirQ) != 0 || dirq_count(dead) != 2)
+    die("unexpected counts: %d and %d", dirq_count(DirQ), dirq_count(dead));
+  /* failed move (the dead letter queue is not a directory anymore) */
+  strcpy(name, add_element(DirQ, 2, NULL));
+  lock_attempts(name, 3);
+  safe_unlock(name);
+  sprintf(path, "%s.dead", OptPath);
+  sprintf(Buffer, "%s.moved", path);
+  if (rename(path, Buffer) != 0 || (fp = fopen(path, "w")) == NULL ||
+      fclose(fp) != 0)
+    die("cannot replace %s: %s", path, ERROR);
+  if (dirq_lock(DirQ, name, 1) >= 0)
+    die("unexpected move to the dead letter queue: %s", name);
+  if (access(dirq_get_path(DirQ, name), F_OK) == 0)
+    die("lock left behind: %s", dirq_get_path(DirQ, name));
+  dirq_clear_error(DirQ);
+  if (unlink(path) != 0 || rename(Buffer, path) != 0)
+    die("cannot restore %s: %s", path, ERROR);
+  cleanup();
+  debug(0, "finished deadletter test successfully");
+}
+
+/*
+ * filter test (only the elements with the given metadata are seen)
+ */
+
+static int count_elements (void)
+{
+  const char *name;
+  int count;
+
+  count = 0;
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ))
+    count++;
+  if (dirq_get_errstr(DirQ))
+    die("iteration failed: %s", dirq_get_errstr(DirQ));
+  return(count);
+}
+
+static void test_filter (void)
+{
+  const char *meta[3], *name, *value;
+  int i, count;
+
+  debug(0, "filtering %d elements...", OptCount);
+  setup();
+  meta[0] = "color";
+  meta[2] = NULL;
+  for (i=0; i<OptCount; i++) {
+    new_element(i);
+    BufOffset = 0;
+    meta[1] = (i % 2) ? "blue" : "red";
+    if (!dirq_add_meta(DirQ, test_add_iow, meta))
+      die("adding failed: %s", dirq_get_errstr(DirQ));
+  }
+  dirq_set_filter(DirQ, "color", "red");
+  count = 0;
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ)) {
+    value = dirq_get_meta(DirQ, name, "color");
+    if (!value || strcmp(value, "red") != 0)
+      die("unexpected metadata: %s", value ? value : "none");
+    count++;
+  }
+  if (dirq_get_errstr(DirQ) || count != (OptCount + 1) / 2)
+    die("unexpected number of filtered elements: %d", count);
+  dirq_set_filter(DirQ, "color", "green");
+  if (count_elements() != 0)
+    die("unexpected elements with an unknown value");
+  dirq_set_filter(DirQ, NULL, NULL);
+  if (count_elements() != OptCount)
+    die("unexpected number of unfiltered elements");
+  cleanup();
+  debug(1, "filtered %d elements", count);
+  debug(0, "finished filter test successfully");
+}
+
+/*
+ * tier test (merged iteration, migration, routing and dead letter queue)
+ */
+
+static void set_tier (const char *path, int maxcount)
+{
+  if (dirq_set_tier(DirQ, path, maxcount, 0) != 0)
+    die("cannot set tier: %s", dirq_get_errstr(DirQ));
+}
+
+static void test_tier (void)
+{
+  char path[1024], dead[1024];
+  struct utimbuf times;
+  const char *name;
+  int i, count;
+
+  debug(0, "using a fast tier...");
+  setup();
+  sprintf(path, "%s.fast", OptPath);
+  sprintf(dead, "%s.dead", OptPath);
+  /* the first ten elements go to the tier, the other ten to the queue */
+  set_tier(path, 10);
+  if (dirq_set_deadletter(DirQ, dead, 1) != 0)
+    die("cannot set dead letter queue: %s", dirq_get_errstr(DirQ));
+  for (i=0; i<20; i++)
+    add_element(DirQ, i, NULL);
+  if (dirq_count(dirq_get_tier(DirQ)) != 10)
+    die("unexpected tier count: %d", dirq_count(dirq_get_tier(DirQ)));
+  /* the oldest five are migrated to the queue */
+  set_tier(path, 5);
+  if (!dirq_get_deadletter(dirq_get_tier(DirQ)))
+    die("missing dead letter queue for the tier");
+  if (dirq_tier_migrate(DirQ) != 5)
+    die("unexpected migration: %s", dirq_get_errstr(DirQ));
+  /* the merged iteration gives them in insertion order, even when adding */
+  set_tier(path, 20);
+  count = 0;
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ)) {
+    if (!safe_lock(name))
+      die("cannot lock %s", name);
+    new_element(count);
+    BufOffset = 0;
+    if (dirq_get(DirQ, name, test_get_ior) != 0)
+      die("getting failed: %s", dirq_get_errstr(DirQ));
+    if (OptSize == 0 && BufOffset != BufLength)
+      die("unexpected element %d: %s", count, name);
+    safe_remove(name);
+    if (count++ == 0)
+      add_element(DirQ, 20, NULL);
+  }
+  if (dirq_get_errstr(DirQ))
+    die("iteration failed: %s", dirq_get_errstr(DirQ));
+  if (count < 20)
+    die("unexpected number of merged elements: %d", count);
+  empty_queue();
+  /* poison elements of the tier go to the dead letter queue too */
+  strcpy(path, add_element(DirQ, 0, NULL));
+  lock_attempts(path, 1);
+  safe_unlock(path);
+  if (dirq_lock(DirQ, path, 1) != 1)
+    die("element not moved to the dead letter queue: %s", path);
+  strcpy(path, add_element(DirQ, 1, NULL));
+  lock_attempts(path, 1);
+  sprintf(Buffer, "%s/%s", dirq_get_path(dirq_get_tier(DirQ), NULL), path);
+  times.actime = times.modtime = time(NULL) - 2 * dirq_get_maxlock(DirQ);
+  if (utime(Buffer, &times) != 0)
+    die("cannot utime(%s): %s", Buffer, ERROR);
+  if (dirq_purge_step(DirQ, 1) < 0)
+    die("purging failed: %s", dirq_get_errstr(DirQ));
+  if (dirq_count(dirq_get_tier(DirQ)) != 0 ||
+      dirq_count(dirq_get_deadletter(DirQ)) != 2)
+    die("unexpected dead letter queue count: %d",
+        dirq_count(dirq_get_deadletter(DirQ)));
+  cleanup();
+  debug(1, "merged %d elements", count);
+  debug(0, "finished tier test successfully");
+}
+
+/*
+ * watermarks test
+ */
+
+static void check_full (int errcode)
+{
+  new_element(0);
+  BufOffset = 0;
+  if (dirq_add(DirQ, test_add_iow))
+    die("element added to a full queue");
+  if (dirq_get_errcode(DirQ) != errcode)
+    die("unexpected full queue error: %s", dirq_get_errstr(DirQ));
+  dirq_clear_error(DirQ);
+}
+
+static void test_watermarks (void)
+{
+  const char *name;
+  int i;
+
+  debug(0, "filling the queue up to its watermarks...");
+  setup();
+  if (dirq_set_watermarks(DirQ, 5, 2, 0, 0) != 0 ||
+      dirq_set_full_policy(DirQ, DIRQ_FULL_FAIL, 0) != 0)
+    die("cannot set watermarks: %s", dirq_get_errstr(DirQ));
+  for (i=0; i<5; i++)
+    add_element(DirQ, i, NULL);
+  check_full(EDQUOT);
+  /* the queue stays full until it drains down to the low watermark */
+  for (i=0; i<3; i++) {
+    name = dirq_first(DirQ);
+    if (!name || !safe_lock(name))
+      die("cannot lock element %d", i);
+    safe_remove(name);
+    if (i < 2)
+      check_full(EDQUOT);
+  }
+  add_element(DirQ, 5, NULL);
+  add_element(DirQ, 6, NULL);
+  add_element(DirQ, 7, NULL);
+  /* shed elements are not added, blocked ones give up after the timeout */
+  if (dirq_set_full_policy(DirQ, DIRQ_FULL_SHED, 0) != 0)
+    die("cannot set full policy: %s", dirq_get_errstr(DirQ));
+  check_full(ECANCELED);
+  if (dirq_set_full_policy(DirQ, DIRQ_FULL_BLOCK, 10) != 0)
+    die("cannot set full policy: %s", dirq_get_errstr(DirQ));
+  check_full(ETIMEDOUT);
+  if (dirq_count(DirQ) != 5)
+    die("unexpected count: %d", dirq_count(DirQ));
+  cleanup();
+  debug(0, "finished watermarks test successfully");
+}
+
+/*
+ * checkpoint test (stragglers are only found by full iterations)
+ */
+
+static void set_checkpoint (int recheck)
+{
+  if (dirq_set_checkpoint(DirQ, "dqt", recheck) != 0)
+    die("cannot set checkpoint: %s", dirq_get_errstr(DirQ));
+}
+
+static void test_checkpoint (void)
+{
+  char straggler[1024];
+  struct stat sb;
+  dirq_t other;
+  int count;
+
+  debug(0, "consuming %d elements with a checkpoint...", OptCount);
+  setup();
+  if (dirq_set_checkpoint(DirQ, "dqt/..", 1) == 0 ||
+      dirq_set_checkpoint(DirQ, "dqt", 0) == 0)
+    die("unexpected checkpoint with invalid arguments");
+  dirq_clear_error(DirQ);
+  fill_dirs(10);
+  set_checkpoint(3600);
+  /* the oldest element is locked by another consumer meanwhile */
+  other = dirq_copy(DirQ);
+  strcpy(straggler, dirq_first(DirQ));
+  if (dirq_lock(other, straggler, 0) != 0)
+    die("cannot lock %s: %s", straggler, dirq_get_errstr(other));
+  empty_queue();
+  if (dirq_unlock(other, straggler, 0) != 0)
+    die("cannot unlock %s: %s", straggler, dirq_get_errstr(other));
+  dirq_free(other);
+  sprintf(Buffer, "%s/.checkpoint.dqt", OptPath);
+  if (stat(Buffer, &sb) != 0 || sb.st_size == 0)
+    die("checkpoint not recorded in %s", Buffer);
+  /* new elements are found, even after a restart, but not the straggler */
+  add_element(DirQ, OptCount, NULL);
+  cleanup();
+  setup();
+  set_checkpoint(3600);
+  count = count_elements();
+  if (count != 1)
+    die("unexpected number of elements after the checkpoint: %d", count);
+  /* until the next full iteration */
+  set_checkpoint(1);
+  sleep(1);
+  count = count_elements();
+  if (count != 2)
+    die("straggler not found by a full iteration: %d elements", count);
+  cleanup();
+  debug(0, "finished checkpoint test successfully");
+}
+
+/*
+ * compact test
+ */
+
+static char *list_elements (int *count)
+{
+  const char *name;
+  char *list;
+  size_t length, size;
+
+  list = NULL;
+  length = 0;
+  *count = 0;
+  for (name=dirq_first(DirQ); name; name=dirq_next(DirQ)) {
+    name = strrchr(name, '/') + 1;
+    size = strlen(name);
+    list = realloc(list, length + size + 2);
+    if (!list)
+      die("cannot realloc(): %s", strerror(errno));
+    sprintf(list + length, "%s\n", name);
+    length += size + 1;
+    (*count)++;
+  }
+  if (dirq_get_errstr(DirQ))
+    die("iteration failed: %s", dirq_get_errstr(DirQ));
+  return(list ? list : strdup(""));
+}
+
+static void test_compact (void)
+{
+  int count, before, after;
+  const char *errstr;
+  char *list, *check;
+
+  setup();
+  list = NULL;
+  if (OptCount) {
+    /* two elements per directory, to be merged around the bucket size */
+    debug(0, "compacting %d elements...", OptCount);
+    fill_dirs(OptCount / 2);
+    list = list_elements(&before);
+  }
+  count = dirq_compact(DirQ, 0);
+  if (count < 0) {
+      errstr = dirq_get_errstr(DirQ);
+      assert(errstr != NULL);
+      die("compacting failed: %s", errstr);
+  }
+  if (list) {
+    if (count == 0 || count_dirs(OptPath) >= OptCount / 2)
+      die("nothing compacted: %d elements moved", count);
+    check = list_elements(&after);
+    if (strcmp(list, check) != 0 || after != before)
+      die("compaction changed the iteration: %d elements instead of %d",
+          after, before);
+    free(check);
+    free(list);
+    debug(0, "finished compact test successfully");
+  }
+  cleanup();
+  debug(1, "moved %d elements", count);
+}
+
 /*
  * simple meta-test (only for non=existing path!)
  */
@@ -480,8 +1424,11 @@ static void test_simple (void)
     die("cannot use existing path for simple test: %s", OptPath);
   }
   test_info();
+  test_local();
+  check_delayed();
   test_add();
   test_count();
+  check_oldest();
   test_size();
   test_purge();
   test_iterate(DO_GET);
@@ -571,7 +1518,9 @@ int main(int argc, char *argv[])
       break;
     case 'l':
       printf("Available tests: %s\n",
-             "add count get info iterate purge remove simple size");
+             "add checkpoint compact count deadletter expire fanout fast"
+             " filter get info iterate lanes local maint move purge remove"
+             " set simple size step tier watermarks");
       exit(0);
       break;
     case 'p':
@@ -581,7 +1530,11 @@ int main(int argc, char *argv[])
       OptRandom++;
       break;
     case 0:
-      if (strcmp(Options[opti].name, "granularity") == 0)
+      if (strcmp(Options[opti].name, "async") == 0)
+        OptAsync = atoi(optarg);
+      else if (strcmp(Options[opti].name, "bucket-size") == 0)
+        OptBucketSize = atoi(optarg);
+      else if (strcmp(Options[opti].name, "granularity") == 0)
         OptGranularity = atoi(optarg);
       else if (strcmp(Options[opti].name, "header") == 0)
         OptHeader++;
@@ -589,10 +1542,16 @@ int main(int argc, char *argv[])
         OptMaxLock = atoi(optarg);
       else if (strcmp(Options[opti].name, "maxtemp") == 0)
         OptMaxTemp = atoi(optarg);
+      else if (strcmp(Options[opti].name, "order") == 0)
+        OptOrder = optarg;
+      else if (strcmp(Options[opti].name, "prefetch") == 0)
+        OptPrefetch = atoi(optarg);
       else if (strcmp(Options[opti].name, "size") == 0)
         OptSize = atoi(optarg);
       else if (strcmp(Options[opti].name, "sleep") == 0)
         OptSleep = atof(optarg);
+      else if (strcmp(Options[opti].name, "threads") == 0)
+        OptThreads = atoi(optarg);
       else if (strcmp(Options[opti].name, "type") == 0)
         OptType = optarg;
       else if (strcmp(Options[opti].name, "umask") == 0)
@@ -604,7 +1563,7 @@ int main(int argc, char *argv[])
       usage(1);
     }
   }
-  if (strcmp(OptType, "simple") != 0)
+  if (strcmp(OptType, "simple") != 0 && strcmp(OptType, "packed") != 0)
     die("unsupported dirq type: %s", OptType);
   if (optind + 1 != argc)
     usage(1);
@@ -624,14 +1583,36 @@ int main(int argc, char *argv[])
     usleep(OptSleep * 1e6);
   if (strcmp(argv[optind], "add") == 0) {
     test_add();
+  } else if (strcmp(argv[optind], "checkpoint") == 0) {
+    test_checkpoint();
+  } else if (strcmp(argv[optind], "compact") == 0) {
+    test_compact();
   } else if (strcmp(argv[optind], "count") == 0) {
     test_count();
+  } else if (strcmp(argv[optind], "deadletter") == 0) {
+    test_deadletter();
+  } else if (strcmp(argv[optind], "expire") == 0) {
+    test_expire();
+  } else if (strcmp(argv[optind], "fanout") == 0) {
+    test_fanout();
+  } else if (strcmp(argv[optind], "fast") == 0) {
+    test_fast();
+  } else if (strcmp(argv[optind], "filter") == 0) {
+    test_filter();
   } else if (strcmp(argv[optind], "get") == 0) {
     test_iterate(DO_GET);
   } else if (strcmp(argv[optind], "info") == 0) {
     test_info();
   } else if (strcmp(argv[optind], "iterate") == 0) {
     test_iterate(DO_ITERATE);
+  } else if (strcmp(argv[optind], "lanes") == 0) {
+    test_lanes();
+  } else if (strcmp(argv[optind], "local") == 0) {
+    test_local();
+  } else if (strcmp(argv[optind], "maint") == 0) {
+    test_maint();
+  } else if (strcmp(argv[optind], "move") == 0) {
+    test_move();
   } else if (strcmp(argv[optind], "purge") == 0) {
     test_purge();
   } else if (strcmp(argv[optind], "remove") == 0) {
@@ -639,10 +1620,18 @@ int main(int argc, char *argv[])
       test_iterate(DO_REMOVE);
     else
       test_remove();
+  } else if (strcmp(argv[optind], "set") == 0) {
+    test_set();
   } else if (strcmp(argv[optind], "simple") == 0) {
     test_simple();
   } else if (strcmp(argv[optind], "size") == 0) {
     test_size();
+  } else if (strcmp(argv[optind], "step") == 0) {
+    test_step();
+  } else if (strcmp(argv[optind], "tier") == 0) {
+    test_tier();
+  } else if (strcmp(argv[optind], "watermarks") == 0) {
+    test_watermarks();
   } else {
     die("unknown test: %s", argv[optind]);
   }